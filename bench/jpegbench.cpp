@@ -0,0 +1,415 @@
+/*
+jpegbench.cpp
+Throughput of each encoder stage, and of whole encodes, over a synthetic
+corpus of flat, gradient, noise, photo-like and scanned text images
+
+Prints CSV with a header line and one row per image, size, sampling and stage:
+image,width,height,sampling,stage,mpix_per_s,bytes_per_pixel
+
+Stages, each run on the output of the one before:
+color: RGB to Y, Cb and Cr planes (a copy for gray)
+downsample: planes to level shifted blocks at each component's sampling
+dct: forward DCT of every block
+quantize: quantizing and zigzagging every block
+delta: DC differences and run/size symbols of every block, as counted
+for optimal Huffman codes
+delta-planes: delta with the blocks kept in one plane per component
+rather than MCU by MCU, still visited in scan order
+entropy: Huffman coding the whole scan with the default tables
+headers: SOI up to SOS
+total: Jpeg::encode and Jpeg::write together
+mpix_per_s counts the pixels of the image for every stage; bytes_per_pixel
+is that of the stage's output, 0 for stages that write nothing.
+Each figure is the fastest of as many runs as fit in the time given.
+
+Options:
+-t seconds: least time spent on each figure, 0.05 by default
+-q quality: 75 by default
+-s WxH: image size, may be repeated, replacing the default sizes
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <getopt.h>
+#include "jpegutil.hpp"
+#include "jpeginternal.hpp"
+
+#define NUM_IMAGES 5
+#define NUM_SAMPLINGS 4
+
+const char *imageNames[NUM_IMAGES] = {"flat", "gradient", "noise", "photo", "text"};
+const char *samplingNames[NUM_SAMPLINGS] = {"444", "422", "420", "gray"};
+
+/*
+Fixed size output that bytes go straight into, emptied between runs
+*/
+class ArrayBuffer : public std::streambuf {
+    private:
+        std::vector<char> data;
+    public:
+        ArrayBuffer(size_t capacity) :
+            data(capacity)
+        {
+            clear();
+        }
+
+        void clear()
+        {
+            setp(data.data(), data.data() + data.size());
+        }
+
+        size_t size() const
+        {
+            return pptr() - pbase();
+        }
+};
+
+/*
+Pseudo random bytes, the same on every platform
+*/
+struct Lcg {
+    std::uint32_t state;
+    std::uint8_t next()
+    {
+        state = state * 1664525u + 1013904223u;
+        return state >> 24;
+    }
+};
+
+std::uint8_t clampByte(float value)
+{
+    return (std::uint8_t)std::min(255.0f, std::max(0.0f, std::round(value)));
+}
+
+/*
+RGB pixels of corpus image kind
+photo: soft shading, a shaded disc, a striped rectangle and a little noise
+text: lines of dark strokes on slightly noisy paper, as a scanned page
+*/
+std::vector<std::uint8_t> makeImage(int kind, size_t width, size_t height)
+{
+    std::vector<std::uint8_t> rgb(width * height * 3);
+    Lcg lcg {12345};
+    const float pi = 3.14159265f;
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++) {
+            std::uint8_t *pixel = &rgb[(y * width + x) * 3];
+            float fx = (float)x / width, fy = (float)y / height;
+            if (kind == 0) {
+                pixel[0] = 120;
+                pixel[1] = 130;
+                pixel[2] = 140;
+            }
+            else if (kind == 1) {
+                pixel[0] = clampByte(255 * fx);
+                pixel[1] = clampByte(255 * fy);
+                pixel[2] = clampByte(255 * (1 - fx) * (1 - fy));
+            }
+            else if (kind == 2) {
+                for (int c = 0; c < 3; c++) {
+                    pixel[c] = lcg.next();
+                }
+            }
+            else if (kind == 3) {
+                float shade = 110 + 50 * std::cos(2 * pi * (1.3f * fx + 0.4f * fy)) * std::cos(2 * pi * 0.7f * fy);
+                float color[3] = {shade + 20, shade, shade - 25};
+                float dx = fx - 0.3f, dy = fy - 0.4f;
+                if (dx * dx + dy * dy < 0.04f) {
+                    float light = 1 - 3 * (dx * dx + dy * dy);
+                    color[0] = 210 * light;
+                    color[1] = 90 * light;
+                    color[2] = 60 * light;
+                }
+                else if (fx > 0.55f && fx < 0.9f && fy > 0.2f && fy < 0.7f) {
+                    float stripe = (x / 3 + y / 5) % 2 == 0 ? 40 : -40;
+                    color[0] = 90 + stripe;
+                    color[1] = 150 + stripe;
+                    color[2] = 100 + stripe;
+                }
+                for (int c = 0; c < 3; c++) {
+                    pixel[c] = clampByte(color[c] + (lcg.next() % 13) - 6);
+                }
+            }
+            else {
+                bool margin = fx < 0.08f || fx > 0.92f || fy < 0.06f || fy > 0.94f;
+                bool line = y % 40 < 24 && (x / 60) % 7 != 6;
+                bool ink = !margin && line && (x / 2 * 7 + y % 40 * 3) % 11 < 3;
+                std::uint8_t value = (ink ? 35 : 232) + lcg.next() % 9;
+                for (int c = 0; c < 3; c++) {
+                    pixel[c] = value;
+                }
+            }
+        }
+    }
+    return rgb;
+}
+
+std::vector<Jpeg::JpegComponent> makeComponents(int sampling)
+{
+    if (sampling == 3) {
+        return Jpeg::grayscaleComponents;
+    }
+    std::pair<int, int> luma[3] = {{1, 1}, {2, 1}, {2, 2}};
+    return std::vector<Jpeg::JpegComponent> {
+        Jpeg::JpegComponent(luma[sampling], 0, 0, 0),
+        Jpeg::JpegComponent(std::pair<int, int>(1, 1), 1, 1, 1),
+        Jpeg::JpegComponent(std::pair<int, int>(1, 1), 1, 1, 1)
+    };
+}
+
+/*
+Seconds of the fastest run of stage, run until minSeconds have been spent
+prepare: called before each run, untimed
+*/
+template <typename Prepare, typename Stage>
+double fastest(double minSeconds, const Prepare& prepare, const Stage& stage)
+{
+    double best = INFINITY;
+    double total = 0;
+    do {
+        prepare();
+        auto start = std::chrono::steady_clock::now();
+        stage();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        best = std::min(best, seconds);
+        total += seconds;
+    } while (total < minSeconds);
+    return best;
+}
+
+void benchImage(const std::string& label, const std::vector<std::uint8_t>& rgb,
+    size_t width, size_t height, int sampling, int quality, double minSeconds)
+{
+    std::vector<Jpeg::JpegComponent> components = makeComponents(sampling);
+    Jpeg::JpegSettings settings(std::pair<int, int>(width, height), &components,
+        Jpeg::DPI, {72, 72}, quality, Jpeg::flagHuffmanDefault);
+    Jpeg::Jpeg jpeg(settings);
+    bool gray = components.size() == 1;
+    std::vector<std::uint8_t> grayPixels;
+    if (gray) {
+        grayPixels.resize(width * height);
+        for (size_t i = 0; i < width * height; i++) {
+            grayPixels[i] = Jpeg::ycbcrFromRGB(&rgb[i * 3], 0);
+        }
+    }
+    Jpeg::JpegPixels pixels(gray ? grayPixels.data() : rgb.data(), gray ? Jpeg::PIXEL_GRAY : Jpeg::PIXEL_RGB);
+    size_t pixelBytes = Jpeg::pixelBytes(pixels.format);
+    ArrayBuffer out(width * height * 8 + (1 << 20));
+    std::ostream stream(&out);
+
+    double numPixels = (double)width * height;
+    auto report = [&](const char *stage, double seconds, size_t bytes) {
+        std::cout << label << ',' << samplingNames[sampling] << ',' << stage << ',' <<
+            std::fixed << std::setprecision(2) << numPixels / seconds / 1e6 << ',' <<
+            std::setprecision(4) << bytes / numPixels << std::endl;
+    };
+
+    /* Run first as it leaves the tables in jpeg for the entropy and headers stages */
+    double totalSeconds = fastest(minSeconds, [&]() { out.clear(); }, [&]() {
+        jpeg.encode(pixels);
+        jpeg.write(stream);
+    });
+    size_t totalBytes = out.size();
+    const Jpeg::JpegSettings& used = jpeg.settings;
+
+    size_t mcuWidth = used.mcuScale.first * JPEG_BLOCK_ROW;
+    size_t mcuHeight = used.mcuScale.second * JPEG_BLOCK_ROW;
+    size_t planeWidth = mcuWidth * used.numMcus.first;
+    size_t planeSize = planeWidth * mcuHeight * used.numMcus.second;
+    std::vector<std::uint8_t> planes(3 * planeSize);
+    report("color", fastest(minSeconds, []() {}, [&]() {
+        for (size_t y = 0; y < height; y++) {
+            size_t row = y * planeWidth;
+            Jpeg::convertRow(pixels.format, pixels.data + y * width * pixelBytes, width,
+                &planes[row], &planes[planeSize + row], &planes[2 * planeSize + row]);
+        }
+    }), 0);
+    /* Repeat the last column and row past the edge, as the encoder does */
+    for (size_t iPlane = 0; iPlane < 3; iPlane++) {
+        std::uint8_t *plane = &planes[iPlane * planeSize];
+        for (size_t y = 0; y < planeSize / planeWidth; y++) {
+            std::uint8_t *row = plane + y * planeWidth;
+            if (y >= height) {
+                std::copy(row - planeWidth, row, row);
+            }
+            std::fill(row + width, row + planeWidth, row[width - 1]);
+        }
+    }
+
+    size_t numMcus = used.numMcus.first * used.numMcus.second;
+    size_t numBlocks = numMcus * used.mcuSize;
+    std::vector<float> spatialStore(numBlocks * JPEG_BLOCK_SIZE), dctStore(numBlocks * JPEG_BLOCK_SIZE);
+    float (*spatial)[JPEG_BLOCK_SIZE] = reinterpret_cast<float (*)[JPEG_BLOCK_SIZE]>(spatialStore.data());
+    float (*dct)[JPEG_BLOCK_SIZE] = reinterpret_cast<float (*)[JPEG_BLOCK_SIZE]>(dctStore.data());
+    int levelShift = 1 << (used.bitDepth - 1);
+    Jpeg::BlockifyKernel kernels[JPEG_MAX_COMPONENTS];
+    for (size_t iComp = 0; iComp < used.components.size(); iComp++) {
+        kernels[iComp] = Jpeg::blockifyKernel(used.components[iComp].sampling.first,
+            used.components[iComp].sampling.second, used.mcuScale.first, used.mcuScale.second);
+    }
+    report("downsample", fastest(minSeconds, []() {}, [&]() {
+        for (size_t iMcu = 0; iMcu < numMcus; iMcu++) {
+            size_t xMcu = iMcu % used.numMcus.first, yMcu = iMcu / used.numMcus.first;
+            for (size_t iComp = 0; iComp < used.components.size(); iComp++) {
+                const Jpeg::JpegComponent& comp = used.components[iComp];
+                const std::uint8_t *plane = &planes[std::min(iComp, size_t{2}) * planeSize];
+                kernels[iComp](plane + yMcu * mcuHeight * planeWidth + xMcu * mcuWidth, planeWidth,
+                    comp.sampling.first, comp.sampling.second, used.mcuScale.first, used.mcuScale.second,
+                    levelShift, spatial + iMcu * used.mcuSize + used.componentOffsets[iComp]);
+            }
+        }
+    }), 0);
+
+    report("dct", fastest(minSeconds, [&]() {
+        std::copy(spatialStore.begin(), spatialStore.end(), dctStore.begin());
+    }, [&]() {
+        Jpeg::forwardDct(dct, numBlocks);
+    }), 0);
+
+    /* quantizeCoefficients takes them zigzagged, as kept coefficients are */
+    for (size_t iBlock = 0; iBlock < numBlocks; iBlock++) {
+        for (size_t i = 0; i < JPEG_BLOCK_SIZE; i++) {
+            spatial[iBlock][i] = dct[iBlock][Jpeg::zigzag[i]];
+        }
+    }
+    report("quantize", fastest(minSeconds, []() {}, [&]() {
+        Jpeg::quantizeCoefficients(used, spatial, used.numMcus.second, jpeg.blocks, nullptr);
+    }), 0);
+
+    Jpeg::histograms_t histograms;
+    report("delta", fastest(minSeconds, [&]() { Jpeg::resetHistograms(used, histograms); }, [&]() {
+        Jpeg::dct_t predictors[JPEG_MAX_COMPONENTS] = {0};
+        for (size_t iMcu = 0; iMcu < numMcus; iMcu++) {
+            for (size_t iComp = 0; iComp < used.components.size(); iComp++) {
+                const Jpeg::JpegComponent& comp = used.components[iComp];
+                size_t start = iMcu * used.mcuSize + used.componentOffsets[iComp];
+                for (size_t iBlock = start; iBlock < start + comp.sampling.first * comp.sampling.second; iBlock++) {
+                    Jpeg::dct_t dc = jpeg.blocks[iBlock][0];
+                    histograms.first[comp.dcTable].counts[Jpeg::splitNumber(dc - predictors[iComp]).first]++;
+                    predictors[iComp] = dc;
+                    Jpeg::countAcSymbols(jpeg.blocks[iBlock], histograms.second[comp.acTable]);
+                }
+            }
+        }
+    }), 0);
+
+    /* Rows of blocks of each component in turn, as a planar store would keep them */
+    Jpeg::coef_t (*planeBlocks)[JPEG_BLOCK_SIZE] = Jpeg::allocBlocks(numBlocks);
+    size_t planeStarts[JPEG_MAX_COMPONENTS];
+    size_t planeStart = 0;
+    for (size_t iComp = 0; iComp < used.components.size(); iComp++) {
+        planeStarts[iComp] = planeStart;
+        planeStart += numMcus * used.components[iComp].sampling.first * used.components[iComp].sampling.second;
+    }
+    auto planeBlock = [&](size_t iComp, size_t iMcu, size_t iBlock) {
+        const Jpeg::JpegComponent& comp = used.components[iComp];
+        size_t xMcu = iMcu % used.numMcus.first, yMcu = iMcu / used.numMcus.first;
+        size_t blocksPerRow = used.numMcus.first * comp.sampling.first;
+        size_t x = xMcu * comp.sampling.first + iBlock % comp.sampling.first;
+        size_t y = yMcu * comp.sampling.second + iBlock / comp.sampling.first;
+        return planeBlocks[planeStarts[iComp] + y * blocksPerRow + x];
+    };
+    for (size_t iMcu = 0; iMcu < numMcus; iMcu++) {
+        for (size_t iComp = 0; iComp < used.components.size(); iComp++) {
+            const Jpeg::JpegComponent& comp = used.components[iComp];
+            for (size_t iBlock = 0; iBlock < comp.sampling.first * comp.sampling.second; iBlock++) {
+                std::copy(jpeg.blocks[iMcu * used.mcuSize + used.componentOffsets[iComp] + iBlock],
+                    jpeg.blocks[iMcu * used.mcuSize + used.componentOffsets[iComp] + iBlock] + JPEG_BLOCK_SIZE,
+                    planeBlock(iComp, iMcu, iBlock));
+            }
+        }
+    }
+    report("delta-planes", fastest(minSeconds, [&]() { Jpeg::resetHistograms(used, histograms); }, [&]() {
+        Jpeg::dct_t predictors[JPEG_MAX_COMPONENTS] = {0};
+        for (size_t yMcu = 0; yMcu < (size_t)used.numMcus.second; yMcu++) {
+            for (size_t xMcu = 0; xMcu < (size_t)used.numMcus.first; xMcu++) {
+                for (size_t iComp = 0; iComp < used.components.size(); iComp++) {
+                    const Jpeg::JpegComponent& comp = used.components[iComp];
+                    size_t blocksPerRow = used.numMcus.first * comp.sampling.first;
+                    const Jpeg::coef_t (*mcu)[JPEG_BLOCK_SIZE] = planeBlocks + planeStarts[iComp] +
+                        yMcu * comp.sampling.second * blocksPerRow + xMcu * comp.sampling.first;
+                    for (int y = 0; y < comp.sampling.second; y++) {
+                        for (int x = 0; x < comp.sampling.first; x++) {
+                            const Jpeg::coef_t *block = mcu[y * blocksPerRow + x];
+                            Jpeg::dct_t dc = block[0];
+                            histograms.first[comp.dcTable].counts[Jpeg::splitNumber(dc - predictors[iComp]).first]++;
+                            predictors[iComp] = dc;
+                            Jpeg::countAcSymbols(block, histograms.second[comp.acTable]);
+                        }
+                    }
+                }
+            }
+        }
+    }), 0);
+    Jpeg::freeBlocks(planeBlocks);
+
+    /* Timed apart from reporting, which reads the size of the output */
+    double seconds = fastest(minSeconds, [&]() { out.clear(); }, [&]() {
+        Jpeg::JpegBitWriter bout(&out);
+        Jpeg::dct_t predictors[JPEG_MAX_COMPONENTS] = {0};
+        Jpeg::writeMcus(used, jpeg.tables, jpeg.blocks, 0, numMcus, predictors, bout);
+        bout.flush();
+    });
+    report("entropy", seconds, out.size());
+
+    seconds = fastest(minSeconds, [&]() { out.clear(); }, [&]() {
+        Jpeg::writeHeaders(used, jpeg.tables, out);
+    });
+    report("headers", seconds, out.size());
+
+    report("total", totalSeconds, totalBytes);
+}
+
+int main(int argc, char **argv) {
+    double minSeconds = 0.05;
+    int quality = 75;
+    std::vector<std::pair<size_t, size_t>> sizes;
+    int c;
+    while ((c = getopt(argc, argv, "t:q:s:")) != -1) {
+        switch (c) {
+            case 't':
+                minSeconds = atof(optarg);
+                break;
+            case 'q':
+                quality = atoi(optarg);
+                break;
+            case 's': {
+                size_t width = 0, height = 0;
+                if (sscanf(optarg, "%zux%zu", &width, &height) != 2 || width == 0 || height == 0) {
+                    std::cerr << "Sizes are given as WxH" << std::endl;
+                    return 1;
+                }
+                sizes.push_back(std::pair<size_t, size_t>(width, height));
+                break;
+            }
+            default:
+                std::cerr << "Usage: " << argv[0] << " [-t seconds] [-q quality] [-s WxH]..." << std::endl;
+                return 1;
+        }
+    }
+    if (sizes.empty()) {
+        sizes = {{256, 256}, {1280, 720}, {1920, 1080}};
+    }
+
+    std::cout << "image,width,height,sampling,stage,mpix_per_s,bytes_per_pixel" << std::endl;
+    for (auto size = sizes.begin(); size != sizes.end(); size++) {
+        for (int kind = 0; kind < NUM_IMAGES; kind++) {
+            std::vector<std::uint8_t> rgb = makeImage(kind, size->first, size->second);
+            std::string label = std::string(imageNames[kind]) + ',' + std::to_string(size->first) + ',' +
+                std::to_string(size->second);
+            for (int sampling = 0; sampling < NUM_SAMPLINGS; sampling++) {
+                benchImage(label, rgb, size->first, size->second, sampling, quality, minSeconds);
+            }
+        }
+    }
+    return 0;
+}
@@ -13,6 +13,8 @@ but frankly, that's all you'd normally need
 #include <cstdint>
 #include <cstddef>
 #include <iostream>
+#include <streambuf>
+#include <string>
 #include <algorithm>
 #include <vector>
 
@@ -25,11 +27,22 @@ but frankly, that's all you'd normally need
 #define JPEG_DCT_COEFF_SIZE 64
 #define JPEG_DCT_SIZE 8
 
+#define JPEG_MAX_SAMPLING 4
+
+#define JPEG_PIXEL_FORMATS 7
+
+#define JPEG_STAGES 5
+
+/* Alignment of block storage, enough for AVX loads */
+#define JPEG_BLOCK_ALIGN 32
+
 namespace Jpeg {
     
     using codes_t = std::pair<std::vector<Huffman::HuffmanCode>, std::vector<Huffman::HuffmanCode>>;
     using dqt_t = std::uint16_t;
     using dct_t = std::int32_t;
+    /* Quantized coefficient as stored, which baseline coding keeps within 16 bits */
+    using coef_t = std::int16_t;
     
     /* Constant tables used for operations */
     extern const dqt_t defaultLuminanceQTable[JPEG_BLOCK_SIZE];
@@ -42,7 +55,147 @@ namespace Jpeg {
     const int flagHuffmanProvided = 1;
     const int flagHuffmanOptimal = 2;
     const int flagHuffmanMask = 3;
+    /*
+    Huffman code on separate threads: one reset interval each, or without
+    reset intervals, runs of MCUs joined at bit level
+    */
+    const int flagParallelEntropy = 4;
+    /* Keep unquantized coefficients so the image can be requantized */
+    const int flagKeepCoefficients = 8;
+
+    /* Instruction sets usable by the vectorized kernels */
+    enum SimdLevel {
+        SIMD_NONE = 0,
+        SIMD_SSE2 = 1,
+        SIMD_AVX2 = 2
+    };
+
+    /*
+    Byte order of input pixels
+    X is a padding byte, ignored like alpha
+    */
+    enum JpegPixelFormat {
+        PIXEL_RGB = 0,
+        PIXEL_BGR = 1,
+        PIXEL_RGBA = 2,
+        PIXEL_BGRA = 3,
+        PIXEL_RGBX = 4,
+        PIXEL_BGRX = 5,
+        PIXEL_GRAY = 6
+    };
+
+    inline size_t pixelBytes(JpegPixelFormat format)
+    {
+        switch (format) {
+            case PIXEL_RGB:
+            case PIXEL_BGR:
+                return 3;
+            case PIXEL_GRAY:
+                return 1;
+            default:
+                return 4;
+        }
+    }
+
+    /*
+    Where input pixels are and how they are laid out
+    
+    stride: bytes from the start of one row to the next, 0 for tightly packed
+    bottomUp: rows are stored from the bottom of the image up, as in BMP
+    */
+    struct JpegPixels {
+        const std::uint8_t *data;
+        JpegPixelFormat format;
+        size_t stride;
+        bool bottomUp;
+        JpegPixels(
+            const std::uint8_t *data,
+            JpegPixelFormat format = PIXEL_RGB,
+            size_t stride = 0,
+            bool bottomUp = false
+        ) :
+            data {data},
+            format {format},
+            stride {stride},
+            bottomUp {bottomUp}
+        {}
+    };
+
+    /*
+    Where planar or semi-planar Y, Cb and Cr input is, such as decoded video
+    
+    data: first sample of Y, Cb and Cr; for interleaved chroma Cb and Cr
+    point into the same plane, one byte apart (NV12 Cb first, NV21 Cr first)
+    stride: bytes from the start of one row of each plane to the next
+    step: bytes from one sample to the next, 2 for interleaved chroma
+    subsampling: image pixels per chroma sample each way, {2, 2} for 4:2:0;
+    a chroma plane has width / subsampling.first samples per row, rounded up
+    */
+    struct JpegYCbCr {
+        const std::uint8_t *data[3];
+        size_t stride[3];
+        size_t step[3];
+        std::pair<int, int> subsampling;
+        /* Three planes, as I420 */
+        JpegYCbCr(
+            const std::uint8_t *y, size_t yStride,
+            const std::uint8_t *cb, size_t cbStride,
+            const std::uint8_t *cr, size_t crStride,
+            std::pair<int, int> subsampling = std::pair<int, int>(2, 2)
+        ) :
+            data {y, cb, cr},
+            stride {yStride, cbStride, crStride},
+            step {1, 1, 1},
+            subsampling {subsampling}
+        {}
+        /* Luma and one plane of Cb, Cr pairs, as NV12 */
+        JpegYCbCr(
+            const std::uint8_t *y, size_t yStride,
+            const std::uint8_t *cbcr, size_t cbcrStride,
+            std::pair<int, int> subsampling = std::pair<int, int>(2, 2)
+        ) :
+            data {y, cbcr, cbcr + 1},
+            stride {yStride, cbcrStride, cbcrStride},
+            step {1, 2, 2},
+            subsampling {subsampling}
+        {}
+    };
+
+    /*
+    Lossless rearrangements of the blocks of an image
+    Rotations are clockwise; TRANSVERSE mirrors across the other diagonal
+    */
+    enum JpegTransform {
+        TRANSFORM_NONE = 0,
+        TRANSFORM_FLIP_HORIZONTAL = 1,
+        TRANSFORM_FLIP_VERTICAL = 2,
+        TRANSFORM_TRANSPOSE = 3,
+        TRANSFORM_TRANSVERSE = 4,
+        TRANSFORM_ROTATE_90 = 5,
+        TRANSFORM_ROTATE_180 = 6,
+        TRANSFORM_ROTATE_270 = 7
+    };
 
+    /*
+    Parts of an encode timed by JpegEncodeStats
+    ENCODE: encode, encodeRGB, encodeYCbCr or requantize, from pixels to
+    quantized blocks, counting symbols on the way for optimal codes
+    SYMBOLS: counting symbols in write when the encode did not
+    HUFFMAN: building and compiling the Huffman codes
+    HEADERS: the thumbnail and everything up to SOS
+    ENTROPY: Huffman coding the blocks, DC differences included, and EOI
+    */
+    enum JpegStage {
+        STAGE_ENCODE = 0,
+        STAGE_SYMBOLS = 1,
+        STAGE_HUFFMAN = 2,
+        STAGE_HEADERS = 3,
+        STAGE_ENTROPY = 4
+    };
+    
+    /* Lower case names of the stages, for reports */
+    extern const char *const stageNames[JPEG_STAGES];
+    
     enum JpegDensityUnits {
         DPI = 1,
         DPCM = 2,
@@ -67,6 +220,13 @@ namespace Jpeg {
                 acTable {acTable}
             {}
     };
+    
+    /*
+    One luma component with the luminance tables, for gray images such as
+    document scans; pairs with PIXEL_GRAY input, which is then encoded
+    without color conversion
+    */
+    extern const std::vector<JpegComponent> grayscaleComponents;
 
     /*
     Data object to hold settings for JPEG encoding and metadata
@@ -74,6 +234,7 @@ namespace Jpeg {
     struct JpegSettings {
         private:
             void init();
+            void scaleQTables();
         public:
             std::vector<JpegComponent> components;
             std::pair<int, int> size;
@@ -84,8 +245,20 @@ namespace Jpeg {
             int compressionFlags;
             int numQTables;
             dqt_t qtables[JPEG_MAX_COMPONENTS][JPEG_BLOCK_SIZE];
+            /* qtables before scaling by quality */
+            dqt_t baseQTables[JPEG_MAX_COMPONENTS][JPEG_BLOCK_SIZE];
             std::pair<int, int> version;
             int resetInterval;
+            /*
+            Longest side of the RGB thumbnail in the JFIF header, 0 for none
+            Made from the DC terms when written, so JpegStream leaves it out
+            */
+            int thumbnailSize;
+            /*
+            Segments written as they are after APP0, marker and length
+            included, such as the EXIF data of a file read by readJpeg
+            */
+            std::vector<std::string> extraSegments;
             codes_t huffmanCodes;
 
             std::pair<int, int> mcuScale;
@@ -94,7 +267,10 @@ namespace Jpeg {
             size_t mcuSize;
             
             /*
-            bitDepth and resetInterval are not (yet) supported as non-default values
+            bitDepth is not (yet) supported as a non-default value
+            resetInterval: MCUs per restart interval up to 65535, 0 for none
+            A single component is always scanned non-interleaved, a block
+            at a time, so its sampling factors are taken as 1 by 1
             */
             JpegSettings(
                 std::pair<int, int> size,
@@ -112,8 +288,205 @@ namespace Jpeg {
                 const codes_t *huffmanCodes = nullptr,
                 int bitDepth = 8,
                 int resetInterval = 0);
+            
+            /*
+            Rescale the quantization tables for a new quality
+            */
+            void setQuality(int quality);
+            
+            /*
+            Replace the quantization tables, scaled by quality
+            */
+            void setQTables(int numQTables, const dqt_t *qtables[JPEG_MAX_COMPONENTS], int quality);
+    };
+    
+    /*
+    Huffman table compiled for encoding
+    
+    The entry of each symbol holds its code above the low 8 bits and the
+    length of the code in them, 0 for symbols without a code
+    */
+    struct JpegHuffmanTable {
+        std::uint32_t entries[256];
     };
     
+    using tables_t = std::pair<std::vector<JpegHuffmanTable>, std::vector<JpegHuffmanTable>>;
+    
+    /*
+    How often each symbol of a Huffman table is used
+    */
+    struct JpegHistogram {
+        std::uint64_t counts[256];
+    };
+    
+    using histograms_t = std::pair<std::vector<JpegHistogram>, std::vector<JpegHistogram>>;
+    
+    /*
+    Bit writer for entropy coded data
+    
+    Bits gather in a 64-bit accumulator and leave it 8 bytes at a time,
+    straight into the destination buffer with a 0x00 after every 0xFF
+    unless stuffing is turned off
+    */
+    class JpegBitWriter {
+        private:
+            std::streambuf *dst;
+            std::uint64_t buffer;
+            int freeBits;
+            bool stuffing;
+            bool failed;
+            
+            inline void emitByte(std::uint8_t byte)
+            {
+                if (dst->sputc(byte) == std::streambuf::traits_type::eof()) {
+                    failed = true;
+                }
+                if (byte == 0xFF && stuffing && dst->sputc(0) == std::streambuf::traits_type::eof()) {
+                    failed = true;
+                }
+            }
+        public:
+            JpegBitWriter(std::streambuf *dst = nullptr, bool stuffing = true) :
+                dst {dst},
+                buffer {0},
+                freeBits {64},
+                stuffing {stuffing},
+                failed {false} {}
+            
+            /*
+            Start over with a new destination, dropping pending bits
+            */
+            void reset(std::streambuf *dst)
+            {
+                this->dst = dst;
+                buffer = 0;
+                freeBits = 64;
+                failed = false;
+            }
+            
+            /*
+            Append the low length bits of bits, which must be clear above them
+            length: at most 32
+            */
+            inline void write(std::uint32_t bits, int length)
+            {
+                if (length < freeBits) {
+                    buffer = (buffer << length) | bits;
+                    freeBits -= length;
+                    return;
+                }
+                /* Top up the accumulator, write it out and keep the rest */
+                int rest = length - freeBits;
+                std::uint64_t word = (buffer << freeBits) | (bits >> rest);
+                for (int shift = 56; shift >= 0; shift -= 8) {
+                    emitByte(word >> shift);
+                }
+                buffer = bits;
+                freeBits = 64 - rest;
+            }
+            
+            size_t pendingBits() const
+            {
+                return 64 - freeBits;
+            }
+            
+            /*
+            Pad with ones to a byte boundary and write out every pending bit
+            */
+            void flush();
+            
+            /*
+            Flush, then write a two byte marker without stuffing
+            */
+            void putMarker(std::uint8_t code);
+            
+            /*
+            Whether the destination has refused any byte
+            */
+            bool good() const
+            {
+                return !failed;
+            }
+    };
+    
+    /*
+    Called as each stage of an encode ends, with the time it took
+    It must not throw.
+    */
+    using JpegStageHook = void (*)(JpegStage stage, double wallSeconds, double cpuSeconds, void *context);
+    
+    /*
+    Called when output written to memory fills its buffer
+    
+    data, used: the full buffer and how much of it is written
+    capacity: on entry the size the buffer needs to be, on return the size
+    of the one returned, which may be larger
+    Returns a buffer holding the first used bytes of data, which may be
+    data itself resized, or nullptr to give up
+    */
+    using JpegGrowHook = std::uint8_t *(*)(std::uint8_t *data, size_t used, size_t& capacity, void *context);
+    
+    /*
+    Called with each chunk of output as soon as it is complete
+    Returns false to refuse it, which fails the write
+    */
+    using JpegChunkHook = bool (*)(const std::uint8_t *data, size_t size, void *context);
+    
+    /*
+    How the entropy coded data of one component came out, as of the last write
+    */
+    struct JpegComponentStats {
+        /* Bits of the component's blocks, leaving out padding, stuffing and markers */
+        std::uint64_t bits = 0;
+        std::uint64_t blocks = 0;
+        /* Blocks with every coefficient zero */
+        std::uint64_t zeroBlocks = 0;
+        /* Blocks with every AC coefficient zero, coded as a DC difference and EOB */
+        std::uint64_t eobOnlyBlocks = 0;
+        std::uint64_t dcSymbols = 0;
+        std::uint64_t acSymbols = 0;
+    };
+    
+    /*
+    Where the time and bytes of a Jpeg's encodes go
+    
+    Point Jpeg::stats at one to have it filled in. Only a library built with
+    JPEG_STATS defined fills it; otherwise nothing is measured and it is
+    left as it is, so the instrumentation costs nothing.
+    
+    wallSeconds, cpuSeconds: each stage's latest run, 0 for stages the
+    latest write skipped; CPU time is that of the whole process, so it
+    adds up the threads of parallel stages
+    components: per component of the latest write
+    symbols: how often the latest write used each symbol of each table
+    blockBytes, coefficientBytes, workspaceBytes: the buffers the Jpeg
+    holds, which only grow, so they are its peak use
+    hook, hookContext: if set, hook(stage, wall, cpu, hookContext) is
+    called as each stage ends, to pass timings on
+    */
+    struct JpegEncodeStats {
+        double wallSeconds[JPEG_STAGES] = {0};
+        double cpuSeconds[JPEG_STAGES] = {0};
+        std::vector<JpegComponentStats> components;
+        histograms_t symbols;
+        size_t blockBytes = 0;
+        size_t coefficientBytes = 0;
+        size_t workspaceBytes = 0;
+        JpegStageHook hook = nullptr;
+        void *hookContext = nullptr;
+    };
+    
+    /* Per-thread buffers kept by a Jpeg between frames, see jpeginternal.hpp */
+    struct JpegWorkspace;
+    
+    /*
+    Storage for count blocks aligned to JPEG_BLOCK_ALIGN, released with
+    freeBlocks
+    */
+    coef_t (*allocBlocks(size_t count))[JPEG_BLOCK_SIZE];
+    
+    void freeBlocks(coef_t (*blocks)[JPEG_BLOCK_SIZE]);
+    
     /*
     Data of a compressing JPEG
     
@@ -122,47 +495,357 @@ namespace Jpeg {
     class Jpeg {
         public:
             JpegSettings settings;
-            volatile dct_t (*blocks)[JPEG_BLOCK_SIZE];
-            void encodeDeltas();
-            void encodeCompressed(BitBuffer::BitBufferOut& dst);
+            /* Quantized coefficients of each block in zigzag order, MCU by MCU */
+            coef_t (*blocks)[JPEG_BLOCK_SIZE];
+            /* Blocks that blocks and coefficients have room for */
+            size_t blockCapacity;
+            /* Symbol counts taken while quantizing, for optimal Huffman codes */
+            histograms_t histograms;
+            bool histogramsReady;
+            /* DCT output before quantization, in the same order as blocks */
+            float (*coefficients)[JPEG_BLOCK_SIZE];
+            /* Compiled tables of the last write, reused while they are the defaults */
+            tables_t tables;
+            bool defaultTablesReady;
+            JpegWorkspace *workspace;
+            /* Filled in by encodes and writes if set, see JpegEncodeStats */
+            JpegEncodeStats *stats;
+            /* Both return false if dst refused any byte */
+            bool encodeCompressed(std::streambuf& dst);
+            bool writeBuffer(std::streambuf& dst, bool syncHeaders = false);
         public:
             Jpeg(JpegSettings jpegSettings) :
-                settings {jpegSettings},
-                blocks {new dct_t[
-                        jpegSettings.numMcus.first *
-                        jpegSettings.numMcus.second *
-                        jpegSettings.mcuSize
-                    ][JPEG_BLOCK_SIZE]}
+                settings {std::move(jpegSettings)},
+                blocks {allocBlocks((size_t)settings.numMcus.first * settings.numMcus.second * settings.mcuSize)},
+                blockCapacity {(size_t)settings.numMcus.first * settings.numMcus.second * settings.mcuSize},
+                histogramsReady {false},
+                coefficients {nullptr},
+                defaultTablesReady {false},
+                workspace {nullptr},
+                stats {nullptr}
             {}
             
             Jpeg(const Jpeg& other);
             
+            /*
+            Takes over the buffers of other, which is left without any until
+            it is reset
+            */
+            Jpeg(Jpeg&& other) noexcept;
+            
             Jpeg& operator=(const Jpeg& other);
             
+            Jpeg& operator=(Jpeg&& other) noexcept;
+            
             ~Jpeg();
             
+            /*
+            Start over with new settings, keeping the buffers if the new
+            image has no more blocks than they hold
+            
+            Frames with the same settings need no reset: encodeRGB and write
+            again, which allocate nothing after the first frame with the
+            default Huffman tables, no thumbnail and no flagParallelEntropy
+            */
+            void reset(const JpegSettings& jpegSettings);
+            
             /*
             Populate this JPEG with RGB data
+            
+            With flagHuffmanOptimal, symbols are counted on the way
             */
             void encodeRGB(const std::uint8_t *rgb);
             
+            /*
+            Populate this JPEG with pixels of any format, converted row by
+            row as they are transformed
+            */
+            void encode(const JpegPixels& pixels);
+            
+            /*
+            Populate this JPEG with Y, Cb and Cr samples
+            
+            When each plane's resolution is the one its component is coded
+            at, the samples go straight to the DCT; otherwise chroma is
+            repeated up to full resolution and sampled as encodeRGB would
+            */
+            void encodeYCbCr(const JpegYCbCr& ycbcr);
+            
             /*
             Compress and write out to a stream
+            
+            Leaves the data as it is, so it can be written again
             */
             void write(std::ostream& dst);
+            
+            /*
+            Compress and write out to capacity bytes of memory at dst
+            
+            When the output is about to overflow, grow is called with
+            context for a larger buffer, and the rest of the output and
+            any later growth go to the one it returns.
+            Throws JpegEncodingException if the output does not fit and
+            there is no grow, or it gives up
+            returns the size of the output
+            */
+            size_t write(std::uint8_t *dst, size_t capacity, JpegGrowHook grow = nullptr,
+                void *context = nullptr);
+            
+            /*
+            Compress and pass the output to hook in chunks of chunkSize
+            bytes, the headers on their own as soon as the Huffman tables
+            are settled
+            
+            Throws JpegEncodingException if hook refuses a chunk
+            */
+            void write(JpegChunkHook hook, void *context, size_t chunkSize = 4096);
+            
+            /*
+            Write to the file at path, which is replaced, encoding straight
+            into memory mapped over it where the system allows
+            
+            The file is first given maxEncodedSize bytes of disk, then cut to
+            the output
+            Throws JpegEncodingException if the file cannot be written, in
+            which case it is removed
+            returns the size of the output
+            */
+            size_t writeFile(const std::string& path);
+            
+            /*
+            Quantize again with the current settings.qtables, without redoing
+            color conversion or the DCT
+            
+            Needs flagKeepCoefficients to have been set for encodeRGB
+            */
+            void requantize();
+            
+            /*
+            Rescale the quantization tables for quality and requantize
+            */
+            void requantize(int quality);
+            
+            /*
+            Write at the highest quality from minQuality to maxQuality whose
+            output is at most maxBytes long, found by bisection
+            
+            Needs flagKeepCoefficients to have been set for encodeRGB
+            If nothing fits, writes at minQuality
+            returns the quality written
+            */
+            int writeTargetSize(std::ostream& dst, size_t maxBytes,
+                int minQuality = 1, int maxQuality = 100);
+            
+            /*
+            Write a copy of the image reduced by scale each way, straight
+            from the DCT coefficients without another pass over the pixels
+            
+            The lowest 8/scale frequencies of each block are inverse
+            transformed at that size, so scale 8 is the box filtered image
+            of the DC terms, and the result is coded again with the same
+            settings. Uses the kept coefficients if there are any,
+            otherwise the dequantized blocks.
+            scale: 1, 2, 4 or 8
+            */
+            void writeReduced(std::ostream& dst, int scale);
+            
+            /*
+            Rotate or flip the image by moving its blocks and permuting and
+            negating their coefficients, with no DCT and no requantization
+            
+            A flip would bring the partial MCUs past the far edge to the
+            near one, where decoders show them, so they are dropped: the
+            mirrored dimension is cut to a whole number of MCUs
+            Provided Huffman codes may lack symbols the moved blocks need,
+            so after this and crop they give way to optimal ones
+            */
+            void transform(JpegTransform op);
+            
+            /*
+            Keep only the given rectangle, moving whole blocks
+            
+            offset: a multiple of the MCU size each way
+            size: up to the edge of the image from offset
+            */
+            void crop(std::pair<int, int> offset, std::pair<int, int> size);
     };
     
+    /*
+    Most bytes a write with settings can take, whatever the image and
+    Huffman codes
+    
+    Every coefficient is counted at its longest code and every byte of
+    the scan as stuffed, so it is a loose bound, but a buffer this large
+    never needs to grow
+    */
+    size_t maxEncodedSize(const JpegSettings& settings);
+    
+    /*
+    Read a baseline JPEG file back to its quantized blocks, without
+    decoding any pixels
+    
+    The result has flagHuffmanProvided with the file's own tables, so it
+    writes the same scan again; its APPn and COM segments other than a
+    JFIF APP0 are kept in settings.extraSegments. It can be transformed,
+    cropped and written with other Huffman codes, but not requantized.
+    Throws JpegEncodingException for anything but 8-bit baseline
+    Huffman coding, or a damaged file.
+    */
+    Jpeg readJpeg(std::istream& src);
+    
+    /*
+    Rewrite a baseline JPEG file with optimal Huffman codes, reading its
+    blocks with readJpeg and writing them again, so the image is unchanged
+    and no pixels are decoded
+    */
+    void reoptimize(std::istream& src, std::ostream& dst);
+    
+    /*
+    Stream buffer that hands what is written to a JpegChunkHook in chunks
+    of chunkSize bytes, and whatever is left over whenever it is synced
+    
+    Once the hook refuses a chunk, every later byte is refused too.
+    Nothing is passed on when it is destroyed, so sync it first.
+    */
+    class JpegChunkSink : public std::streambuf {
+        private:
+            JpegChunkHook hook;
+            void *context;
+            std::vector<char> chunk;
+            bool failed;
+            
+            bool emit();
+        public:
+            JpegChunkSink(JpegChunkHook hook = nullptr, void *context = nullptr, size_t chunkSize = 4096);
+            
+            /*
+            Start over with a new hook, dropping anything not yet passed on
+            */
+            void reset(JpegChunkHook hook, void *context, size_t chunkSize = 4096);
+            
+            bool good() const
+            {
+                return !failed;
+            }
+        protected:
+            int_type overflow(int_type ch) override;
+            int sync() override;
+    };
+    
+    /*
+    Streaming JPEG encoder
+
+    Takes the image a few rows at a time and writes the compressed output as
+    soon as each MCU row is complete, so only ringRows MCU rows of input and
+    coefficients are ever resident.
+    Huffman codes must be known before the first row, so flagHuffmanOptimal
+    is not supported.
+    */
+    class JpegStream {
+        private:
+            JpegSettings settings;
+            size_t ringRows;
+            std::uint8_t *staging;
+            coef_t (*blocks)[JPEG_BLOCK_SIZE];
+            /* Scratch of each stripe, kept so frames stop allocating */
+            JpegWorkspace *workspace;
+            /* Output of the frame, nullptr between frames */
+            std::streambuf *out;
+            /* The stream out belongs to, or nullptr when it is chunks */
+            std::ostream *dst;
+            JpegChunkSink chunks;
+            tables_t tables;
+            JpegBitWriter bout;
+            size_t rowsStaged;
+            size_t rowsPushed;
+            size_t mcuRowsDone;
+            /* Format of the rows of this frame, kept as they are in staging */
+            JpegPixelFormat format;
+            dct_t predictors[JPEG_MAX_COMPONENTS];
+            void encodeMcuRows(const JpegPixels& pixels, size_t rows, size_t numMcuRows);
+            bool startFrame(std::streambuf& out);
+        public:
+            /*
+            ringRows: number of MCU rows transformed together
+            */
+            JpegStream(JpegSettings jpegSettings, size_t ringRows = 1);
+
+            JpegStream(const JpegStream& other) = delete;
+
+            JpegStream& operator=(const JpegStream& other) = delete;
+
+            ~JpegStream();
+
+            /*
+            Write the headers and prepare to receive a new image
+            */
+            void beginFrame(std::ostream& dst);
+            
+            /*
+            Pass the headers to hook at once and prepare to receive a new
+            image, whose data then goes to hook in chunks of chunkSize bytes
+            as the rows that fill them are pushed
+            
+            Throws JpegEncodingException if hook refuses the headers
+            */
+            void beginFrame(JpegChunkHook hook, void *context, size_t chunkSize = 4096);
+
+            /*
+            Encode the next nRows rows of tightly packed RGB data
+            */
+            void pushRows(const std::uint8_t *rgb, size_t nRows);
+
+            /*
+            Encode the next nRows rows, the first at pixels.data
+            
+            Every push of a frame must use the same format, and rows
+            must come top down
+            */
+            void pushRows(const JpegPixels& pixels, size_t nRows);
+
+            /*
+            Flush the last MCU row and finish the image
+            
+            Frames begun with a hook pass it the last chunk, and throw
+            JpegEncodingException if it refused any
+            */
+            void finish();
+    };
+
+    /*
+    One image of a batch: pixels of settings.size, written to dst as a
+    complete JPEG
+    */
+    struct JpegJob {
+        const JpegSettings *settings;
+        JpegPixels pixels;
+        std::ostream *dst;
+    };
+
+    /*
+    Encode and write count images on the threads of one parallel region
+
+    Every image is a task for whichever thread is free, largest first.
+    Small images are encoded whole on one thread, which avoids the fork and
+    join of a parallel region per image, while large ones are further split
+    into tasks of a few MCU rows. The Makefile builds with -fopenmp; a
+    library built without it encodes the images one after another.
+    If any image fails, the rest are still written and the exception of
+    the first failing job is rethrown
+    */
+    void encodeBatch(const JpegJob *jobs, size_t count);
+
     /*
     Exception raised when an error in JPEG encoding is encountered
     */
     class JpegEncodingException : public std::exception {
         private:
-            const char* message;
+            std::string message;
         public:
             JpegEncodingException(std::string message) :
-                message{("Jpeg Encoding Exception: " + message).c_str()} {}
-            virtual const char* what() {
-                return message;
+                message{"Jpeg Encoding Exception: " + message} {}
+            virtual const char* what() const noexcept {
+                return message.c_str();
             }
     };
     
@@ -222,6 +905,45 @@ namespace Jpeg {
         return y * width + x;
     }
 
+    /*
+    Best instruction set supported by both this build and the running CPU
+    */
+    SimdLevel detectSimd();
+
+    /*
+    Forward 8x8 DCT of count blocks in place, in natural order and level shifted
+    
+    Picks the widest kernel the CPU supports, or at most level if given
+    */
+    void forwardDct(float (*blocks)[JPEG_BLOCK_SIZE], size_t count);
+    void forwardDct(float (*blocks)[JPEG_BLOCK_SIZE], size_t count, SimdLevel level);
+
+    /*
+    Convert count pixels of packed RGB into separate Y, Cb and Cr rows
+    
+    Uses the same weights as Y, Cb and Cr in fixed point, rounding rather
+    than truncating, so results are within 1 of those functions
+    */
+    void convertRowRGB(const std::uint8_t *rgb, size_t count,
+        std::uint8_t *y, std::uint8_t *cb, std::uint8_t *cr);
+    void convertRowRGB(const std::uint8_t *rgb, size_t count,
+        std::uint8_t *y, std::uint8_t *cb, std::uint8_t *cr, SimdLevel level);
+
+    /*
+    convertRowRGB for pixels of any format, with the same results as for
+    the same colors in RGB
+    */
+    void convertRow(JpegPixelFormat format, const std::uint8_t *pixels, size_t count,
+        std::uint8_t *y, std::uint8_t *cb, std::uint8_t *cr);
+    void convertRow(JpegPixelFormat format, const std::uint8_t *pixels, size_t count,
+        std::uint8_t *y, std::uint8_t *cb, std::uint8_t *cr, SimdLevel level);
+
+    /*
+    Reference forward DCT using 16 passes of the scalar 8-point transform,
+    truncating to integers after every pass
+    */
+    void forwardDctScalar(dct_t block[JPEG_BLOCK_SIZE]);
+
     template <class sample_t>
     inline sample_t componentFromRGB(sample_t *sample, size_t component)
     {
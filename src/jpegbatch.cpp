@@ -0,0 +1,66 @@
+/*
+jpegbatch.cpp
+Many images encoded together as OpenMP tasks
+*/
+
+#include <algorithm>
+#include <exception>
+#include <numeric>
+#include <vector>
+#include "jpegutil.hpp"
+#include "jpeginternal.hpp"
+
+/* Images of at least this many MCUs are split into row tasks */
+#define BATCH_SPLIT_MCUS 2048
+/* MCUs per row task of a split image */
+#define BATCH_TASK_MCUS 512
+
+size_t mcuCount(const Jpeg::JpegSettings& settings)
+{
+    return (size_t)settings.numMcus.first * settings.numMcus.second;
+}
+
+void encodeJob(const Jpeg::JpegJob& job)
+{
+    Jpeg::Jpeg jpeg(*job.settings);
+    /* One task for the whole image unless it is large */
+    size_t rowsPerTask = jpeg.settings.numMcus.second;
+    if (mcuCount(jpeg.settings) >= BATCH_SPLIT_MCUS) {
+        rowsPerTask = std::max(size_t{1}, BATCH_TASK_MCUS / (size_t)jpeg.settings.numMcus.first);
+    }
+    Jpeg::encodeImageRGB(jpeg, job.pixels, rowsPerTask);
+    jpeg.write(*job.dst);
+}
+
+void Jpeg::encodeBatch(const JpegJob *jobs, size_t count)
+{
+    /* Largest first, so no large image is left to finish on its own */
+    std::vector<size_t> order(count);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [jobs](size_t a, size_t b) {
+        return mcuCount(*jobs[a].settings) > mcuCount(*jobs[b].settings);
+    });
+    /* Exceptions cannot leave a task, so they wait here */
+    std::vector<std::exception_ptr> errors(count);
+    
+    #pragma omp parallel
+    #pragma omp single
+    for (size_t i = 0; i < count; i++) {
+        size_t iJob = order[i];
+        #pragma omp task firstprivate(iJob) shared(errors)
+        {
+            try {
+                encodeJob(jobs[iJob]);
+            }
+            catch (...) {
+                errors[iJob] = std::current_exception();
+            }
+        }
+    }
+    
+    for (size_t i = 0; i < count; i++) {
+        if (errors[i]) {
+            std::rethrow_exception(errors[i]);
+        }
+    }
+}
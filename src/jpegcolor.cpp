@@ -0,0 +1,216 @@
+/*
+jpegcolor.cpp
+Fixed point RGB to YCbCr conversion of whole rows, in every pixel format
+*/
+
+#include <cstdint>
+#include <cstring>
+#include "jpegutil.hpp"
+#include "jpeginternal.hpp"
+
+#ifdef JPEG_X86_SIMD
+#include <immintrin.h>
+#endif
+
+const std::int32_t Jpeg::colorFix[3][4] = {
+    {9798, 19235, 3736, JPEG_COLOR_HALF},
+    {-5529, -10855, 16384, (128 << JPEG_COLOR_BITS) + JPEG_COLOR_HALF - 1},
+    {16384, -13720, -2664, (128 << JPEG_COLOR_BITS) + JPEG_COLOR_HALF - 1}
+};
+
+/*
+Kernels are instantiated for each layout of color pixels
+step: bytes per pixel
+r, g, b: offsets of the channels within a pixel
+*/
+template <int step, int r, int g, int b>
+static void convertRowFixed(const std::uint8_t *px, size_t count,
+    std::uint8_t *y, std::uint8_t *cb, std::uint8_t *cr)
+{
+    for (size_t i = 0; i < count; i++, px += step) {
+        const std::uint8_t rgb[3] = {px[r], px[g], px[b]};
+        y[i] = Jpeg::ycbcrFromRGB(rgb, 0);
+        cb[i] = Jpeg::ycbcrFromRGB(rgb, 1);
+        cr[i] = Jpeg::ycbcrFromRGB(rgb, 2);
+    }
+}
+
+/*
+Gray needs no arithmetic: the Y weights sum to just over one and the
+chroma weights to zero, so the results are the sample and 128 exactly
+*/
+static void convertRowGray(const std::uint8_t *px, size_t count,
+    std::uint8_t *y, std::uint8_t *cb, std::uint8_t *cr)
+{
+    std::memcpy(y, px, count);
+    std::memset(cb, 128, count);
+    std::memset(cr, 128, count);
+}
+
+#ifdef JPEG_X86_SIMD
+
+/*
+Coefficients laid out for pmaddwd: the low half of each 32-bit lane
+multiplies R (or B), the high half G (or nothing)
+*/
+#define COLOR_RG(c) ((std::int32_t)(((std::uint32_t)Jpeg::colorFix[c][1] << 16) | (Jpeg::colorFix[c][0] & 0xFFFF)))
+#define COLOR_B(c) (Jpeg::colorFix[c][2] & 0xFFFF)
+
+/*
+Without a byte shuffle the samples are gathered one by one, but all the
+arithmetic of 8 pixels is done in 4 multiply-adds per component
+*/
+template <int step, int r, int g, int b>
+__attribute__((target("sse2")))
+static void convertRowSse2(const std::uint8_t *px, size_t count,
+    std::uint8_t *y, std::uint8_t *cb, std::uint8_t *cr)
+{
+    std::uint8_t *out[3] = {y, cb, cr};
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const std::uint8_t *p = px + step * i;
+        /* (R, G) and (B, 0) pairs of pixels 0-3 and 4-7 */
+        __m128i rg0 = _mm_setr_epi16(p[r], p[g], p[step + r], p[step + g],
+            p[2 * step + r], p[2 * step + g], p[3 * step + r], p[3 * step + g]);
+        __m128i b0 = _mm_setr_epi16(p[b], 0, p[step + b], 0, p[2 * step + b], 0, p[3 * step + b], 0);
+        p += 4 * step;
+        __m128i rg1 = _mm_setr_epi16(p[r], p[g], p[step + r], p[step + g],
+            p[2 * step + r], p[2 * step + g], p[3 * step + r], p[3 * step + g]);
+        __m128i b1 = _mm_setr_epi16(p[b], 0, p[step + b], 0, p[2 * step + b], 0, p[3 * step + b], 0);
+        for (int c = 0; c < 3; c++) {
+            __m128i kRg = _mm_set1_epi32(COLOR_RG(c));
+            __m128i kB = _mm_set1_epi32(COLOR_B(c));
+            __m128i bias = _mm_set1_epi32(Jpeg::colorFix[c][3]);
+            __m128i v0 = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(rg0, kRg), _mm_madd_epi16(b0, kB)), bias);
+            __m128i v1 = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(rg1, kRg), _mm_madd_epi16(b1, kB)), bias);
+            __m128i v = _mm_packs_epi32(_mm_srai_epi32(v0, JPEG_COLOR_BITS), _mm_srai_epi32(v1, JPEG_COLOR_BITS));
+            _mm_storel_epi64((__m128i*)(out[c] + i), _mm_packus_epi16(v, v));
+        }
+    }
+    convertRowFixed<step, r, g, b>(px + step * i, count - i, y + i, cb + i, cr + i);
+}
+
+/*
+Each 128-bit lane takes 4 pixels from a 16 byte load, and one shuffle per
+lane pulls out the (R, G) pairs and another the (B, 0) pairs
+*/
+template <int step, int r, int g, int b>
+__attribute__((target("avx2")))
+static void convertRowAvx2(const std::uint8_t *px, size_t count,
+    std::uint8_t *y, std::uint8_t *cb, std::uint8_t *cr)
+{
+    alignas(32) std::int8_t rgBytes[32], bBytes[32];
+    std::memset(rgBytes, -1, sizeof(rgBytes));
+    std::memset(bBytes, -1, sizeof(bBytes));
+    for (int k = 0; k < 8; k++) {
+        rgBytes[4 * k] = (k % 4) * step + r;
+        rgBytes[4 * k + 2] = (k % 4) * step + g;
+        bBytes[4 * k] = (k % 4) * step + b;
+    }
+    const __m256i rgShuffle = _mm256_load_si256((const __m256i*)rgBytes);
+    const __m256i bShuffle = _mm256_load_si256((const __m256i*)bBytes);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    __m256i kRg[3], kB[3], bias[3];
+    for (int c = 0; c < 3; c++) {
+        kRg[c] = _mm256_set1_epi32(COLOR_RG(c));
+        kB[c] = _mm256_set1_epi32(COLOR_B(c));
+        bias[c] = _mm256_set1_epi32(Jpeg::colorFix[c][3]);
+    }
+    size_t i = 0;
+    /* With 3 byte pixels the second load reads 4 bytes past pixel i + 7 */
+    const size_t span = (4 * step + 16 + step - 1) / step;
+    for (; i + span <= count; i += 8) {
+        const std::uint8_t *p = px + step * i;
+        __m128i lo = _mm_loadu_si128((const __m128i*)p);
+        __m128i hi = _mm_loadu_si128((const __m128i*)(p + 4 * step));
+        __m256i both = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        __m256i rgPairs = _mm256_shuffle_epi8(both, rgShuffle);
+        __m256i bPairs = _mm256_shuffle_epi8(both, bShuffle);
+        __m256i v[3];
+        for (int c = 0; c < 3; c++) {
+            v[c] = _mm256_add_epi32(_mm256_madd_epi16(rgPairs, kRg[c]), _mm256_madd_epi16(bPairs, kB[c]));
+            v[c] = _mm256_srai_epi32(_mm256_add_epi32(v[c], bias[c]), JPEG_COLOR_BITS);
+        }
+        /* Bytes of each lane are Y, Cb, Cr, Cr in groups of 4, then interleave the lanes */
+        __m256i packed = _mm256_packus_epi16(
+            _mm256_packs_epi32(v[0], v[1]),
+            _mm256_packs_epi32(v[2], v[2]));
+        packed = _mm256_permutevar8x32_epi32(packed, order);
+        __m128i yCb = _mm256_castsi256_si128(packed);
+        _mm_storel_epi64((__m128i*)(y + i), yCb);
+        _mm_storel_epi64((__m128i*)(cb + i), _mm_srli_si128(yCb, 8));
+        _mm_storel_epi64((__m128i*)(cr + i), _mm256_extracti128_si256(packed, 1));
+    }
+    convertRowFixed<step, r, g, b>(px + step * i, count - i, y + i, cb + i, cr + i);
+}
+
+#endif
+
+using convert_t = void (*)(const std::uint8_t*, size_t, std::uint8_t*, std::uint8_t*, std::uint8_t*);
+
+template <int step, int r, int g, int b>
+static convert_t selectKernel(Jpeg::SimdLevel level)
+{
+    switch (std::min(level, Jpeg::detectSimd())) {
+#ifdef JPEG_X86_SIMD
+        case Jpeg::SIMD_AVX2:
+            return convertRowAvx2<step, r, g, b>;
+        case Jpeg::SIMD_SSE2:
+            return convertRowSse2<step, r, g, b>;
+#endif
+        default:
+            return convertRowFixed<step, r, g, b>;
+    }
+}
+
+static convert_t selectConvertRow(Jpeg::JpegPixelFormat format, Jpeg::SimdLevel level)
+{
+    switch (format) {
+        case Jpeg::PIXEL_BGR:
+            return selectKernel<3, 2, 1, 0>(level);
+        case Jpeg::PIXEL_RGBA:
+        case Jpeg::PIXEL_RGBX:
+            return selectKernel<4, 0, 1, 2>(level);
+        case Jpeg::PIXEL_BGRA:
+        case Jpeg::PIXEL_BGRX:
+            return selectKernel<4, 2, 1, 0>(level);
+        case Jpeg::PIXEL_GRAY:
+            return convertRowGray;
+        default:
+            return selectKernel<3, 0, 1, 2>(level);
+    }
+}
+
+static const convert_t bestConvertRow[JPEG_PIXEL_FORMATS] = {
+    selectConvertRow(Jpeg::PIXEL_RGB, Jpeg::SIMD_AVX2),
+    selectConvertRow(Jpeg::PIXEL_BGR, Jpeg::SIMD_AVX2),
+    selectConvertRow(Jpeg::PIXEL_RGBA, Jpeg::SIMD_AVX2),
+    selectConvertRow(Jpeg::PIXEL_BGRA, Jpeg::SIMD_AVX2),
+    selectConvertRow(Jpeg::PIXEL_RGBX, Jpeg::SIMD_AVX2),
+    selectConvertRow(Jpeg::PIXEL_BGRX, Jpeg::SIMD_AVX2),
+    selectConvertRow(Jpeg::PIXEL_GRAY, Jpeg::SIMD_AVX2)
+};
+
+void Jpeg::convertRowRGB(const std::uint8_t *rgb, size_t count,
+    std::uint8_t *y, std::uint8_t *cb, std::uint8_t *cr)
+{
+    bestConvertRow[PIXEL_RGB](rgb, count, y, cb, cr);
+}
+
+void Jpeg::convertRowRGB(const std::uint8_t *rgb, size_t count,
+    std::uint8_t *y, std::uint8_t *cb, std::uint8_t *cr, SimdLevel level)
+{
+    selectConvertRow(PIXEL_RGB, level)(rgb, count, y, cb, cr);
+}
+
+void Jpeg::convertRow(JpegPixelFormat format, const std::uint8_t *pixels, size_t count,
+    std::uint8_t *y, std::uint8_t *cb, std::uint8_t *cr)
+{
+    bestConvertRow[format](pixels, count, y, cb, cr);
+}
+
+void Jpeg::convertRow(JpegPixelFormat format, const std::uint8_t *pixels, size_t count,
+    std::uint8_t *y, std::uint8_t *cb, std::uint8_t *cr, SimdLevel level)
+{
+    selectConvertRow(format, level)(pixels, count, y, cb, cr);
+}
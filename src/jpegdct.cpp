@@ -0,0 +1,328 @@
+/*
+jpegdct.cpp
+Forward DCT kernels
+*/
+
+#include <cmath>
+#include <cstdint>
+#include "jpegutil.hpp"
+#include "jpeginternal.hpp"
+
+#ifdef JPEG_X86_SIMD
+#include <immintrin.h>
+#endif
+
+const float inverseSqrtTwo = 0.7071067811865476;
+
+const static float dct8_scales[8] = {
+	0.353553390593273762200422,
+	0.254897789552079584470970,
+	0.270598050073098492199862,
+	0.300672443467522640271861,
+	0.353553390593273762200422,
+	0.449988111568207852319255,
+	0.653281482438188263928322,
+	1.281457723870753089398043,
+};
+
+const static float dct8_consts[5] = {
+	0.707106781186547524400844,
+	0.541196100146196984399723,
+	0.707106781186547524400844,
+	1.306562964876376527856643,
+	0.382683432365089771728460,
+};
+
+void DCT8(Jpeg::dct_t *data, size_t stride)
+{
+    // Jpeg::dct_t buffer[JPEG_DCT_SIZE];
+    // for(size_t u = 0; u < JPEG_DCT_SIZE; u++) {
+        // float point = 0;
+        // for(size_t x = 0; x < JPEG_DCT_SIZE; x++) {
+            // point += data[x * stride] * Jpeg::dctCoeffs[u * 8 + x];
+        // }
+        // buffer[u] = std::round(point) / 2;
+    // }
+    // buffer[0] *= inverseSqrtTwo;
+    // for (size_t i = 0; i < JPEG_DCT_SIZE; i++) {
+        // data[i * stride] = buffer[i];
+    // }
+    // return;
+    
+    // Idea from https://web.stanford.edu/class/ee398a/handouts/lectures/07-TransformCoding.pdf#page=30
+    float v0 = data[0 * stride] + data[7 * stride];
+    float v1 = data[1 * stride] + data[6 * stride];
+    float v2 = data[2 * stride] + data[5 * stride];
+    float v3 = data[3 * stride] + data[4 * stride];
+    float v4 = data[3 * stride] - data[4 * stride];
+    float v5 = data[2 * stride] - data[5 * stride];
+    float v6 = data[1 * stride] - data[6 * stride];
+    float v7 = data[0 * stride] - data[7 * stride];
+    
+    float w0 = v0 + v3;
+    float w1 = v1 + v2;
+    float w2 = v1 - v2;
+    float w3 = v0 - v3;
+    float w4 = -(v4 + v5);
+    float w5 = v5 + v6;
+    float w6 = v6 + v7;
+    float w7 = v7;
+    
+    v0 = w0 + w1;
+    v1 = w0 - w1;
+    v2 = w2 + w3;
+    v3 = w3;
+    v4 = w4;
+    v5 = w5;
+    v6 = w6;
+    v7 = w7;
+    
+    float y = (v4 + v6) * dct8_consts[4];
+    
+    w0 = v0;
+    w1 = v1;
+    w2 = v2 * dct8_consts[0];
+    w3 = v3;
+    w4 = -y - v4 * dct8_consts[1];
+    w5 = v5 * dct8_consts[2];
+    w6 = v6 * dct8_consts[3] - y;
+    w7 = v7;
+    
+    v0 = w0;
+    v1 = w1;
+    v2 = w2 + w3;
+    v3 = w3 - w2;
+    v4 = w4;
+    v5 = w5 + w7;
+    v6 = w6;
+    v7 = w7 - w5;
+    
+    w0 = v0;
+    w1 = v1;
+    w2 = v2;
+    w3 = v3;
+    w4 = v4 + v7;
+    w5 = v5 + v6;
+    w6 = v5 - v6;
+    w7 = v7 - v4;
+    
+    data[0 * stride] = dct8_scales[0] * w0;
+    data[4 * stride] = dct8_scales[4] * w1;
+    data[2 * stride] = dct8_scales[2] * w2;
+    data[6 * stride] = dct8_scales[6] * w3;
+    data[5 * stride] = dct8_scales[5] * w4;
+    data[1 * stride] = dct8_scales[1] * w5;
+    data[7 * stride] = dct8_scales[7] * w6;
+    data[3 * stride] = dct8_scales[3] * w7;
+}
+
+/*
+The same butterfly as DCT8 without the truncation between stages
+
+T may be float or a vector of floats, in which case one call transforms
+as many independent 8-point vectors as there are lanes
+*/
+template <class T>
+__attribute__((always_inline)) inline void fdct8(T& d0, T& d1, T& d2, T& d3, T& d4, T& d5, T& d6, T& d7)
+{
+    T v0 = d0 + d7;
+    T v1 = d1 + d6;
+    T v2 = d2 + d5;
+    T v3 = d3 + d4;
+    T v4 = d3 - d4;
+    T v5 = d2 - d5;
+    T v6 = d1 - d6;
+    T v7 = d0 - d7;
+    
+    T w0 = v0 + v3;
+    T w1 = v1 + v2;
+    T w2 = v1 - v2;
+    T w3 = v0 - v3;
+    T w4 = -(v4 + v5);
+    T w5 = v5 + v6;
+    T w6 = v6 + v7;
+    T w7 = v7;
+    
+    v0 = w0 + w1;
+    v1 = w0 - w1;
+    v2 = w2 + w3;
+    
+    T y = (w4 + w6) * dct8_consts[4];
+    
+    w2 = v2 * dct8_consts[0];
+    w4 = -y - w4 * dct8_consts[1];
+    w5 = w5 * dct8_consts[2];
+    w6 = w6 * dct8_consts[3] - y;
+    
+    v2 = w2 + w3;
+    v3 = w3 - w2;
+    v5 = w5 + w7;
+    v7 = w7 - w5;
+    
+    d0 = v0 * dct8_scales[0];
+    d4 = v1 * dct8_scales[4];
+    d2 = v2 * dct8_scales[2];
+    d6 = v3 * dct8_scales[6];
+    d5 = (w4 + v7) * dct8_scales[5];
+    d1 = (v5 + w6) * dct8_scales[1];
+    d7 = (v5 - w6) * dct8_scales[7];
+    d3 = (v7 - w4) * dct8_scales[3];
+}
+
+void Jpeg::forwardDctScalar(dct_t block[JPEG_BLOCK_SIZE])
+{
+    /* Row-wise DCTs */
+    for (size_t i = 0; i < JPEG_BLOCK_ROW; i++) {
+        DCT8(block + i * JPEG_BLOCK_ROW, 1);
+    }
+    /* Column-wise DCTs */
+    for (size_t i = 0; i < JPEG_BLOCK_ROW; i++) {
+        DCT8(block + i, JPEG_BLOCK_ROW);
+    }
+}
+
+static void forwardDctFloat(float (*blocks)[JPEG_BLOCK_SIZE], size_t count)
+{
+    for (size_t n = 0; n < count; n++) {
+        float *b = blocks[n];
+        for (size_t i = 0; i < JPEG_BLOCK_SIZE; i += JPEG_BLOCK_ROW) {
+            fdct8(b[i], b[i + 1], b[i + 2], b[i + 3], b[i + 4], b[i + 5], b[i + 6], b[i + 7]);
+        }
+        for (size_t i = 0; i < JPEG_BLOCK_ROW; i++) {
+            fdct8(b[i], b[i + 8], b[i + 16], b[i + 24], b[i + 32], b[i + 40], b[i + 48], b[i + 56]);
+        }
+    }
+}
+
+#ifdef JPEG_X86_SIMD
+
+/*
+Each block is held as two halves of four columns, l for the left and r for
+the right. Transforming across the registers does the columns, then an
+in-register transpose turns the rows into columns for the second pass.
+*/
+__attribute__((target("sse2")))
+static void forwardDctSse2(float (*blocks)[JPEG_BLOCK_SIZE], size_t count)
+{
+    for (size_t n = 0; n < count; n++) {
+        float *b = blocks[n];
+        __m128 l[JPEG_BLOCK_ROW], r[JPEG_BLOCK_ROW];
+        for (size_t i = 0; i < JPEG_BLOCK_ROW; i++) {
+            l[i] = _mm_loadu_ps(b + i * JPEG_BLOCK_ROW);
+            r[i] = _mm_loadu_ps(b + i * JPEG_BLOCK_ROW + 4);
+        }
+        for (int pass = 0; pass < 2; pass++) {
+            fdct8(l[0], l[1], l[2], l[3], l[4], l[5], l[6], l[7]);
+            fdct8(r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7]);
+            /* Transpose each 4x4 quarter, then swap the off-diagonal quarters */
+            _MM_TRANSPOSE4_PS(l[0], l[1], l[2], l[3]);
+            _MM_TRANSPOSE4_PS(r[0], r[1], r[2], r[3]);
+            _MM_TRANSPOSE4_PS(l[4], l[5], l[6], l[7]);
+            _MM_TRANSPOSE4_PS(r[4], r[5], r[6], r[7]);
+            for (size_t i = 0; i < 4; i++) {
+                __m128 t = r[i];
+                r[i] = l[i + 4];
+                l[i + 4] = t;
+            }
+        }
+        for (size_t i = 0; i < JPEG_BLOCK_ROW; i++) {
+            _mm_storeu_ps(b + i * JPEG_BLOCK_ROW, l[i]);
+            _mm_storeu_ps(b + i * JPEG_BLOCK_ROW + 4, r[i]);
+        }
+    }
+}
+
+__attribute__((target("avx2"), always_inline))
+inline void transpose8x8(__m256 *r)
+{
+    __m256 t0 = _mm256_unpacklo_ps(r[0], r[1]);
+    __m256 t1 = _mm256_unpackhi_ps(r[0], r[1]);
+    __m256 t2 = _mm256_unpacklo_ps(r[2], r[3]);
+    __m256 t3 = _mm256_unpackhi_ps(r[2], r[3]);
+    __m256 t4 = _mm256_unpacklo_ps(r[4], r[5]);
+    __m256 t5 = _mm256_unpackhi_ps(r[4], r[5]);
+    __m256 t6 = _mm256_unpacklo_ps(r[6], r[7]);
+    __m256 t7 = _mm256_unpackhi_ps(r[6], r[7]);
+    __m256 u0 = _mm256_shuffle_ps(t0, t2, 0x44);
+    __m256 u1 = _mm256_shuffle_ps(t0, t2, 0xEE);
+    __m256 u2 = _mm256_shuffle_ps(t1, t3, 0x44);
+    __m256 u3 = _mm256_shuffle_ps(t1, t3, 0xEE);
+    __m256 u4 = _mm256_shuffle_ps(t4, t6, 0x44);
+    __m256 u5 = _mm256_shuffle_ps(t4, t6, 0xEE);
+    __m256 u6 = _mm256_shuffle_ps(t5, t7, 0x44);
+    __m256 u7 = _mm256_shuffle_ps(t5, t7, 0xEE);
+    r[0] = _mm256_permute2f128_ps(u0, u4, 0x20);
+    r[1] = _mm256_permute2f128_ps(u1, u5, 0x20);
+    r[2] = _mm256_permute2f128_ps(u2, u6, 0x20);
+    r[3] = _mm256_permute2f128_ps(u3, u7, 0x20);
+    r[4] = _mm256_permute2f128_ps(u0, u4, 0x31);
+    r[5] = _mm256_permute2f128_ps(u1, u5, 0x31);
+    r[6] = _mm256_permute2f128_ps(u2, u6, 0x31);
+    r[7] = _mm256_permute2f128_ps(u3, u7, 0x31);
+}
+
+/*
+One whole block per iteration, a row per register
+*/
+__attribute__((target("avx2")))
+static void forwardDctAvx2(float (*blocks)[JPEG_BLOCK_SIZE], size_t count)
+{
+    for (size_t n = 0; n < count; n++) {
+        float *b = blocks[n];
+        __m256 r[JPEG_BLOCK_ROW];
+        for (size_t i = 0; i < JPEG_BLOCK_ROW; i++) {
+            r[i] = _mm256_loadu_ps(b + i * JPEG_BLOCK_ROW);
+        }
+        fdct8(r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7]);
+        transpose8x8(r);
+        fdct8(r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7]);
+        transpose8x8(r);
+        for (size_t i = 0; i < JPEG_BLOCK_ROW; i++) {
+            _mm256_storeu_ps(b + i * JPEG_BLOCK_ROW, r[i]);
+        }
+    }
+}
+
+#endif
+
+Jpeg::SimdLevel Jpeg::detectSimd()
+{
+#ifdef JPEG_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return SIMD_SSE2;
+    }
+#endif
+    return SIMD_NONE;
+}
+
+using fdct_t = void (*)(float (*)[JPEG_BLOCK_SIZE], size_t);
+
+static fdct_t selectForwardDct(Jpeg::SimdLevel level)
+{
+    switch (std::min(level, Jpeg::detectSimd())) {
+#ifdef JPEG_X86_SIMD
+        case Jpeg::SIMD_AVX2:
+            return forwardDctAvx2;
+        case Jpeg::SIMD_SSE2:
+            return forwardDctSse2;
+#endif
+        default:
+            return forwardDctFloat;
+    }
+}
+
+static const fdct_t bestForwardDct = selectForwardDct(Jpeg::SIMD_AVX2);
+
+void Jpeg::forwardDct(float (*blocks)[JPEG_BLOCK_SIZE], size_t count)
+{
+    bestForwardDct(blocks, count);
+}
+
+void Jpeg::forwardDct(float (*blocks)[JPEG_BLOCK_SIZE], size_t count, SimdLevel level)
+{
+    selectForwardDct(level)(blocks, count);
+}
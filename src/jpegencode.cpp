@@ -3,122 +3,18 @@ jpegencode.cpp
 */
 
 #include <iostream>
-#include <sstream>
 #include <cmath>
 #include <cstdint>
 // #include <endian.h>
 #include <climits>
+#include <vector>
+#include <algorithm>
+#ifdef _OPENMP
 #include <omp.h>
+#endif
 #include "bitutil.hpp"
 #include "jpegutil.hpp"
-
-#define SYMBOL_LENGTHS 16
-#define SYMBOL_CAP 256
-
-static Jpeg::codes_t defaultEncodingCodes;
-const std::int16_t defaultDcLuminance[SYMBOL_LENGTHS][SYMBOL_CAP] = {
-    {-1},
-    {0, -1},
-    {1, 2, 3, 4, 5, -1},
-    {6, -1},
-    {7, -1},
-    {8, -1},
-    {9, -1},
-    {10, -1},
-    {11, -1},
-    {-1},
-    {-1},
-    {-1},
-    {-1},
-    {-1},
-    {-1},
-    {-1}
-};
-const std::int16_t defaultDcChrominance[SYMBOL_LENGTHS][SYMBOL_CAP] = {
-    {-1},
-    {0, 1, 2, -1},
-    {3, -1},
-    {4, -1},
-    {5, -1},
-    {6, -1},
-    {7, -1},
-    {8, -1},
-    {9, -1},
-    {10, -1},
-    {11, -1},
-    {-1},
-    {-1},
-    {-1},
-    {-1},
-    {-1}
-};
-const std::int16_t defaultAcLuminance[SYMBOL_LENGTHS][SYMBOL_CAP] = {
-    {-1},
-    {0x01, 0x02, -1},
-    {0x03, -1},
-    {0x00, 0x04, 0x11, -1},
-    {0x05, 0x12, 0x21, -1},
-    {0x31, 0x41, -1},
-    {0x06, 0x13, 0x51, 0x61, -1},
-    {0x07, 0x22, 0x71, -1},
-    {0x14, 0x32, 0x81, 0x91, 0xA1, -1},
-    {0x08, 0x23, 0x42, 0xB1, 0xC1, -1},
-    {0x15, 0x52, 0xD1, 0xF0, -1},
-    {0x24, 0x33, 0x62, 0x72, -1},
-    {-1},
-    {-1},
-    {0x82, -1},
-    {0x09, 0x0A,
-     0x16, 0x17, 0x18, 0x19, 0x1A,
-     0x25, 0x26, 0x27, 0x28, 0x29, 0x2A,
-     0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A,
-     0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A,
-     0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A,
-     0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A,
-     0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x78, 0x7A,
-     0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8A,
-     0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A,
-     0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA,
-     0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA,
-     0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA,
-     0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
-     0xE1, 0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA,
-     0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA,
-    -1}
-};
-const std::int16_t defaultAcChrominance[SYMBOL_LENGTHS][SYMBOL_CAP] = {
-    {-1},
-    {0x00, 0x01, -1},
-    {0x02, -1},
-    {0x03, 0x11, -1},
-    {0x04, 0x05, 0x21, 0x31, -1},
-    {0x06, 0x12, 0x41, 0x51, -1},
-    {0x07, 0x61, 0x71, -1},
-    {0x13, 0x22, 0x32, 0x81, -1},
-    {0x08, 0x14, 0x42, 0x91, 0xA1, 0xB1, 0xC1, -1},
-    {0x09, 0x23, 0x33, 0x52, 0xF0, -1},
-    {0x15, 0x62, 0x72, 0xD1, -1},
-    {0x0A, 0x16, 0x24, 0x34, -1},
-    {-1},
-    {0xE1, -1},
-    {0x25, 0xF1, -1},
-    {0x17, 0x18, 0x19, 0x1A,
-     0x26, 0x27, 0x28, 0x29, 0x2A,
-     0x35, 0x36, 0x37, 0x38, 0x39, 0x3A,
-     0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A,
-     0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A,
-     0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A,
-     0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x78, 0x7A,
-     0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8A,
-     0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A,
-     0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA,
-     0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA,
-     0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA,
-     0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
-     0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA,
-     0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA,
-    -1}
-};
+#include "jpeginternal.hpp"
 
 /*
 u-major, so given u and x, use the coefficient at 8u + x
@@ -167,650 +63,1143 @@ const Jpeg::dqt_t Jpeg::defaultChrominanceQTable[JPEG_BLOCK_SIZE] = {
     99, 99, 99, 99, 99, 99, 99, 99
 };
 
-inline float accumRowRGB(const std::uint8_t *rgb,
-    size_t width, size_t height,
-    size_t component, size_t bitDepth,
-    int numX, int denX,
-    size_t x0, size_t x, size_t y)
-{
-    float row = 0;
-    float step = (float)denX / numX;
-    float startX = x0 + x * step;
-    float endX = startX + step;
-    if ((x * denX) % numX != 0) {
-        size_t coord = Jpeg::getPixelCoord(std::floor(startX), y, width, height);
-        const std::uint8_t *sample = rgb + 3 * coord;
-        row += (Jpeg::componentFromRGB(sample, component)) * (std::ceil(startX) - startX);
-    }
-    for (size_t ix = std::ceil(startX); ix < std::floor(endX); ix++) {
-        size_t coord = Jpeg::getPixelCoord(ix, y, width, height);
-        const std::uint8_t *sample = rgb + 3 * coord;
-        row += Jpeg::componentFromRGB(sample, component);
-    }
-    if ((x * denX + denX) % numX != 0) {
-        size_t coord = Jpeg::getPixelCoord(std::floor(endX), y, width, height);
-        const std::uint8_t *sample = rgb + 3 * coord;
-        row += (Jpeg::componentFromRGB(sample, component)) * (endX - std::ceil(endX));
-    }
-    return row / step;
-}
-
-inline float accumRowRGBi(const std::uint8_t *rgb,
-    size_t width, size_t height,
-    size_t component, size_t bitDepth,
-    int numX, int denX,
-    size_t x0, size_t x, size_t y)
-{
-    float row = 0;
-    int step = denX / numX;
-    size_t startX = x0 + x * step;
-    size_t endX = startX + step;
-    for (size_t ix = startX; ix < endX; ix++) {
-        size_t coord = Jpeg::getPixelCoord(ix, y, width, height);
-        const std::uint8_t *sample = rgb + 3 * coord;
-        row += Jpeg::componentFromRGB(sample, component);
-    }
-    return row / step;
-}
-
-inline float accumBlockRGB(const std::uint8_t *rgb,
-    size_t width, size_t height, 
-    size_t component, size_t bitDepth,
-    int numX, int denX,
-    int numY, int denY,
-    size_t x0, size_t y0,
-    size_t x, size_t y)
-{
-    float block = 0;
-    float step = (float)denY / numY;
-    float startY = y0 + y * step;
-    float endY = startY + step;
-    if ((y * denY) % numY != 0) {
-        block += (std::ceil(startY) - startY) * accumRowRGB(rgb, width, height, component, bitDepth, numX, denX, x0, x, std::floor(startY));
-    }
-    for (size_t iy = std::ceil(startY); iy < std::floor(endY); iy++) {
-        block += accumRowRGB(rgb, width, height, component, bitDepth, numX, denX, x0, x, iy);
-    }
-    if ((y * denY + denY) % numY != 0) {
-        block += (endY - std::ceil(endY)) * accumRowRGB(rgb, width, height, component, bitDepth, numX, denX, x0, x, std::floor(endY));
-    }
-    return block / step;
-}
-
-inline float accumBlockRGBi(const std::uint8_t *rgb,
-    size_t width, size_t height, 
-    size_t component, size_t bitDepth,
-    int numX, int denX,
-    int numY, int denY,
-    size_t x0, size_t y0,
-    size_t x, size_t y)
-{
-    float block = 0;
-    int step = denY / numY;
-    size_t startY = y0 + y * step;
-    size_t endY = startY + step;
-    for (size_t iy = startY; iy < endY; iy++) {
-        block += accumRowRGBi(rgb, width, height, component, bitDepth, numX, denX, x0, x, iy);
-    }
-    return block / step;
-}
-
-const float inverseSqrtTwo = 0.7071067811865476;
-
-const static float dct8_scales[8] = {
-	0.353553390593273762200422,
-	0.254897789552079584470970,
-	0.270598050073098492199862,
-	0.300672443467522640271861,
-	0.353553390593273762200422,
-	0.449988111568207852319255,
-	0.653281482438188263928322,
-	1.281457723870753089398043,
-};
+/*
+Convert one MCU row of input into planar Y, Cb and Cr, each planeWidth wide
+and mcuHeight tall, repeating the last column and row past the image edge
+*/
+void convertMcuRowRGB(const Jpeg::JpegPixels& pixels,
+    size_t width, size_t rows, size_t y0,
+    size_t planeWidth, size_t mcuHeight,
+    std::uint8_t *planes)
+{
+    size_t planeSize = planeWidth * mcuHeight;
+    for (size_t y = 0; y < mcuHeight; y++) {
+        size_t srcY = std::min(y0 + y, rows - 1);
+        std::uint8_t *dst[3] = {
+            planes + y * planeWidth,
+            planes + planeSize + y * planeWidth,
+            planes + 2 * planeSize + y * planeWidth
+        };
+        if (y > 0 && y0 + y >= rows) {
+            /* Past the bottom edge, repeat the row above */
+            for (size_t c = 0; c < 3; c++) {
+                std::copy(dst[c] - planeWidth, dst[c], dst[c]);
+            }
+            continue;
+        }
+        Jpeg::convertRow(pixels.format, Jpeg::pixelRow(pixels, width, rows, srcY), width,
+            dst[0], dst[1], dst[2]);
+        for (size_t c = 0; c < 3; c++) {
+            std::fill(dst[c] + width, dst[c] + planeWidth, dst[c][width - 1]);
+        }
+    }
+}
 
-const static float dct8_consts[5] = {
-	0.707106781186547524400844,
-	0.541196100146196984399723,
-	0.707106781186547524400844,
-	1.306562964876376527856643,
-	0.382683432365089771728460,
-};
+/*
+Copy one MCU row of Y, Cb and Cr input into full resolution planes as
+convertMcuRowRGB does, repeating each chroma sample over the pixels it covers
+*/
+void convertMcuRowYCbCr(const Jpeg::JpegYCbCr& ycbcr,
+    size_t width, size_t height, size_t y0,
+    size_t planeWidth, size_t mcuHeight,
+    std::uint8_t *planes)
+{
+    size_t planeSize = planeWidth * mcuHeight;
+    for (size_t y = 0; y < mcuHeight; y++) {
+        for (size_t c = 0; c < 3; c++) {
+            std::uint8_t *dst = planes + c * planeSize + y * planeWidth;
+            if (y > 0 && y0 + y >= height) {
+                std::copy(dst - planeWidth, dst, dst);
+                continue;
+            }
+            size_t subX = c == 0 ? 1 : ycbcr.subsampling.first;
+            size_t subY = c == 0 ? 1 : ycbcr.subsampling.second;
+            size_t step = ycbcr.step[c];
+            const std::uint8_t *src = ycbcr.data[c] + std::min(y0 + y, height - 1) / subY * ycbcr.stride[c];
+            if (subX == 1 && step == 1) {
+                std::copy(src, src + width, dst);
+            }
+            else {
+                for (size_t x = 0; x < width; x++) {
+                    dst[x] = src[x / subX * step];
+                }
+            }
+            std::fill(dst + width, dst + planeWidth, dst[width - 1]);
+        }
+    }
+}
 
-void DCT8(Jpeg::dct_t *data, size_t stride)
-{
-    // Jpeg::dct_t buffer[JPEG_DCT_SIZE];
-    // for(size_t u = 0; u < JPEG_DCT_SIZE; u++) {
-        // float point = 0;
-        // for(size_t x = 0; x < JPEG_DCT_SIZE; x++) {
-            // point += data[x * stride] * Jpeg::dctCoeffs[u * 8 + x];
-        // }
-        // buffer[u] = std::round(point) / 2;
-    // }
-    // buffer[0] *= inverseSqrtTwo;
-    // for (size_t i = 0; i < JPEG_DCT_SIZE; i++) {
-        // data[i * stride] = buffer[i];
-    // }
-    // return;
-    
-    // Idea from https://web.stanford.edu/class/ee398a/handouts/lectures/07-TransformCoding.pdf#page=30
-    float v0 = data[0 * stride] + data[7 * stride];
-    float v1 = data[1 * stride] + data[6 * stride];
-    float v2 = data[2 * stride] + data[5 * stride];
-    float v3 = data[3 * stride] + data[4 * stride];
-    float v4 = data[3 * stride] - data[4 * stride];
-    float v5 = data[2 * stride] - data[5 * stride];
-    float v6 = data[1 * stride] - data[6 * stride];
-    float v7 = data[0 * stride] - data[7 * stride];
-    
-    float w0 = v0 + v3;
-    float w1 = v1 + v2;
-    float w2 = v1 - v2;
-    float w3 = v0 - v3;
-    float w4 = -(v4 + v5);
-    float w5 = v5 + v6;
-    float w6 = v6 + v7;
-    float w7 = v7;
-    
-    v0 = w0 + w1;
-    v1 = w0 - w1;
-    v2 = w2 + w3;
-    v3 = w3;
-    v4 = w4;
-    v5 = w5;
-    v6 = w6;
-    v7 = w7;
-    
-    float y = (v4 + v6) * dct8_consts[4];
-    
-    w0 = v0;
-    w1 = v1;
-    w2 = v2 * dct8_consts[0];
-    w3 = v3;
-    w4 = -y - v4 * dct8_consts[1];
-    w5 = v5 * dct8_consts[2];
-    w6 = v6 * dct8_consts[3] - y;
-    w7 = v7;
-    
-    v0 = w0;
-    v1 = w1;
-    v2 = w2 + w3;
-    v3 = w3 - w2;
-    v4 = w4;
-    v5 = w5 + w7;
-    v6 = w6;
-    v7 = w7 - w5;
-    
-    w0 = v0;
-    w1 = v1;
-    w2 = v2;
-    w3 = v3;
-    w4 = v4 + v7;
-    w5 = v5 + v6;
-    w6 = v5 - v6;
-    w7 = v7 - v4;
-    
-    data[0 * stride] = dct8_scales[0] * w0;
-    data[4 * stride] = dct8_scales[4] * w1;
-    data[2 * stride] = dct8_scales[2] * w2;
-    data[6 * stride] = dct8_scales[6] * w3;
-    data[5 * stride] = dct8_scales[5] * w4;
-    data[1 * stride] = dct8_scales[1] * w5;
-    data[7 * stride] = dct8_scales[7] * w6;
-    data[3 * stride] = dct8_scales[3] * w7;
+size_t Jpeg::boxWeights(float start, float end, size_t *index, float *weight)
+{
+    size_t count = 0;
+    float x = std::ceil(start);
+    if (x != start) {
+        /* The box may also end inside its first sample */
+        index[count] = std::floor(start);
+        weight[count++] = std::min(x, end) - start;
+    }
+    for (; x < std::floor(end); x++) {
+        index[count] = x;
+        weight[count++] = 1;
+    }
+    if (x < end) {
+        index[count] = x;
+        weight[count++] = end - x;
+    }
+    return count;
 }
 
-void Jpeg::Jpeg::encodeRGB(const std::uint8_t *rgb)
+/*
+Box sums of blockifyComponent when each output sample covers stepX by
+stepY whole pixels; inlined, so constant steps unroll
+*/
+__attribute__((always_inline)) inline void blockifyWholeBoxes(const std::uint8_t *plane, size_t planeWidth,
+    int numX, int numY, int stepX, int stepY, int levelShift,
+    float (*cBlocks)[JPEG_BLOCK_SIZE])
+{
+    int area = stepX * stepY;
+    for (size_t yBlock = 0; yBlock < numY; yBlock++) {
+    for (size_t xBlock = 0; xBlock < numX; xBlock++) {
+        float *cBlock = cBlocks[yBlock * numX + xBlock];
+        const std::uint8_t *origin = plane +
+            yBlock * JPEG_BLOCK_ROW * stepY * planeWidth +
+            xBlock * JPEG_BLOCK_ROW * stepX;
+        for (size_t oy = 0; oy < JPEG_BLOCK_ROW; oy++) {
+            const std::uint8_t *row = origin + oy * stepY * planeWidth;
+            for (size_t ox = 0; ox < JPEG_BLOCK_ROW; ox++) {
+                int sum = 0;
+                for (int dy = 0; dy < stepY; dy++) {
+                    for (int dx = 0; dx < stepX; dx++) {
+                        sum += row[dy * planeWidth + ox * stepX + dx];
+                    }
+                }
+                cBlock[oy * JPEG_BLOCK_ROW + ox] = (sum + area / 2) / area - levelShift;
+            }
+        }
+    }
+    }
+}
+
+void Jpeg::blockifyComponent(const std::uint8_t *plane, size_t planeWidth,
+    int numX, int numY, int denX, int denY, int levelShift,
+    float (*cBlocks)[JPEG_BLOCK_SIZE])
+{
+    if (denX % numX == 0 && denY % numY == 0) {
+        /* Whole pixel boxes */
+        blockifyWholeBoxes(plane, planeWidth, numX, numY, denX / numX, denY / numY,
+            levelShift, cBlocks);
+        return;
+    }
+    /* Fractional boxes, each output sample covers den/num pixels each way */
+    float stepX = (float)denX / numX;
+    float stepY = (float)denY / numY;
+    size_t xIndex[JPEG_MAX_SAMPLING + 2], yIndex[JPEG_MAX_SAMPLING + 2];
+    float xWeight[JPEG_MAX_SAMPLING + 2], yWeight[JPEG_MAX_SAMPLING + 2];
+    for (size_t yBlock = 0; yBlock < numY; yBlock++) {
+    for (size_t xBlock = 0; xBlock < numX; xBlock++) {
+        float *cBlock = cBlocks[yBlock * numX + xBlock];
+        for (size_t oy = 0; oy < JPEG_BLOCK_ROW; oy++) {
+            float startY = (yBlock * JPEG_BLOCK_ROW + oy) * stepY;
+            size_t rowsCovered = boxWeights(startY, startY + stepY, yIndex, yWeight);
+            for (size_t ox = 0; ox < JPEG_BLOCK_ROW; ox++) {
+                float startX = (xBlock * JPEG_BLOCK_ROW + ox) * stepX;
+                size_t colsCovered = boxWeights(startX, startX + stepX, xIndex, xWeight);
+                float sum = 0;
+                for (size_t iy = 0; iy < rowsCovered; iy++) {
+                    const std::uint8_t *row = plane + yIndex[iy] * planeWidth;
+                    float rowSum = 0;
+                    for (size_t ix = 0; ix < colsCovered; ix++) {
+                        rowSum += row[xIndex[ix]] * xWeight[ix];
+                    }
+                    sum += rowSum * yWeight[iy];
+                }
+                cBlock[oy * JPEG_BLOCK_ROW + ox] = std::round(sum / (stepX * stepY)) - levelShift;
+            }
+        }
+    }
+    }
+}
+
+/*
+blockifyComponent for boxes of StepX by StepY whole pixels, known at
+compile time so the box sums unroll and the division is by a constant
+*/
+template <int StepX, int StepY>
+void blockifyBoxes(const std::uint8_t *plane, size_t planeWidth,
+    int numX, int numY, int, int, int levelShift,
+    float (*cBlocks)[JPEG_BLOCK_SIZE])
+{
+    blockifyWholeBoxes(plane, planeWidth, numX, numY, StepX, StepY, levelShift, cBlocks);
+}
+
+Jpeg::BlockifyKernel Jpeg::blockifyKernel(int numX, int numY, int denX, int denY)
+{
+    if (denX % numX != 0 || denY % numY != 0) {
+        return blockifyComponent;
+    }
+    int stepX = denX / numX;
+    int stepY = denY / numY;
+    if (stepX == 1 && stepY == 1) {
+        /* Full resolution: every component of 4:4:4 and gray, luma of the rest */
+        return blockifyBoxes<1, 1>;
+    }
+    if (stepX == 2 && stepY == 1) {
+        return blockifyBoxes<2, 1>; // 4:2:2 chroma
+    }
+    if (stepX == 2 && stepY == 2) {
+        return blockifyBoxes<2, 2>; // 4:2:0 chroma
+    }
+    if (stepX == 1 && stepY == 2) {
+        return blockifyBoxes<1, 2>; // 4:4:0 chroma
+    }
+    return blockifyComponent;
+}
+
+/*
+Count the symbols of one component's blocks in an MCU, just quantized
+
+predictor: DC of the component's previous block in the MCU row
+continues: the first block's DC difference is from the previous MCU row,
+which may be on another thread, so it is counted once all rows are done
+*/
+void countComponentBlocks(const Jpeg::coef_t (*blocks)[JPEG_BLOCK_SIZE], size_t numBlocks,
+    const Jpeg::JpegComponent& comp, bool continues,
+    Jpeg::dct_t& predictor, Jpeg::histograms_t& histograms)
+{
+    std::uint64_t *dcCounts = histograms.first[comp.dcTable].counts;
+    Jpeg::JpegHistogram& acCounts = histograms.second[comp.acTable];
+    for (size_t iBlock = 0; iBlock < numBlocks; iBlock++) {
+        Jpeg::dct_t dc = blocks[iBlock][0];
+        if (iBlock != 0 || !continues) {
+            dcCounts[Jpeg::splitNumber(dc - predictor).first]++;
+        }
+        predictor = dc;
+        Jpeg::countAcSymbols(blocks[iBlock], acCounts);
+    }
+}
+
+/*
+Count the DC differences into the first block of each MCU row, left out
+by countComponentBlocks
+*/
+void countRowStarts(const Jpeg::JpegSettings& settings,
+    const Jpeg::coef_t (*blocks)[JPEG_BLOCK_SIZE],
+    size_t numMcuRows, Jpeg::histograms_t& histograms)
+{
+    size_t mcusPerRow = settings.numMcus.first;
+    size_t interval = settings.resetInterval;
+    for (size_t yMcu = 1; yMcu < numMcuRows; yMcu++) {
+        size_t iMcu = yMcu * mcusPerRow;
+        if (interval != 0 && iMcu % interval == 0) {
+            continue;
+        }
+        for (size_t iComp = 0; iComp < settings.components.size(); iComp++) {
+            const Jpeg::JpegComponent& comp = settings.components[iComp];
+            size_t offset = settings.componentOffsets[iComp];
+            size_t numBlocks = comp.sampling.first * comp.sampling.second;
+            Jpeg::dct_t previous = blocks[(iMcu - 1) * settings.mcuSize + offset + numBlocks - 1][0];
+            Jpeg::dct_t current = blocks[iMcu * settings.mcuSize + offset][0];
+            histograms.first[comp.dcTable].counts[Jpeg::splitNumber(current - previous).first]++;
+        }
+    }
+}
+
+/*
+std::round of a quotient well inside the int range, without a call into
+libm: the fraction truncation leaves is exact, so halves still go away
+from zero
+*/
+inline Jpeg::coef_t roundQuotient(float value)
+{
+    int truncated = (int)value;
+    float fraction = value - (float)truncated;
+    return (Jpeg::coef_t)(truncated + (fraction >= 0.5f) - (fraction <= -0.5f));
+}
+
+/*
+Each component's quantization table as floats, in natural order, or
+zigzagged to divide coefficients kept in zigzag order
+*/
+void quantDivisors(const Jpeg::JpegSettings& settings, bool zigzagged,
+    float (*divisors)[JPEG_BLOCK_SIZE])
+{
+    for (size_t iComp = 0; iComp < settings.components.size(); iComp++) {
+        const Jpeg::dqt_t *qTable = settings.qtables[settings.components[iComp].qtable];
+        for (size_t i = 0; i < JPEG_BLOCK_SIZE; i++) {
+            divisors[iComp][i] = qTable[zigzagged ? Jpeg::zigzag[i] : i];
+        }
+    }
+}
+
+/*
+Quantize a block of DCT output in natural order, zigzagging the result
+*/
+void quantizeBlock(const float *block, const float *divisors, Jpeg::coef_t *out)
+{
+    /* Divided in order, so the loop vectorizes, then moved */
+    Jpeg::coef_t natural[JPEG_BLOCK_SIZE];
+    for (size_t i = 0; i < JPEG_BLOCK_SIZE; i++) {
+        natural[i] = roundQuotient(block[i] / divisors[i]);
+    }
+    for (size_t i = 0; i < JPEG_BLOCK_SIZE; i++) {
+        out[i] = natural[Jpeg::zigzag[i]];
+    }
+}
+
+/*
+Sample, DCT and quantize MCU row yMcu of a stripe, as encodeStripeRGB
+
+planes: the Y, Cb and Cr of the row at full resolution, as convertMcuRowRGB
+leaves them
+counted: if given, gets the symbols of the row except its first DC
+difference of each component, which countRowStarts adds
+*/
+void encodeMcuRowPlanes(const Jpeg::JpegSettings& settings, size_t yMcu,
+    const std::uint8_t *planes, Jpeg::coef_t (*blocks)[JPEG_BLOCK_SIZE],
+    Jpeg::histograms_t *counted, float (*coefficients)[JPEG_BLOCK_SIZE])
 {
     int denX = settings.mcuScale.first;
     int denY = settings.mcuScale.second;
     /* Size of each MCU in pixels */
     size_t mcuWidth = denX * JPEG_BLOCK_ROW;
     size_t mcuHeight = denY * JPEG_BLOCK_ROW;
-    size_t rowPitch = mcuWidth * settings.numMcus.first;
+    size_t planeWidth = mcuWidth * settings.numMcus.first;
+    size_t planeSize = planeWidth * mcuHeight;
+    int levelShift = 1 << (settings.bitDepth - 1);
+    size_t interval = settings.resetInterval;
     
+    Jpeg::BlockifyKernel kernels[JPEG_MAX_COMPONENTS];
+    for (size_t iComp = 0; iComp < settings.components.size(); iComp++) {
+        kernels[iComp] = Jpeg::blockifyKernel(settings.components[iComp].sampling.first,
+            settings.components[iComp].sampling.second, denX, denY);
+    }
+    float divisors[JPEG_MAX_COMPONENTS][JPEG_BLOCK_SIZE];
+    quantDivisors(settings, false, divisors);
     
-    /* Iterate each MCU */
-    #pragma omp parallel for collapse(2)
-    for (size_t yMcu = 0; yMcu < settings.numMcus.second; yMcu++) {
+    Jpeg::dct_t predictors[JPEG_MAX_COMPONENTS] = {0};
     for (size_t xMcu = 0; xMcu < settings.numMcus.first; xMcu++) {
-        dct_t tBlock[JPEG_BLOCK_SIZE];
-        size_t mcuInputStartY = yMcu * mcuHeight;
-        size_t mcuInputStartX = xMcu * mcuWidth;
-        size_t mcuOutputStart = settings.mcuSize * (yMcu * settings.numMcus.first + xMcu);
+        alignas(32) float cBlocks[JPEG_MAX_SAMPLING * JPEG_MAX_SAMPLING][JPEG_BLOCK_SIZE];
+        size_t iMcu = yMcu * settings.numMcus.first + xMcu;
+        size_t mcuOutputStart = settings.mcuSize * iMcu;
+        bool restart = interval != 0 && iMcu % interval == 0;
+        if (restart) {
+            std::fill(predictors, predictors + JPEG_MAX_COMPONENTS, 0);
+        }
         /* Iterate each component */
         for (size_t iComp = 0; iComp < settings.components.size(); iComp++) {
             int numX = settings.components[iComp].sampling.first;
             int numY = settings.components[iComp].sampling.second;
-            auto accumFunc = accumBlockRGB;
-            if ((denX % numX == 0) && (denY % numY == 0)) {
-                accumFunc = accumBlockRGBi;
-            }
-            /* Number of pixels of the input image to be scanned over for each block in this component */
-            size_t blockWidth = JPEG_BLOCK_ROW * numX / denX;
-            size_t blockHeight = JPEG_BLOCK_ROW * numY / denY;
             size_t compOutputStart = settings.componentOffsets[iComp] + mcuOutputStart;
-            const dqt_t *qTable = settings.qtables[settings.components[iComp].qtable];
-            /* Iterate each block */
-            for (size_t yBlock = 0; yBlock < numY; yBlock++) {
-            for (size_t xBlock = 0; xBlock < numX; xBlock++) {
-                size_t blockInputStartY = yBlock * blockHeight + mcuInputStartY;
-                size_t blockInputStartX = xBlock * blockWidth + mcuInputStartX;
-                size_t blockNum = yBlock * numX + xBlock + compOutputStart;
-                /* Iterate over each output sample */
-                for (size_t ox = 0; ox < JPEG_BLOCK_ROW; ox++) {
-                for (size_t oy = 0; oy < JPEG_BLOCK_ROW; oy++) {
-                    dct_t sample = (dct_t)std::round(accumFunc(rgb,
-                        settings.size.first, settings.size.second,
-                        iComp, settings.bitDepth,
-                        numX, denX, numY, denY,
-                        blockInputStartX, blockInputStartY, ox, oy));
-                    sample = std::max(dct_t{0}, std::min((dct_t)(1 << settings.bitDepth) - 1, sample));
-                    sample -= 1 << (settings.bitDepth - 1);
-                    const size_t index = oy * JPEG_BLOCK_ROW + ox;
-                    // std::cout << index << ": " << sample << std::endl;
-                    tBlock[index] = sample;
-                }
-                }
-                /* Row-wise DCTs */
-                for (size_t i = 0; i < JPEG_BLOCK_ROW; i++) {
-                    DCT8(tBlock + i * JPEG_BLOCK_ROW, 1);
-                }
-                /* Column-wise DCTs */
-                for (size_t i = 0; i < JPEG_BLOCK_ROW; i++) {
-                    DCT8(tBlock + i, JPEG_BLOCK_ROW);
-                }
-                /* Copy zigzagged and quantized to the block */
-                for (size_t i = 0; i < JPEG_BLOCK_SIZE; i++) {
-                    size_t index = zigzag[i];
-                    blocks[blockNum][i] = (dct_t)std::round((float)tBlock[index] / qTable[index]);
+            /* Components past Cr reuse it, as componentFromRGB does */
+            const std::uint8_t *plane = planes + std::min(iComp, size_t{2}) * planeSize;
+            kernels[iComp](plane + xMcu * mcuWidth, planeWidth,
+                numX, numY, denX, denY, levelShift, cBlocks);
+            /* All blocks of this component in the MCU go through the DCT together */
+            size_t numBlocks = numX * numY;
+            Jpeg::forwardDct(cBlocks, numBlocks);
+            if (coefficients != nullptr) {
+                for (size_t iBlock = 0; iBlock < numBlocks; iBlock++) {
+                    for (size_t i = 0; i < JPEG_BLOCK_SIZE; i++) {
+                        coefficients[compOutputStart + iBlock][i] = cBlocks[iBlock][Jpeg::zigzag[i]];
+                    }
                 }
             }
+            /* Copy zigzagged and quantized to the block */
+            for (size_t iBlock = 0; iBlock < numBlocks; iBlock++) {
+                quantizeBlock(cBlocks[iBlock], divisors[iComp], blocks[compOutputStart + iBlock]);
+            }
+            if (counted != nullptr) {
+                /* Counted while the blocks are still in cache */
+                countComponentBlocks(blocks + compOutputStart, numBlocks,
+                    settings.components[iComp], xMcu == 0 && yMcu != 0 && !restart,
+                    predictors[iComp], *counted);
             }
         }
     }
-    }
 }
 
-void Jpeg::Jpeg::encodeDeltas()
+/*
+Color convert, DCT and quantize MCU row yMcu of a stripe
+
+planes: scratch for the Y, Cb and Cr of the row
+*/
+void encodeMcuRowRGB(const Jpeg::JpegSettings& settings,
+    const Jpeg::JpegPixels& pixels, size_t rows, size_t yMcu,
+    Jpeg::coef_t (*blocks)[JPEG_BLOCK_SIZE], std::uint8_t *planes,
+    Jpeg::histograms_t *counted, float (*coefficients)[JPEG_BLOCK_SIZE])
 {
-    /* Iterate every component */
-    #pragma omp parallel for
-    for (size_t iComp = 0; iComp < settings.components.size(); iComp++) {
-        dct_t predictor = 0;
-        /* Iterate over every MCU */
-        for (size_t iMcu = 0; iMcu < settings.numMcus.first * settings.numMcus.second; iMcu++) {
-            if (settings.resetInterval != 0 && iMcu % settings.resetInterval == 0) {
-                predictor = 0;
-            }
-            /* Iterate over every block in MCU of this component */
-            size_t numBlocks = settings.components[iComp].sampling.first * settings.components[iComp].sampling.second;
-            for (size_t iBlock = 0; iBlock < numBlocks; iBlock++) {
-                volatile dct_t *block = blocks[iBlock + settings.componentOffsets[iComp] + iMcu * settings.mcuSize];
-                dct_t delta = block[0] - predictor;
-                predictor = block[0];
-                block[0] = delta;
-            }
-        }
-    }
+    size_t mcuHeight = settings.mcuScale.second * JPEG_BLOCK_ROW;
+    size_t planeWidth = settings.mcuScale.first * JPEG_BLOCK_ROW * settings.numMcus.first;
+    convertMcuRowRGB(pixels, settings.size.first, rows, yMcu * mcuHeight, planeWidth, mcuHeight, planes);
+    encodeMcuRowPlanes(settings, yMcu, planes, blocks, counted, coefficients);
 }
 
-using split_t = std::pair<std::uint8_t, std::uint16_t>;
+/*
+Bytes of the Y, Cb and Cr planes of one MCU row
+*/
+size_t mcuRowPlanesSize(const Jpeg::JpegSettings& settings)
+{
+    return 3 * settings.mcuScale.first * JPEG_BLOCK_ROW * settings.numMcus.first *
+        settings.mcuScale.second * JPEG_BLOCK_ROW;
+}
 
-split_t splitNumber(Jpeg::dct_t number)
+/*
+Share numMcuRows MCU rows out in a parallel region, filling each row's full
+resolution planes with convert(yMcu, planes) and encoding them as
+encodeMcuRowPlanes; the other arguments are as for encodeStripeRGB
+*/
+template <typename Convert>
+void encodeMcuRows(const Jpeg::JpegSettings& settings, size_t numMcuRows,
+    Jpeg::coef_t (*blocks)[JPEG_BLOCK_SIZE], Jpeg::histograms_t *histograms,
+    float (*coefficients)[JPEG_BLOCK_SIZE], Jpeg::JpegWorkspace *workspace,
+    const Convert& convert)
 {
-    if (number == 0) {
-        return split_t(0, 0);
+    size_t numThreads = 1;
+#ifdef _OPENMP
+    numThreads = omp_get_max_threads();
+#endif
+    if (workspace != nullptr && workspace->planes.size() < numThreads) {
+        workspace->planes.resize(numThreads);
+        workspace->counted.resize(numThreads);
+    }
+    
+    #pragma omp parallel
+    {
+    size_t thread = 0;
+#ifdef _OPENMP
+    thread = omp_get_thread_num();
+#endif
+    std::vector<std::uint8_t> ownPlanes;
+    Jpeg::histograms_t ownCounted;
+    /* Y, Cb and Cr of one MCU row, converted once and read by every block */
+    std::vector<std::uint8_t>& planes = workspace != nullptr ? workspace->planes[thread] : ownPlanes;
+    /* Symbols of this thread's rows */
+    Jpeg::histograms_t& counted = workspace != nullptr ? workspace->counted[thread] : ownCounted;
+    planes.resize(mcuRowPlanesSize(settings));
+    if (histograms != nullptr) {
+        Jpeg::resetHistograms(settings, counted);
+    }
+    
+    /* Iterate each MCU row */
+    #pragma omp for schedule(dynamic)
+    for (size_t yMcu = 0; yMcu < numMcuRows; yMcu++) {
+        convert(yMcu, planes.data());
+        encodeMcuRowPlanes(settings, yMcu, planes.data(), blocks,
+            histograms != nullptr ? &counted : nullptr, coefficients);
+    }
+    if (histograms != nullptr) {
+        #pragma omp critical
+        Jpeg::addHistograms(*histograms, counted);
+    }
     }
-    std::uint16_t anum = number;
-    if (number < 0) {
-        anum = -anum;
-        number--;
+    
+    if (histograms != nullptr) {
+        countRowStarts(settings, blocks, numMcuRows, *histograms);
     }
-    std::uint8_t bits = BitManip::msbSet(anum) + 1;
-    anum = number & ((1 << bits) - 1);
-    return split_t(bits, anum);
 }
 
-using block_t = std::vector<split_t>;
-using mcu_t = std::vector<block_t>;
+void Jpeg::encodeStripeRGB(const JpegSettings& settings,
+    const JpegPixels& pixels, size_t rows,
+    size_t numMcuRows, coef_t (*blocks)[JPEG_BLOCK_SIZE],
+    histograms_t *histograms, float (*coefficients)[JPEG_BLOCK_SIZE],
+    JpegWorkspace *workspace)
+{
+    size_t mcuHeight = settings.mcuScale.second * JPEG_BLOCK_ROW;
+    size_t planeWidth = settings.mcuScale.first * JPEG_BLOCK_ROW * settings.numMcus.first;
+    encodeMcuRows(settings, numMcuRows, blocks, histograms, coefficients, workspace,
+        [&](size_t yMcu, std::uint8_t *planes) {
+            convertMcuRowRGB(pixels, settings.size.first, rows, yMcu * mcuHeight,
+                planeWidth, mcuHeight, planes);
+        });
+}
 
-void createJpegHuffmanCodes(
-    Jpeg::codes_t& codeList,
-    std::vector<mcu_t>& mcus,
-    Jpeg::JpegSettings& settings)
+void Jpeg::encodeStripeTasks(const JpegSettings& settings,
+    const JpegPixels& pixels, size_t rows,
+    size_t numMcuRows, coef_t (*blocks)[JPEG_BLOCK_SIZE],
+    size_t rowsPerTask, histograms_t *histograms, float (*coefficients)[JPEG_BLOCK_SIZE])
 {
-    size_t maxDc = 0, maxAc = 0;
-    for (auto it = settings.components.begin(); it != settings.components.end(); it++) {
-        maxDc = std::max(maxDc, it->dcTable);
-        maxAc = std::max(maxAc, it->acTable);
-    }
-    maxDc++;
-    maxAc++;
-    using ftable_t = std::map<int, int>;
-    using ftables = std::vector<ftable_t>;
-    ftables dcFreq(maxDc, ftable_t()), acFreq(maxAc, ftable_t());
-    ftable_t *dcTable, *acTable;
-    for (auto itMcu = mcus.begin(); itMcu != mcus.end(); itMcu++) {
-        size_t compP1 = 0; // Current component plus 1
-        mcu_t& mcu = *itMcu;
-        for (size_t iBlock = 0; iBlock < settings.mcuSize; iBlock++) {
-            if (compP1 < settings.components.size() && iBlock == settings.componentOffsets[compP1]) {
-                compP1++;
-                dcTable = &(dcFreq[settings.components[compP1 - 1].dcTable]);
-                acTable = &(acFreq[settings.components[compP1 - 1].acTable]);
-            }
-            block_t& block = mcu[iBlock];
-            /* Get DC */
-            split_t dc = block[0];
-            dcTable->insert(std::pair<int, int>(dc.first, 1));
-            (*dcTable)[dc.first]++;
-            /* Get AC */
-            for (size_t i = 1; i < block.size(); i++) {
-                split_t ac = block[i];
-                acTable->insert(std::pair<int, int>(ac.first, 1));
-                (*acTable)[ac.first]++;
-            }
+    size_t numTasks = (numMcuRows + rowsPerTask - 1) / rowsPerTask;
+    /* Waits for every row, running other tasks meanwhile */
+    #pragma omp taskloop grainsize(1)
+    for (size_t iTask = 0; iTask < numTasks; iTask++) {
+        std::vector<std::uint8_t> planes(mcuRowPlanesSize(settings));
+        histograms_t counted;
+        if (histograms != nullptr) {
+            resetHistograms(settings, counted);
         }
-    }
-    codeList.first.clear();
-    for (auto it = dcFreq.begin(); it != dcFreq.end(); it++) {
-        // for (int i = 0; i <= 11; i++) {
-            // it->insert(std::pair<int, int>(i, 1));
-        // }
-        it->insert(std::pair<int, int>(INT_MAX, 0));
-        codeList.first.push_back(Huffman::HuffmanCode(*it, 16));
-    }
-    codeList.second.clear();
-    for (auto it = acFreq.begin(); it != acFreq.end(); it++) {
-        // for (int i = 0; i < 16; i++) {
-            // for (int j = 1; j <= 10; j++) {
-                // it->insert(std::pair<int, int>((i << 4) | j, 1));
-            // }
-        // }
-        // it->insert(std::pair<int, int>(0, 1));
-        // it->insert(std::pair<int, int>(0xF0, 1));
-        it->insert(std::pair<int, int>(INT_MAX, 0));
-        codeList.second.push_back(Huffman::HuffmanCode(*it, 16));
-    }
-}
-
-Huffman::HuffmanCode fromDefault(const std::int16_t table[SYMBOL_LENGTHS][SYMBOL_CAP])
-{
-    std::vector<std::vector<int>> symbolsList;
-    symbolsList.reserve(SYMBOL_LENGTHS);
-    for (size_t i = 0; i < SYMBOL_LENGTHS; i++) {
-        std::vector<int> ofLength;
-        for (size_t j = 0; j < SYMBOL_CAP; j++) {
-            if (table[i][j] == -1) {
-                break;
-            }
-            ofLength.push_back(table[i][j]);
+        size_t end = std::min(numMcuRows, (iTask + 1) * rowsPerTask);
+        for (size_t yMcu = iTask * rowsPerTask; yMcu < end; yMcu++) {
+            encodeMcuRowRGB(settings, pixels, rows, yMcu, blocks, planes.data(),
+                histograms != nullptr ? &counted : nullptr, coefficients);
         }
-        symbolsList.push_back(ofLength);
+        if (histograms != nullptr) {
+            #pragma omp critical(jpegTaskHistograms)
+            addHistograms(*histograms, counted);
+        }
+    }
+    
+    if (histograms != nullptr) {
+        countRowStarts(settings, blocks, numMcuRows, *histograms);
     }
-    return Huffman::HuffmanCode(symbolsList);
 }
 
-void setupDefaultEncodingCodes()
+void Jpeg::encodePlanes(const JpegSettings& settings, const JpegPlane *planes,
+    coef_t (*blocks)[JPEG_BLOCK_SIZE], histograms_t *histograms,
+    float (*coefficients)[JPEG_BLOCK_SIZE])
 {
-    std::vector<Huffman::HuffmanCode>& dcTables = defaultEncodingCodes.first;
-    if (dcTables.empty()) {
-        dcTables.push_back(fromDefault(defaultDcLuminance));
-        dcTables.push_back(fromDefault(defaultDcChrominance));
-    }
-    std::vector<Huffman::HuffmanCode>& acTables = defaultEncodingCodes.second;
-    if (acTables.empty()) {
-        acTables.push_back(fromDefault(defaultAcLuminance));
-        acTables.push_back(fromDefault(defaultAcChrominance));
-        
+    int levelShift = 1 << (settings.bitDepth - 1);
+    size_t interval = settings.resetInterval;
+    float divisors[JPEG_MAX_COMPONENTS][JPEG_BLOCK_SIZE];
+    quantDivisors(settings, false, divisors);
+    
+    #pragma omp parallel
+    {
+    histograms_t counted;
+    if (histograms != nullptr) {
+        resetHistograms(settings, counted);
     }
-}
-
-void Jpeg::Jpeg::encodeCompressed(BitBuffer::BitBufferOut& dst)
-{
-    std::vector<mcu_t> mcus;
-    size_t numMcus = settings.numMcus.first * settings.numMcus.second;
-    mcus.reserve(numMcus);
-    for (size_t iMcu = 0; iMcu < numMcus; iMcu++) {
-        mcu_t mcu;
-        mcu.reserve(settings.mcuSize);
-        for (size_t iBlock = 0; iBlock < settings.mcuSize; iBlock++) {
-            size_t blockNum = iMcu * settings.mcuSize + iBlock;
-            block_t block;
-            /* DC component */
-            block.push_back(splitNumber(blocks[blockNum][0]));
-            /* AC components */
-            size_t leadingZeros = 0;
-            size_t lastInserted = 1;
-            for (size_t i = 1; i < JPEG_BLOCK_SIZE; i++) {
-                if (blocks[blockNum][i] != 0) {
-                    while (leadingZeros > 15) {
-                        block.push_back(split_t(0xF0, 0));
-                        leadingZeros -= 16;
+    
+    #pragma omp for schedule(dynamic)
+    for (size_t yMcu = 0; yMcu < settings.numMcus.second; yMcu++) {
+        dct_t predictors[JPEG_MAX_COMPONENTS] = {0};
+        for (size_t xMcu = 0; xMcu < settings.numMcus.first; xMcu++) {
+            alignas(32) float cBlocks[JPEG_MAX_SAMPLING * JPEG_MAX_SAMPLING][JPEG_BLOCK_SIZE];
+            size_t iMcu = yMcu * settings.numMcus.first + xMcu;
+            bool restart = interval != 0 && iMcu % interval == 0;
+            if (restart) {
+                std::fill(predictors, predictors + JPEG_MAX_COMPONENTS, 0);
+            }
+            for (size_t iComp = 0; iComp < settings.components.size(); iComp++) {
+                const JpegComponent& comp = settings.components[iComp];
+                const JpegPlane& plane = planes[iComp];
+                int numX = comp.sampling.first;
+                int numY = comp.sampling.second;
+                size_t numBlocks = numX * numY;
+                size_t start = settings.mcuSize * iMcu + settings.componentOffsets[iComp];
+                for (size_t yBlock = 0; yBlock < numY; yBlock++) {
+                for (size_t xBlock = 0; xBlock < numX; xBlock++) {
+                    float *cBlock = cBlocks[yBlock * numX + xBlock];
+                    size_t x0 = (xMcu * numX + xBlock) * JPEG_BLOCK_ROW;
+                    size_t y0 = (yMcu * numY + yBlock) * JPEG_BLOCK_ROW;
+                    /* Blocks inside the right edge of a packed plane load straight */
+                    bool inside = plane.step == 1 && x0 + JPEG_BLOCK_ROW <= plane.width;
+                    for (size_t oy = 0; oy < JPEG_BLOCK_ROW; oy++) {
+                        const std::uint8_t *row = plane.data +
+                            std::min(y0 + oy, plane.height - 1) * plane.stride;
+                        if (inside) {
+                            for (size_t ox = 0; ox < JPEG_BLOCK_ROW; ox++) {
+                                cBlock[oy * JPEG_BLOCK_ROW + ox] = row[x0 + ox] - levelShift;
+                            }
+                            continue;
+                        }
+                        for (size_t ox = 0; ox < JPEG_BLOCK_ROW; ox++) {
+                            cBlock[oy * JPEG_BLOCK_ROW + ox] =
+                                row[std::min(x0 + ox, plane.width - 1) * plane.step] - levelShift;
+                        }
                     }
-                    split_t entry = splitNumber(blocks[blockNum][i]);
-                    entry.first |= leadingZeros << 4;
-                    leadingZeros = 0;
-                    block.push_back(entry);
-                    lastInserted = i + 1;
                 }
-                else {
-                    leadingZeros++;
+                }
+                forwardDct(cBlocks, numBlocks);
+                if (coefficients != nullptr) {
+                    for (size_t iBlock = 0; iBlock < numBlocks; iBlock++) {
+                        for (size_t i = 0; i < JPEG_BLOCK_SIZE; i++) {
+                            coefficients[start + iBlock][i] = cBlocks[iBlock][zigzag[i]];
+                        }
+                    }
+                }
+                for (size_t iBlock = 0; iBlock < numBlocks; iBlock++) {
+                    quantizeBlock(cBlocks[iBlock], divisors[iComp], blocks[start + iBlock]);
+                }
+                if (histograms != nullptr) {
+                    countComponentBlocks(blocks + start, numBlocks,
+                        comp, xMcu == 0 && yMcu != 0 && !restart,
+                        predictors[iComp], counted);
                 }
             }
-            if (blocks[blockNum][JPEG_BLOCK_SIZE - 1] == 0) {
-                block.push_back(split_t(0, 0));
-            }
-            mcu.push_back(block);
         }
-        mcus.push_back(mcu);
     }
-    
-    /* Get appropriate huffman codes */
-    codes_t& huffmanCodes = settings.huffmanCodes;
-    switch ((settings.compressionFlags & flagHuffmanMask)) {
-        case flagHuffmanOptimal:
-            createJpegHuffmanCodes(huffmanCodes, mcus, settings);
-            break;
-        case flagHuffmanDefault:
-            setupDefaultEncodingCodes();
-            huffmanCodes = defaultEncodingCodes;
+    if (histograms != nullptr) {
+        #pragma omp critical
+        addHistograms(*histograms, counted);
     }
-    
-    size_t maxDc = 0, maxAc = 0;
-    for (auto it = settings.components.begin(); it != settings.components.end(); it++) {
-        JpegComponent& comp = *it;
-        maxDc = std::max(maxDc, comp.dcTable);
-        maxAc = std::max(maxAc, comp.acTable);
     }
-    maxDc++;
-    maxAc++;
-    if (maxDc > huffmanCodes.first.size()) {
-        throw JpegEncodingException("Not enough DC Huffman codes");
-    }
-    if (maxAc > huffmanCodes.first.size()) {
-        throw JpegEncodingException("Not enough AC Huffman codes");
+    
+    if (histograms != nullptr) {
+        countRowStarts(settings, blocks, settings.numMcus.second, *histograms);
     }
+}
+
+void Jpeg::quantizeCoefficients(const JpegSettings& settings,
+    const float (*coefficients)[JPEG_BLOCK_SIZE], size_t numMcuRows,
+    coef_t (*blocks)[JPEG_BLOCK_SIZE], histograms_t *histograms)
+{
+    size_t interval = settings.resetInterval;
+    float divisors[JPEG_MAX_COMPONENTS][JPEG_BLOCK_SIZE];
+    quantDivisors(settings, true, divisors);
     
-    std::stringstream strstream;
-    BitBuffer::BitBufferOut bout(strstream);
+    #pragma omp parallel
+    {
+    histograms_t counted;
+    if (histograms != nullptr) {
+        resetHistograms(settings, counted);
+    }
     
-    for (size_t iMcu = 0; iMcu < settings.numMcus.first * settings.numMcus.second; iMcu++) {
-        mcu_t& mcu = mcus[iMcu];
-        size_t compP1 = 0;
-        Huffman::HuffmanCode *dcTable, *acTable;
-        for (size_t iBlock = 0; iBlock < settings.mcuSize; iBlock++) {
-            if (compP1 < settings.components.size() && iBlock == settings.componentOffsets[compP1]) {
-                compP1 += 1;
-                dcTable = &(huffmanCodes.first[settings.components[compP1 - 1].dcTable]);
-                acTable = &(huffmanCodes.second[settings.components[compP1 - 1].acTable]);
-            }
-            block_t& block = mcu[iBlock];
-            
-            /* Write DC */
-            split_t& dc = block[0];
-            // std::cout << "DC: " << (int)dc.first << ',' << dc.second << std::endl;
-            dcTable->write(dc.first, bout);
-            if (dc.first != 0) {
-                bout.write(dc.second, dc.first);
+    #pragma omp for schedule(dynamic)
+    for (size_t yMcu = 0; yMcu < numMcuRows; yMcu++) {
+        dct_t predictors[JPEG_MAX_COMPONENTS] = {0};
+        for (size_t xMcu = 0; xMcu < settings.numMcus.first; xMcu++) {
+            size_t iMcu = yMcu * settings.numMcus.first + xMcu;
+            bool restart = interval != 0 && iMcu % interval == 0;
+            if (restart) {
+                std::fill(predictors, predictors + JPEG_MAX_COMPONENTS, 0);
             }
-            
-            /* Write AC */
-            for (size_t i = 1; i < block.size(); i++) {
-                split_t &ac = block[i];
-                // std::cout << "AC: " << (int)ac.first << ',' << ac.second << std::endl;
-                acTable->write(ac.first, bout);
-                if ((ac.first & 0xF) != 0) {
-                    bout.write(ac.second, ac.first & 0xF);
+            for (size_t iComp = 0; iComp < settings.components.size(); iComp++) {
+                const JpegComponent& comp = settings.components[iComp];
+                size_t start = settings.mcuSize * iMcu + settings.componentOffsets[iComp];
+                size_t numBlocks = comp.sampling.first * comp.sampling.second;
+                for (size_t iBlock = start; iBlock < start + numBlocks; iBlock++) {
+                    for (size_t i = 0; i < JPEG_BLOCK_SIZE; i++) {
+                        blocks[iBlock][i] = roundQuotient(coefficients[iBlock][i] / divisors[iComp][i]);
+                    }
+                }
+                if (histograms != nullptr) {
+                    countComponentBlocks(blocks + start, numBlocks,
+                        comp, xMcu == 0 && yMcu != 0 && !restart,
+                        predictors[iComp], counted);
                 }
             }
         }
     }
+    if (histograms != nullptr) {
+        #pragma omp critical
+        addHistograms(*histograms, counted);
+    }
+    }
     
-    bout.flush(true);
-    
-    /* Transfer from temp buffer to output while replacing 0xFF with 0xFF 0x00 */
-    std::string src = strstream.str();
-    const std::uint8_t *srcDat = reinterpret_cast<const std::uint8_t*>(src.data());
-    for (size_t i = 0; i < src.size(); i++) {
-        dst.write(srcDat[i], 8);
-        if (srcDat[i] == 0xFF) {
-            dst.write(0, 8);
+    if (histograms != nullptr) {
+        countRowStarts(settings, blocks, numMcuRows, *histograms);
+    }
+}
+
+void Jpeg::Jpeg::encodeRGB(const std::uint8_t *rgb)
+{
+    JPEG_TIME_STAGE(stats, STAGE_ENCODE);
+    encodeImageRGB(*this, JpegPixels(rgb));
+}
+
+void Jpeg::Jpeg::encode(const JpegPixels& pixels)
+{
+    JPEG_TIME_STAGE(stats, STAGE_ENCODE);
+    encodeImageRGB(*this, pixels);
+}
+
+/*
+Get jpeg ready to be populated: zeroed histograms when symbols are to be
+counted and a buffer for coefficients when they are to be kept
+*/
+void beginImage(Jpeg::Jpeg& jpeg)
+{
+    Jpeg::JpegSettings& settings = jpeg.settings;
+    jpeg.histogramsReady = (settings.compressionFlags & Jpeg::flagHuffmanMask) == Jpeg::flagHuffmanOptimal;
+    if (jpeg.histogramsReady) {
+        Jpeg::resetHistograms(settings, jpeg.histograms);
+    }
+    if ((settings.compressionFlags & Jpeg::flagKeepCoefficients) && jpeg.coefficients == nullptr) {
+        jpeg.coefficients = new float[jpeg.blockCapacity][JPEG_BLOCK_SIZE];
+    }
+}
+
+void Jpeg::encodeImageRGB(Jpeg& jpeg, const JpegPixels& pixels, size_t rowsPerTask)
+{
+    JpegSettings& settings = jpeg.settings;
+    beginImage(jpeg);
+    histograms_t *histograms = jpeg.histogramsReady ? &jpeg.histograms : nullptr;
+    float (*coefficients)[JPEG_BLOCK_SIZE] =
+        (settings.compressionFlags & flagKeepCoefficients) ? jpeg.coefficients : nullptr;
+    if (rowsPerTask == 0 && settings.components.size() == 1 &&
+        pixels.format == PIXEL_GRAY && !pixels.bottomUp) {
+        /* Gray pixels are the samples of a lone luma component */
+        size_t width = settings.size.first;
+        JpegPlane plane = {pixels.data, width, (size_t)settings.size.second,
+            pixels.stride != 0 ? pixels.stride : width, 1};
+        encodePlanes(settings, &plane, jpeg.blocks, histograms, coefficients);
+    }
+    else if (rowsPerTask == 0) {
+        if (jpeg.workspace == nullptr) {
+            jpeg.workspace = new JpegWorkspace();
         }
+        encodeStripeRGB(settings, pixels, settings.size.second, settings.numMcus.second,
+            jpeg.blocks, histograms, coefficients, jpeg.workspace);
+    }
+    else {
+        encodeStripeTasks(settings, pixels, settings.size.second, settings.numMcus.second,
+            jpeg.blocks, rowsPerTask, histograms, coefficients);
     }
 }
 
-void writeBe16(std::uint16_t num, std::ostream& dst)
+void Jpeg::Jpeg::requantize()
 {
-    dst.put((std::uint8_t)(num >> 8));
-    dst.put((std::uint8_t)num);
+    JPEG_TIME_STAGE(stats, STAGE_ENCODE);
+    if (coefficients == nullptr) {
+        throw JpegEncodingException("No coefficients were kept to requantize");
+    }
+    histogramsReady = (settings.compressionFlags & flagHuffmanMask) == flagHuffmanOptimal;
+    if (histogramsReady) {
+        resetHistograms(settings, histograms);
+    }
+    quantizeCoefficients(settings, coefficients, settings.numMcus.second, blocks,
+        histogramsReady ? &histograms : nullptr);
 }
 
-void Jpeg::Jpeg::write(std::ostream& dst)
+void Jpeg::Jpeg::requantize(int quality)
 {
-    std::stringstream temp;
-    BitBuffer::BitBufferOut bbo(temp);
-    encodeDeltas();
-    encodeCompressed(bbo);
-    bbo.flush(true);
-    
-    dst.write(reinterpret_cast<const char*>((const unsigned char[]){
-            0xFF, 0xD8, 0xFF, 0xE0, // SOI, APP0
-            0x00, 0x10, // length, Version
+    settings.setQuality(quality);
+    requantize();
+}
+
+/*
+Stream buffer that only counts what is written to it
+*/
+class ByteCounter : public std::streambuf {
+    public:
+        size_t count = 0;
+    protected:
+        int_type overflow(int_type ch) override
+        {
+            count++;
+            return traits_type::not_eof(ch);
+        }
+        std::streamsize xsputn(const char *s, std::streamsize n) override
+        {
+            count += n;
+            return n;
+        }
+};
+
+int Jpeg::Jpeg::writeTargetSize(std::ostream& dst, size_t maxBytes, int minQuality, int maxQuality)
+{
+    minQuality = std::max(1, minQuality);
+    maxQuality = std::min(100, maxQuality);
+    int best = minQuality;
+    /* Size grows with quality, so bisect for the last quality that fits */
+    int low = minQuality, high = maxQuality;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        requantize(mid);
+        ByteCounter counter;
+        std::ostream sink(&counter);
+        write(sink);
+        if (counter.count <= maxBytes) {
+            best = mid;
+            low = mid + 1;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+    requantize(best);
+    write(dst);
+    return best;
+}
+
+/*
+Byte writer for the segments around the scan, straight into a stream
+buffer; once the buffer refuses a byte nothing more is written
+*/
+class SegmentWriter {
+    private:
+        std::streambuf& dst;
+        bool ok;
+    public:
+        SegmentWriter(std::streambuf& dst) :
+            dst {dst},
+            ok {true} {}
+        
+        void put(std::uint8_t byte)
+        {
+            ok = ok && dst.sputc(byte) != std::streambuf::traits_type::eof();
+        }
+        
+        void write(const void *data, size_t count)
+        {
+            ok = ok && dst.sputn(static_cast<const char*>(data), count) == (std::streamsize)count;
+        }
+        
+        void writeBe16(std::uint16_t num)
+        {
+            put(num >> 8);
+            put(num);
+        }
+        
+        bool good() const
+        {
+            return ok;
+        }
+};
+
+/*
+Whether any component refers to table i through the given member
+*/
+bool tableUsed(const Jpeg::JpegSettings& settings, size_t Jpeg::JpegComponent::*table, size_t i)
+{
+    for (size_t iComp = 0; iComp < settings.components.size(); iComp++) {
+        if (settings.components[iComp].*table == i) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+DHT segment of a compiled table: how many codes there are of each length,
+then the symbols in code order
+*/
+void writeHuffmanTable(const Jpeg::JpegHuffmanTable& table, int id, SegmentWriter& out)
+{
+    std::uint8_t counts[16] = {0};
+    std::uint8_t symbols[256];
+    size_t numSymbols = 0;
+    for (size_t length = 1; length <= 16; length++) {
+        size_t first = numSymbols;
+        for (size_t symbol = 0; symbol < 256; symbol++) {
+            if ((table.entries[symbol] & 0xFF) == length) {
+                symbols[numSymbols++] = symbol;
+            }
+        }
+        std::sort(symbols + first, symbols + numSymbols, [&table](std::uint8_t a, std::uint8_t b) {
+            return table.entries[a] < table.entries[b];
+        });
+        counts[length - 1] = numSymbols - first;
+    }
+    out.write((const unsigned char[]){0xFF, 0xC4}, 2); // DHT
+    out.writeBe16(3 + 16 + numSymbols); // Length
+    out.put(id);
+    out.write(counts, 16);
+    out.write(symbols, numSymbols);
+}
+
+bool Jpeg::writeHeaders(const JpegSettings& settings, const tables_t& tables,
+    std::streambuf& dst, const std::uint8_t *thumbnail)
+{
+    SegmentWriter out(dst);
+    std::pair<int, int> thumbnailSize(0, 0);
+    if (thumbnail != nullptr) {
+        thumbnailSize = thumbnailDimensions(settings);
+    }
+    size_t thumbnailBytes = 3 * thumbnailSize.first * thumbnailSize.second;
+    out.write((const unsigned char[]){
+            0xFF, 0xD8, 0xFF, 0xE0 // SOI, APP0
+        }, 4);
+    out.writeBe16(16 + thumbnailBytes); // Length
+    out.write((const unsigned char[]){
             'J', 'F', 'I', 'F', 0
-        }), 11);
-    dst.put(settings.version.first);
-    dst.put(settings.version.second);
-    dst.put(settings.densityUnits);
-    writeBe16(settings.density.first, dst);
-    writeBe16(settings.density.second, dst);
-    dst.write(reinterpret_cast<const char*>((const unsigned char[]){0, 0}), 2); // Thumbnail size
+        }, 5);
+    out.put(settings.version.first);
+    out.put(settings.version.second);
+    out.put(settings.densityUnits);
+    out.writeBe16(settings.density.first);
+    out.writeBe16(settings.density.second);
+    out.put(thumbnailSize.first);
+    out.put(thumbnailSize.second);
+    out.write(thumbnail, thumbnailBytes);
+    for (auto it = settings.extraSegments.begin(); it != settings.extraSegments.end(); it++) {
+        out.write(it->data(), it->size());
+    }
     
+    /* Only the tables the components refer to, so gray images carry no chroma tables */
     for (size_t i = 0; i < settings.numQTables; i++) {
+        if (!tableUsed(settings, &JpegComponent::qtable, i)) {
+            continue;
+        }
         const dqt_t *qtable = settings.qtables[i];
-        dst.write(reinterpret_cast<const char*>((const unsigned char[]){
+        out.write((const unsigned char[]){
             0xFF, 0xDB, 0x00, 0x43 // DQT, length
-        }), 4);
-        dst.put(i);
+        }, 4);
+        out.put(i);
+        /* Stored in zigzag order, as the blocks are */
         for (size_t j = 0; j < JPEG_BLOCK_SIZE; j++) {
-            dst.put(qtable[j]);
+            out.put(qtable[zigzag[j]]);
         }
     }
     
-    dst.write(reinterpret_cast<const char*>((const unsigned char[]){0xFF, 0xC0}), 2); // SOF
-    writeBe16(8 + 3 * settings.components.size(), dst); // Length
-    dst.put(8); // Precision
-    writeBe16(settings.size.second, dst); // Height
-    writeBe16(settings.size.first, dst); // Width
-    dst.put(settings.components.size()); // Num components
+    out.write((const unsigned char[]){0xFF, 0xC0}, 2); // SOF
+    out.writeBe16(8 + 3 * settings.components.size()); // Length
+    out.put(8); // Precision
+    out.writeBe16(settings.size.second); // Height
+    out.writeBe16(settings.size.first); // Width
+    out.put(settings.components.size()); // Num components
     for (size_t i = 0; i < settings.components.size(); i++) {
-        dst.put(i + 1);
+        out.put(i + 1);
         auto component = settings.components[i];
-        dst.put((component.sampling.first << 4) | component.sampling.second);
-        dst.put(component.qtable);
+        out.put((component.sampling.first << 4) | component.sampling.second);
+        out.put(component.qtable);
     }
     
-    codes_t& hc = settings.huffmanCodes;
-    for (size_t i = 0; i < hc.first.size(); i++) {
-        std::vector<size_t> lengths = hc.first[i].lengthCounts();
-        size_t length = 3 + 16;
-        if ((settings.compressionFlags & flagHuffmanMask) == flagHuffmanOptimal) {
-            lengths[lengths.size() - 1]--;
-        }
-        for (auto it2 = lengths.begin(); it2 != lengths.end(); it2++) {
-            length += *it2;
-        }
-        dst.write(reinterpret_cast<const char*>((const unsigned char[]){0xFF, 0xC4}), 2); // DHT
-        writeBe16(length, dst); // Length
-        dst.put(i); // ID (class = 0 for DC)
-        for (size_t j = 0; j < 16; j++) {
-            if (j < lengths.size()) {
-                dst.put(lengths[j]);
-            }
-            else {
-                dst.put(0);
+    for (size_t i = 0; i < tables.first.size(); i++) {
+        if (tableUsed(settings, &JpegComponent::dcTable, i)) {
+            writeHuffmanTable(tables.first[i], i, out); // Class 0 for DC
+        }
+    }
+    for (size_t i = 0; i < tables.second.size(); i++) {
+        if (tableUsed(settings, &JpegComponent::acTable, i)) {
+            writeHuffmanTable(tables.second[i], 0x10 | i, out); // Class 1 for AC
+        }
+    }
+    
+    if (settings.resetInterval != 0) {
+        out.write((const unsigned char[]){0xFF, 0xDD}, 2); // DRI
+        out.writeBe16(4); // Length
+        out.writeBe16(settings.resetInterval);
+    }
+    
+    out.write((const unsigned char[]){0xFF, 0xDA}, 2); // SOS
+    out.writeBe16(6 + 2 * settings.components.size()); // Length
+    out.put(settings.components.size());
+    for (size_t i = 0; i < settings.components.size(); i++) {
+        const JpegComponent& comp = settings.components[i];
+        out.put(i + 1);
+        out.put((comp.dcTable << 4) | comp.acTable);
+    }
+    out.write((const unsigned char[]){0x00, 0x3F, 0x00}, 3); // Spec/succ, unused
+    return out.good();
+}
+
+bool Jpeg::writeTrailer(std::streambuf& dst)
+{
+    SegmentWriter out(dst);
+    out.write((const unsigned char[]){0xFF, 0xD9}, 2); // EOI
+    return out.good();
+}
+
+void Jpeg::Jpeg::write(std::ostream& dst)
+{
+    if (dst.rdbuf() == nullptr || !writeBuffer(*dst.rdbuf())) {
+        dst.setstate(std::ios_base::badbit);
+    }
+}
+
+/*
+Stream buffer over caller memory that asks grow for more once it is full
+*/
+class MemoryBuffer : public std::streambuf {
+    private:
+        Jpeg::JpegGrowHook grow;
+        void *context;
+        
+        /* pbump takes an int, so large moves go in steps */
+        void advance(size_t count)
+        {
+            while (count > 0) {
+                int step = (int)std::min(count, (size_t)INT_MAX);
+                pbump(step);
+                count -= step;
             }
         }
-        std::vector<std::vector<int>> byLength = hc.first[i].orderedSymbols();
-        for (auto it2 = byLength.begin(); it2 != byLength.end(); it2++) {
-            // std::cout << "lcodes:\n";
-            for (auto it3 = it2->begin(); it3 != it2->end(); it3++) {
-                if (*it3 != INT_MAX) {
-                    dst.put(*it3);
-                    // std::cout << *it3 << ", ";
-                }
-                // else {
-                    // std::cout << "Max int present\n";
-                // }
+        
+        /*
+        Have grow make room for count more bytes; false if it cannot
+        */
+        bool makeRoom(size_t count)
+        {
+            if (grow == nullptr) {
+                return false;
+            }
+            size_t used = size();
+            size_t capacity = used + count;
+            std::uint8_t *data = grow(reinterpret_cast<std::uint8_t*>(pbase()), used, capacity, context);
+            if (data == nullptr || capacity < used + count) {
+                return false;
             }
-            // std::cout << std::endl;
+            char *start = reinterpret_cast<char*>(data);
+            setp(start, start + capacity);
+            advance(used);
+            return true;
         }
-    }
-    for (size_t i = 0; i < hc.second.size(); i++) {
-        std::vector<size_t> lengths = hc.second[i].lengthCounts();
-        size_t length = 3 + 16;
-        if ((settings.compressionFlags & flagHuffmanMask) == flagHuffmanOptimal) {
-            lengths[lengths.size() - 1]--;
+    public:
+        MemoryBuffer(std::uint8_t *data, size_t capacity, Jpeg::JpegGrowHook grow, void *context) :
+            grow {grow},
+            context {context}
+        {
+            char *start = reinterpret_cast<char*>(data);
+            setp(start, start + capacity);
         }
-        for (auto it2 = lengths.begin(); it2 != lengths.end(); it2++) {
-            length += *it2;
+        
+        size_t size() const
+        {
+            return pptr() - pbase();
         }
-        dst.write(reinterpret_cast<const char*>((const unsigned char[]){0xFF, 0xC4}), 2); // DHT
-        writeBe16(length, dst); // Length
-        dst.put(0x10 | i); // ID (class = 0 for DC)
-        for (size_t j = 0; j < 16; j++) {
-            if (j < lengths.size()) {
-                dst.put(lengths[j]);
+    protected:
+        int_type overflow(int_type ch) override
+        {
+            if (traits_type::eq_int_type(ch, traits_type::eof())) {
+                return traits_type::not_eof(ch);
             }
-            else {
-                dst.put(0);
+            if (!makeRoom(1)) {
+                return traits_type::eof();
             }
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+            return ch;
         }
-        std::vector<std::vector<int>> byLength = hc.second[i].orderedSymbols();
-        for (auto it2 = byLength.begin(); it2 != byLength.end(); it2++) {
-            for (auto it3 = it2->begin(); it3 != it2->end(); it3++) {
-                if (*it3 != INT_MAX) {
-                    dst.put(*it3);
-                    // std::cout << *it3 << ", ";
-                }
-                // else {
-                    // std::cout << "Max int present\n";
-                // }
+        
+        std::streamsize xsputn(const char *s, std::streamsize n) override
+        {
+            size_t count = n;
+            size_t room = epptr() - pptr();
+            if (room < count && !makeRoom(count)) {
+                count = room;
             }
+            std::copy(s, s + count, pptr());
+            advance(count);
+            return count;
+        }
+};
+
+size_t Jpeg::Jpeg::write(std::uint8_t *dst, size_t capacity, JpegGrowHook grow, void *context)
+{
+    MemoryBuffer out(dst, capacity, grow, context);
+    if (!writeBuffer(out)) {
+        throw JpegEncodingException("Output does not fit in the buffer");
+    }
+    return out.size();
+}
+
+size_t Jpeg::maxEncodedSize(const JpegSettings& settings)
+{
+    size_t numComponents = settings.components.size();
+    std::pair<int, int> thumbnailSize(0, 0);
+    if (settings.thumbnailSize > 0) {
+        thumbnailSize = thumbnailDimensions(settings);
+    }
+    /* SOI, APP0 and its thumbnail, DQT, SOF, DHT, DRI, SOS and EOI */
+    size_t size = 2 + 18 + 3 * thumbnailSize.first * thumbnailSize.second +
+        settings.numQTables * (4 + 1 + JPEG_BLOCK_SIZE) + 10 + 3 * numComponents +
+        2 * numComponents * (4 + 1 + 16 + 256) + 6 + 8 + 2 * numComponents + 2;
+    for (auto it = settings.extraSegments.begin(); it != settings.extraSegments.end(); it++) {
+        size += it->size();
+    }
+    /*
+    No coefficient takes more than a 16 bit code and bitDepth + 4 extra
+    bits, and stuffing at most doubles the bytes
+    */
+    size_t blockBytes = 2 * ((16 + settings.bitDepth + 4) * JPEG_BLOCK_SIZE / 8);
+    size_t numMcus = (size_t)settings.numMcus.first * settings.numMcus.second;
+    size += numMcus * settings.mcuSize * blockBytes;
+    if (settings.resetInterval != 0) {
+        /* A marker and a padded byte per interval */
+        size += (numMcus / settings.resetInterval + 1) * 3;
+    }
+    return size + 1;
+}
+
+void Jpeg::Jpeg::write(JpegChunkHook hook, void *context, size_t chunkSize)
+{
+    JpegChunkSink out(hook, context, chunkSize);
+    if (!writeBuffer(out, true) || out.pubsync() != 0) {
+        throw JpegEncodingException("Output chunk was refused");
+    }
+}
+
+/*
+syncHeaders: sync dst once the headers are in, so they go out before
+the scan is coded
+*/
+bool Jpeg::Jpeg::writeBuffer(std::streambuf& dst, bool syncHeaders)
+{
+#ifdef JPEG_STATS
+    if (stats != nullptr) {
+        /* Stages this write may skip */
+        for (JpegStage stage : {STAGE_SYMBOLS, STAGE_HUFFMAN}) {
+            stats->wallSeconds[stage] = 0;
+            stats->cpuSeconds[stage] = 0;
+        }
+    }
+#endif
+    /* Tables go in the headers, so they are settled before any scan data */
+    bool fixedTables = (settings.compressionFlags & flagHuffmanMask) == flagHuffmanDefault;
+    if (!fixedTables || !defaultTablesReady) {
+        histograms_t counted;
+        const histograms_t *symbols = histogramsReady ? &histograms : nullptr;
+        if (symbols == nullptr && (settings.compressionFlags & flagHuffmanMask) == flagHuffmanOptimal) {
+            JPEG_TIME_STAGE(stats, STAGE_SYMBOLS);
+            countSymbols(settings, blocks, counted);
+            symbols = &counted;
+        }
+        JPEG_TIME_STAGE(stats, STAGE_HUFFMAN);
+        selectHuffmanCodes(settings, blocks, symbols);
+        compileHuffmanCodes(settings, tables);
+        if ((settings.compressionFlags & flagHuffmanMask) == flagHuffmanProvided) {
+            dct_t predictors[JPEG_MAX_COMPONENTS] = {0};
+            checkCodedSymbols(settings, tables, blocks, 0,
+                settings.numMcus.first * settings.numMcus.second, predictors);
         }
     }
+    defaultTablesReady = fixedTables;
     
-    dst.write(reinterpret_cast<const char*>((const unsigned char[]){0xFF, 0xDA}), 2); // SOS
-    writeBe16(6 + 2 * settings.components.size(), dst); // Length
-    dst.put(settings.components.size());
-    for (size_t i = 0; i < settings.components.size(); i++) {
-        JpegComponent& comp = settings.components[i];
-        dst.put(i + 1);
-        dst.put((comp.dcTable << 4) | comp.acTable);
+    bool ok;
+    {
+        JPEG_TIME_STAGE(stats, STAGE_HEADERS);
+        std::vector<std::uint8_t> thumbnail;
+        if (settings.thumbnailSize > 0) {
+            thumbnail = makeThumbnail(settings, blocks, coefficients);
+        }
+        ok = writeHeaders(settings, tables, dst, thumbnail.empty() ? nullptr : thumbnail.data());
+        if (syncHeaders) {
+            ok = ok && dst.pubsync() == 0;
+        }
+    }
+    
+    {
+        JPEG_TIME_STAGE(stats, STAGE_ENTROPY);
+        ok = ok && encodeCompressed(dst) && writeTrailer(dst);
+    }
+#ifdef JPEG_STATS
+    if (stats != nullptr) {
+        collectEncodeStats(*this, *stats);
     }
-    dst.write(reinterpret_cast<const char*>((const unsigned char[]){0x00, 0x3F, 0x00}), 3); // Spec/succ, unused
+#endif
+    return ok;
+}
 
-    dst.write(temp.str().data(), temp.str().size());
+void Jpeg::Jpeg::encodeYCbCr(const JpegYCbCr& ycbcr)
+{
+    JPEG_TIME_STAGE(stats, STAGE_ENCODE);
+    if (ycbcr.subsampling.first < 1 || ycbcr.subsampling.second < 1) {
+        throw JpegEncodingException("Chroma subsampling must be at least 1 each way");
+    }
+    beginImage(*this);
+    histograms_t *histograms = histogramsReady ? &this->histograms : nullptr;
+    float (*coefficients)[JPEG_BLOCK_SIZE] =
+        (settings.compressionFlags & flagKeepCoefficients) ? this->coefficients : nullptr;
+    size_t width = settings.size.first;
+    size_t height = settings.size.second;
     
-    dst.write(reinterpret_cast<const char*>((const unsigned char[]){0xFF, 0xD9}), 2); // EOI
+    /* Components past Cr reuse it, as with RGB input */
+    JpegPlane planes[JPEG_MAX_COMPONENTS];
+    bool direct = true;
+    for (size_t iComp = 0; iComp < settings.components.size(); iComp++) {
+        size_t c = std::min(iComp, size_t{2});
+        std::pair<int, int> sub = c == 0 ? std::pair<int, int>(1, 1) : ycbcr.subsampling;
+        const std::pair<int, int>& sampling = settings.components[iComp].sampling;
+        /* Coded at the input's resolution */
+        direct = direct && sampling.first * sub.first == settings.mcuScale.first &&
+            sampling.second * sub.second == settings.mcuScale.second;
+        planes[iComp] = JpegPlane{ycbcr.data[c], (width + sub.first - 1) / sub.first,
+            (height + sub.second - 1) / sub.second, ycbcr.stride[c], ycbcr.step[c]};
+    }
+    
+    if (direct) {
+        encodePlanes(settings, planes, blocks, histograms, coefficients);
+        return;
+    }
+    if (workspace == nullptr) {
+        workspace = new JpegWorkspace();
+    }
+    size_t mcuHeight = settings.mcuScale.second * JPEG_BLOCK_ROW;
+    size_t planeWidth = settings.mcuScale.first * JPEG_BLOCK_ROW * settings.numMcus.first;
+    encodeMcuRows(settings, settings.numMcus.second, blocks, histograms, coefficients, workspace,
+        [&](size_t yMcu, std::uint8_t *rowPlanes) {
+            convertMcuRowYCbCr(ycbcr, width, height, yMcu * mcuHeight,
+                planeWidth, mcuHeight, rowPlanes);
+        });
 }
@@ -0,0 +1,812 @@
+/*
+jpegentropy.cpp
+Huffman coding of quantized blocks
+*/
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cstdint>
+#include <climits>
+#include "bitutil.hpp"
+#include "jpegutil.hpp"
+#include "jpeginternal.hpp"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define SYMBOL_LENGTHS 16
+/* Magnitudes below this are categorized by lookup */
+#define CATEGORY_RANGE 2048
+/* Fewest MCUs worth coding on a thread of their own when stitching */
+#define MIN_PIECE_MCUS 256
+#define SYMBOL_CAP 256
+
+static Jpeg::codes_t defaultEncodingCodes;
+const std::int16_t defaultDcLuminance[SYMBOL_LENGTHS][SYMBOL_CAP] = {
+    {-1},
+    {0, -1},
+    {1, 2, 3, 4, 5, -1},
+    {6, -1},
+    {7, -1},
+    {8, -1},
+    {9, -1},
+    {10, -1},
+    {11, -1},
+    {-1},
+    {-1},
+    {-1},
+    {-1},
+    {-1},
+    {-1},
+    {-1}
+};
+const std::int16_t defaultDcChrominance[SYMBOL_LENGTHS][SYMBOL_CAP] = {
+    {-1},
+    {0, 1, 2, -1},
+    {3, -1},
+    {4, -1},
+    {5, -1},
+    {6, -1},
+    {7, -1},
+    {8, -1},
+    {9, -1},
+    {10, -1},
+    {11, -1},
+    {-1},
+    {-1},
+    {-1},
+    {-1},
+    {-1}
+};
+const std::int16_t defaultAcLuminance[SYMBOL_LENGTHS][SYMBOL_CAP] = {
+    {-1},
+    {0x01, 0x02, -1},
+    {0x03, -1},
+    {0x00, 0x04, 0x11, -1},
+    {0x05, 0x12, 0x21, -1},
+    {0x31, 0x41, -1},
+    {0x06, 0x13, 0x51, 0x61, -1},
+    {0x07, 0x22, 0x71, -1},
+    {0x14, 0x32, 0x81, 0x91, 0xA1, -1},
+    {0x08, 0x23, 0x42, 0xB1, 0xC1, -1},
+    {0x15, 0x52, 0xD1, 0xF0, -1},
+    {0x24, 0x33, 0x62, 0x72, -1},
+    {-1},
+    {-1},
+    {0x82, -1},
+    {0x09, 0x0A,
+     0x16, 0x17, 0x18, 0x19, 0x1A,
+     0x25, 0x26, 0x27, 0x28, 0x29, 0x2A,
+     0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A,
+     0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A,
+     0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A,
+     0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A,
+     0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A,
+     0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8A,
+     0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A,
+     0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA,
+     0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA,
+     0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA,
+     0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+     0xE1, 0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA,
+     0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA,
+    -1}
+};
+const std::int16_t defaultAcChrominance[SYMBOL_LENGTHS][SYMBOL_CAP] = {
+    {-1},
+    {0x00, 0x01, -1},
+    {0x02, -1},
+    {0x03, 0x11, -1},
+    {0x04, 0x05, 0x21, 0x31, -1},
+    {0x06, 0x12, 0x41, 0x51, -1},
+    {0x07, 0x61, 0x71, -1},
+    {0x13, 0x22, 0x32, 0x81, -1},
+    {0x08, 0x14, 0x42, 0x91, 0xA1, 0xB1, 0xC1, -1},
+    {0x09, 0x23, 0x33, 0x52, 0xF0, -1},
+    {0x15, 0x62, 0x72, 0xD1, -1},
+    {0x0A, 0x16, 0x24, 0x34, -1},
+    {-1},
+    {0xE1, -1},
+    {0x25, 0xF1, -1},
+    {0x17, 0x18, 0x19, 0x1A,
+     0x26, 0x27, 0x28, 0x29, 0x2A,
+     0x35, 0x36, 0x37, 0x38, 0x39, 0x3A,
+     0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A,
+     0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A,
+     0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A,
+     0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A,
+     0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8A,
+     0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A,
+     0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA,
+     0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA,
+     0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA,
+     0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+     0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA,
+     0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA,
+    -1}
+};
+
+/*
+Number of bits of every magnitude a baseline coefficient or DC difference
+can have, larger ones fall back to counting
+*/
+static struct MagnitudeCategories {
+    std::uint8_t bits[CATEGORY_RANGE];
+    MagnitudeCategories()
+    {
+        bits[0] = 0;
+        for (size_t i = 1; i < CATEGORY_RANGE; i++) {
+            bits[i] = bits[i / 2] + 1;
+        }
+    }
+} categories;
+
+Jpeg::split_t Jpeg::splitNumber(dct_t number)
+{
+    dct_t magnitude = number < 0 ? -number : number;
+    std::uint8_t bits = (magnitude < CATEGORY_RANGE) ?
+        categories.bits[magnitude] :
+        BitManip::msbSet((std::uint16_t)magnitude) + 1;
+    if (number < 0) {
+        number--;
+    }
+    return split_t(bits, number & ((1 << bits) - 1));
+}
+
+/*
+Run-length code one block, handing each DC and AC symbol with its extra
+bits to the visitor as soon as it is found
+
+dcDelta: difference of the DC term from the predictor
+*/
+template <class Visitor>
+inline void visitBlock(const Jpeg::coef_t *block, Jpeg::dct_t dcDelta, Visitor& visitor)
+{
+    Jpeg::split_t dc = Jpeg::splitNumber(dcDelta);
+    visitor.dc(dc.first, dc.second);
+    size_t leadingZeros = 0;
+    for (size_t i = 1; i < JPEG_BLOCK_SIZE; i++) {
+        Jpeg::dct_t coeff = block[i];
+        if (coeff == 0) {
+            leadingZeros++;
+            continue;
+        }
+        while (leadingZeros > 15) {
+            visitor.ac(0xF0, 0);
+            leadingZeros -= 16;
+        }
+        Jpeg::split_t ac = Jpeg::splitNumber(coeff);
+        visitor.ac((leadingZeros << 4) | ac.first, ac.second);
+        leadingZeros = 0;
+    }
+    /* End of block */
+    if (leadingZeros > 0) {
+        visitor.ac(0, 0);
+    }
+}
+
+/*
+Visit every block of numMcus MCUs in scan order, telling the visitor
+which component each run of blocks belongs to
+
+firstMcu: index of blocks[0]'s MCU in the image, for reset intervals
+predictors: DC predictors of each component, carried in and out
+*/
+template <class Visitor>
+void visitMcus(const Jpeg::JpegSettings& settings,
+    const Jpeg::coef_t (*blocks)[JPEG_BLOCK_SIZE],
+    size_t firstMcu, size_t numMcus,
+    Jpeg::dct_t *predictors, Visitor& visitor)
+{
+    size_t interval = settings.resetInterval;
+    for (size_t iMcu = 0; iMcu < numMcus; iMcu++) {
+        if (interval != 0 && (firstMcu + iMcu) % interval == 0) {
+            std::fill(predictors, predictors + settings.components.size(), 0);
+        }
+        const Jpeg::coef_t (*mcu)[JPEG_BLOCK_SIZE] = blocks + iMcu * settings.mcuSize;
+        for (size_t iComp = 0; iComp < settings.components.size(); iComp++) {
+            const Jpeg::JpegComponent& comp = settings.components[iComp];
+            size_t numBlocks = comp.sampling.first * comp.sampling.second;
+            visitor.component(comp);
+            for (size_t iBlock = 0; iBlock < numBlocks; iBlock++) {
+                const Jpeg::coef_t *block = mcu[settings.componentOffsets[iComp] + iBlock];
+                Jpeg::dct_t dc = block[0];
+                visitBlock(block, dc - predictors[iComp], visitor);
+                predictors[iComp] = dc;
+            }
+        }
+    }
+}
+
+/*
+Counts how often each symbol is used in each table
+*/
+struct SymbolCounter {
+    Jpeg::histograms_t& histograms;
+    std::uint64_t *dcCounts, *acCounts;
+    SymbolCounter(Jpeg::histograms_t& histograms) :
+        histograms {histograms} {}
+    void component(const Jpeg::JpegComponent& comp)
+    {
+        dcCounts = histograms.first[comp.dcTable].counts;
+        acCounts = histograms.second[comp.acTable].counts;
+    }
+    void dc(std::uint8_t symbol, std::uint16_t bits)
+    {
+        dcCounts[symbol]++;
+    }
+    void ac(std::uint8_t symbol, std::uint16_t bits)
+    {
+        acCounts[symbol]++;
+    }
+};
+
+/*
+Counts the AC symbols of single blocks
+*/
+struct AcCounter {
+    std::uint64_t *counts;
+    void dc(std::uint8_t symbol, std::uint16_t bits) {}
+    void ac(std::uint8_t symbol, std::uint16_t bits)
+    {
+        counts[symbol]++;
+    }
+};
+
+void Jpeg::resetHistograms(const JpegSettings& settings, histograms_t& histograms)
+{
+    size_t maxDc = 0, maxAc = 0;
+    for (auto it = settings.components.begin(); it != settings.components.end(); it++) {
+        maxDc = std::max(maxDc, it->dcTable);
+        maxAc = std::max(maxAc, it->acTable);
+    }
+    histograms.first.assign(maxDc + 1, JpegHistogram());
+    histograms.second.assign(maxAc + 1, JpegHistogram());
+}
+
+void Jpeg::addHistograms(histograms_t& dst, const histograms_t& src)
+{
+    for (size_t i = 0; i < src.first.size(); i++) {
+        for (size_t j = 0; j < 256; j++) {
+            dst.first[i].counts[j] += src.first[i].counts[j];
+        }
+    }
+    for (size_t i = 0; i < src.second.size(); i++) {
+        for (size_t j = 0; j < 256; j++) {
+            dst.second[i].counts[j] += src.second[i].counts[j];
+        }
+    }
+}
+
+void Jpeg::countAcSymbols(const coef_t *block, JpegHistogram& counts)
+{
+    AcCounter counter {counts.counts};
+    visitBlock(block, 0, counter);
+}
+
+/*
+Writes each symbol and its extra bits as one append, as it is visited
+*/
+struct SymbolWriter {
+    const Jpeg::tables_t& tables;
+    Jpeg::JpegBitWriter& bout;
+    const std::uint32_t *dcTable, *acTable;
+    SymbolWriter(const Jpeg::tables_t& tables, Jpeg::JpegBitWriter& bout) :
+        tables {tables},
+        bout {bout} {}
+    void component(const Jpeg::JpegComponent& comp)
+    {
+        dcTable = tables.first[comp.dcTable].entries;
+        acTable = tables.second[comp.acTable].entries;
+    }
+    void dc(std::uint8_t symbol, std::uint16_t bits)
+    {
+        std::uint32_t entry = dcTable[symbol];
+        bout.write(((entry >> 8) << symbol) | bits, (entry & 0xFF) + symbol);
+    }
+    void ac(std::uint8_t symbol, std::uint16_t bits)
+    {
+        std::uint32_t entry = acTable[symbol];
+        int extra = symbol & 0xF;
+        bout.write(((entry >> 8) << extra) | bits, (entry & 0xFF) + extra);
+    }
+};
+
+/*
+Notes any symbol its table has no code for, which compiles to a zero entry
+*/
+struct CodeChecker {
+    const Jpeg::tables_t& tables;
+    const std::uint32_t *dcTable, *acTable;
+    bool missing = false;
+    CodeChecker(const Jpeg::tables_t& tables) :
+        tables {tables} {}
+    void component(const Jpeg::JpegComponent& comp)
+    {
+        dcTable = tables.first[comp.dcTable].entries;
+        acTable = tables.second[comp.acTable].entries;
+    }
+    void dc(std::uint8_t symbol, std::uint16_t bits)
+    {
+        missing = missing || dcTable[symbol] == 0;
+    }
+    void ac(std::uint8_t symbol, std::uint16_t bits)
+    {
+        missing = missing || acTable[symbol] == 0;
+    }
+};
+
+/*
+A run of MCUs coded on its own thread, then moved to its place in the scan
+
+bits: unstuffed code, the last byte padded
+shift: bit offset of the piece within its first output byte
+head, tail: first and last output bytes if they are shared with neighbours
+body: the whole bytes in between, already stuffed
+*/
+struct ScanPiece {
+    size_t firstMcu, numMcus;
+    std::string bits;
+    size_t bitCount;
+    size_t shift;
+    bool hasHead, hasTail;
+    std::uint8_t head, tail;
+    std::string body;
+};
+
+Huffman::HuffmanCode fromHistogram(const Jpeg::JpegHistogram& histogram)
+{
+    /*
+    Symbols in use have always been given one more than their count,
+    keep doing so that output stays the same
+    */
+    std::map<int, int> frequencies;
+    for (size_t i = 0; i < 256; i++) {
+        if (histogram.counts[i] != 0) {
+            frequencies[i] = histogram.counts[i] + 1;
+        }
+    }
+    /* Reserve the all ones code, which must not be used */
+    frequencies[INT_MAX] = 0;
+    return Huffman::HuffmanCode(frequencies, 16);
+}
+
+void createJpegHuffmanCodes(Jpeg::codes_t& codeList, const Jpeg::histograms_t& histograms)
+{
+    codeList.first.clear();
+    for (auto it = histograms.first.begin(); it != histograms.first.end(); it++) {
+        codeList.first.push_back(fromHistogram(*it));
+    }
+    codeList.second.clear();
+    for (auto it = histograms.second.begin(); it != histograms.second.end(); it++) {
+        codeList.second.push_back(fromHistogram(*it));
+    }
+}
+
+Huffman::HuffmanCode fromDefault(const std::int16_t table[SYMBOL_LENGTHS][SYMBOL_CAP])
+{
+    std::vector<std::vector<int>> symbolsList;
+    symbolsList.reserve(SYMBOL_LENGTHS);
+    for (size_t i = 0; i < SYMBOL_LENGTHS; i++) {
+        std::vector<int> ofLength;
+        for (size_t j = 0; j < SYMBOL_CAP; j++) {
+            if (table[i][j] == -1) {
+                break;
+            }
+            ofLength.push_back(table[i][j]);
+        }
+        symbolsList.push_back(ofLength);
+    }
+    return Huffman::HuffmanCode(symbolsList);
+}
+
+void Jpeg::setupDefaultEncodingCodes(JpegSettings& settings)
+{
+    std::vector<Huffman::HuffmanCode>& dcTables = defaultEncodingCodes.first;
+    if (dcTables.empty()) {
+        dcTables.push_back(fromDefault(defaultDcLuminance));
+        dcTables.push_back(fromDefault(defaultDcChrominance));
+    }
+    std::vector<Huffman::HuffmanCode>& acTables = defaultEncodingCodes.second;
+    if (acTables.empty()) {
+        acTables.push_back(fromDefault(defaultAcLuminance));
+        acTables.push_back(fromDefault(defaultAcChrominance));
+        
+    }
+    settings.huffmanCodes = defaultEncodingCodes;
+}
+
+void Jpeg::checkHuffmanCodes(const JpegSettings& settings)
+{
+    size_t maxDc = 0, maxAc = 0;
+    for (auto it = settings.components.begin(); it != settings.components.end(); it++) {
+        const JpegComponent& comp = *it;
+        maxDc = std::max(maxDc, comp.dcTable);
+        maxAc = std::max(maxAc, comp.acTable);
+    }
+    maxDc++;
+    maxAc++;
+    if (maxDc > settings.huffmanCodes.first.size()) {
+        throw JpegEncodingException("Not enough DC Huffman codes");
+    }
+    if (maxAc > settings.huffmanCodes.second.size()) {
+        throw JpegEncodingException("Not enough AC Huffman codes");
+    }
+}
+
+/*
+Assign canonical codes in the order the table lists its symbols
+*/
+Jpeg::JpegHuffmanTable compileHuffmanCode(Huffman::HuffmanCode& code)
+{
+    Jpeg::JpegHuffmanTable table;
+    std::fill(table.entries, table.entries + 256, 0);
+    std::vector<std::vector<int>> byLength = code.orderedSymbols();
+    std::uint32_t next = 0;
+    for (size_t i = 0; i < byLength.size(); i++) {
+        for (auto it = byLength[i].begin(); it != byLength[i].end(); it++) {
+            /* The placeholder symbol of optimal codes takes a code all the same */
+            if (*it >= 0 && *it < 256) {
+                table.entries[*it] = (next << 8) | (i + 1);
+            }
+            next++;
+        }
+        next <<= 1;
+    }
+    return table;
+}
+
+void Jpeg::compileHuffmanCodes(JpegSettings& settings, tables_t& tables)
+{
+    tables.first.clear();
+    for (auto it = settings.huffmanCodes.first.begin(); it != settings.huffmanCodes.first.end(); it++) {
+        tables.first.push_back(compileHuffmanCode(*it));
+    }
+    tables.second.clear();
+    for (auto it = settings.huffmanCodes.second.begin(); it != settings.huffmanCodes.second.end(); it++) {
+        tables.second.push_back(compileHuffmanCode(*it));
+    }
+}
+
+void Jpeg::writeMcus(const JpegSettings& settings, const tables_t& tables,
+    const coef_t (*blocks)[JPEG_BLOCK_SIZE],
+    size_t firstMcu, size_t numMcus,
+    dct_t *predictors, JpegBitWriter& bout)
+{
+    SymbolWriter writer(tables, bout);
+    size_t interval = settings.resetInterval;
+    size_t done = 0;
+    while (done < numMcus) {
+        size_t iMcu = firstMcu + done;
+        size_t run = numMcus - done;
+        if (interval != 0) {
+            if (iMcu != 0 && iMcu % interval == 0) {
+                bout.putMarker(0xD0 + (iMcu / interval - 1) % 8);
+            }
+            run = std::min(run, interval - iMcu % interval);
+        }
+        visitMcus(settings, blocks + done * settings.mcuSize, iMcu, run, predictors, writer);
+        done += run;
+    }
+}
+
+void Jpeg::JpegBitWriter::flush()
+{
+    int pending = 64 - freeBits;
+    int padding = (8 - pending % 8) % 8;
+    buffer = (buffer << padding) | ((1u << padding) - 1);
+    pending += padding;
+    while (pending > 0) {
+        pending -= 8;
+        emitByte(buffer >> pending);
+    }
+    buffer = 0;
+    freeBits = 64;
+}
+
+void Jpeg::JpegBitWriter::putMarker(std::uint8_t code)
+{
+    flush();
+    if (dst->sputc(0xFF) == std::streambuf::traits_type::eof() ||
+        dst->sputc(code) == std::streambuf::traits_type::eof()) {
+        failed = true;
+    }
+}
+
+void Jpeg::countSymbols(const JpegSettings& settings,
+    const coef_t (*blocks)[JPEG_BLOCK_SIZE], histograms_t& histograms)
+{
+    resetHistograms(settings, histograms);
+    SymbolCounter counter(histograms);
+    dct_t predictors[JPEG_MAX_COMPONENTS] = {0};
+    visitMcus(settings, blocks, 0, settings.numMcus.first * settings.numMcus.second,
+        predictors, counter);
+}
+
+void Jpeg::checkCodedSymbols(const JpegSettings& settings, const tables_t& tables,
+    const coef_t (*blocks)[JPEG_BLOCK_SIZE],
+    size_t firstMcu, size_t numMcus, const dct_t *predictors)
+{
+    CodeChecker checker(tables);
+    dct_t carried[JPEG_MAX_COMPONENTS];
+    std::copy(predictors, predictors + JPEG_MAX_COMPONENTS, carried);
+    visitMcus(settings, blocks, firstMcu, numMcus, carried, checker);
+    if (checker.missing) {
+        throw JpegEncodingException("Huffman code lacks a symbol the image uses");
+    }
+}
+
+#ifdef JPEG_STATS
+/*
+Adds up what the symbols of one component's blocks cost with the
+compiled tables, counting them as it goes
+*/
+struct BitCounter {
+    const Jpeg::tables_t& tables;
+    Jpeg::histograms_t& histograms;
+    const Jpeg::JpegComponent *comp;
+    Jpeg::JpegComponentStats *stats;
+    BitCounter(const Jpeg::tables_t& tables, Jpeg::histograms_t& histograms) :
+        tables {tables},
+        histograms {histograms} {}
+    void dc(std::uint8_t symbol, std::uint16_t bits)
+    {
+        /* Code length, then as many extra bits as the category */
+        stats->bits += (tables.first[comp->dcTable].entries[symbol] & 0xFF) + symbol;
+        stats->dcSymbols++;
+        histograms.first[comp->dcTable].counts[symbol]++;
+    }
+    void ac(std::uint8_t symbol, std::uint16_t bits)
+    {
+        stats->bits += (tables.second[comp->acTable].entries[symbol] & 0xFF) + (symbol & 0xF);
+        stats->acSymbols++;
+        histograms.second[comp->acTable].counts[symbol]++;
+    }
+};
+
+void Jpeg::collectEncodeStats(const Jpeg& jpeg, JpegEncodeStats& stats)
+{
+    const JpegSettings& settings = jpeg.settings;
+    stats.components.assign(settings.components.size(), JpegComponentStats());
+    resetHistograms(settings, stats.symbols);
+    BitCounter counter(jpeg.tables, stats.symbols);
+    size_t numMcus = settings.numMcus.first * settings.numMcus.second;
+    size_t interval = settings.resetInterval;
+    dct_t predictors[JPEG_MAX_COMPONENTS] = {0};
+    for (size_t iMcu = 0; iMcu < numMcus; iMcu++) {
+        if (interval != 0 && iMcu % interval == 0) {
+            std::fill(predictors, predictors + JPEG_MAX_COMPONENTS, 0);
+        }
+        for (size_t iComp = 0; iComp < settings.components.size(); iComp++) {
+            const JpegComponent& comp = settings.components[iComp];
+            JpegComponentStats& compStats = stats.components[iComp];
+            counter.comp = &comp;
+            counter.stats = &compStats;
+            size_t start = iMcu * settings.mcuSize + settings.componentOffsets[iComp];
+            size_t numBlocks = comp.sampling.first * comp.sampling.second;
+            for (size_t iBlock = start; iBlock < start + numBlocks; iBlock++) {
+                const coef_t *block = jpeg.blocks[iBlock];
+                visitBlock(block, block[0] - predictors[iComp], counter);
+                predictors[iComp] = block[0];
+                bool acZero = true;
+                for (size_t i = 1; i < JPEG_BLOCK_SIZE && acZero; i++) {
+                    acZero = block[i] == 0;
+                }
+                compStats.blocks++;
+                compStats.eobOnlyBlocks += acZero;
+                compStats.zeroBlocks += acZero && block[0] == 0;
+            }
+        }
+    }
+    
+    stats.blockBytes = jpeg.blockCapacity * sizeof(*jpeg.blocks);
+    stats.coefficientBytes = jpeg.coefficients != nullptr ? jpeg.blockCapacity * sizeof(*jpeg.coefficients) : 0;
+    stats.workspaceBytes = 0;
+    if (jpeg.workspace != nullptr) {
+        for (auto it = jpeg.workspace->planes.begin(); it != jpeg.workspace->planes.end(); it++) {
+            stats.workspaceBytes += it->capacity();
+        }
+        for (auto it = jpeg.workspace->counted.begin(); it != jpeg.workspace->counted.end(); it++) {
+            stats.workspaceBytes += (it->first.capacity() + it->second.capacity()) * sizeof(JpegHistogram);
+        }
+    }
+}
+#endif
+
+void Jpeg::selectHuffmanCodes(JpegSettings& settings,
+    const coef_t (*blocks)[JPEG_BLOCK_SIZE],
+    const histograms_t *histograms)
+{
+    switch ((settings.compressionFlags & flagHuffmanMask)) {
+        case flagHuffmanOptimal:
+            if (histograms != nullptr) {
+                createJpegHuffmanCodes(settings.huffmanCodes, *histograms);
+            }
+            else {
+                histograms_t counted;
+                countSymbols(settings, blocks, counted);
+                createJpegHuffmanCodes(settings.huffmanCodes, counted);
+            }
+            break;
+        case flagHuffmanDefault:
+            setupDefaultEncodingCodes(settings);
+    }
+    checkHuffmanCodes(settings);
+}
+
+/*
+Huffman code every reset interval on its own thread
+
+Each interval starts byte aligned with fresh predictors, so intervals
+are coded independently, their marker included, and written in order.
+Returns false if dst refused any byte
+*/
+bool writeIntervalsParallel(const Jpeg::JpegSettings& settings, const Jpeg::tables_t& tables,
+    const Jpeg::coef_t (*blocks)[JPEG_BLOCK_SIZE],
+    std::streambuf& dst)
+{
+    size_t numMcus = settings.numMcus.first * settings.numMcus.second;
+    size_t interval = settings.resetInterval;
+    size_t numIntervals = (numMcus + interval - 1) / interval;
+    bool failed = false;
+    #pragma omp parallel for ordered schedule(dynamic)
+    for (size_t i = 0; i < numIntervals; i++) {
+        size_t firstMcu = i * interval;
+        std::stringbuf segment;
+        Jpeg::JpegBitWriter bout(&segment);
+        Jpeg::dct_t predictors[JPEG_MAX_COMPONENTS] = {0};
+        Jpeg::writeMcus(settings, tables, blocks + firstMcu * settings.mcuSize,
+            firstMcu, std::min(interval, numMcus - firstMcu), predictors, bout);
+        bout.flush();
+        std::string bytes = segment.str();
+        #pragma omp ordered
+        {
+            if (dst.sputn(bytes.data(), bytes.size()) != (std::streamsize)bytes.size()) {
+                failed = true;
+            }
+        }
+    }
+    return !failed;
+}
+
+/*
+Huffman code contiguous runs of MCUs on separate threads without markers
+
+The runs are coded unstuffed, then shifted to their bit offsets in the
+scan and stuffed, all in parallel. Only the bytes where two runs meet are
+merged and stuffed while joining, so the output matches the serial coder.
+Returns false if the scan is too small to be worth splitting, and
+clears good if dst refused any byte.
+*/
+bool writeStitchedParallel(const Jpeg::JpegSettings& settings, const Jpeg::tables_t& tables,
+    const Jpeg::coef_t (*blocks)[JPEG_BLOCK_SIZE],
+    std::streambuf& dst, bool& good)
+{
+    size_t numMcus = settings.numMcus.first * settings.numMcus.second;
+    size_t numPieces = 1;
+#ifdef _OPENMP
+    numPieces = std::min(numMcus / MIN_PIECE_MCUS, (size_t)omp_get_max_threads() * 4);
+#endif
+    if (numPieces <= 1) {
+        return false;
+    }
+    
+    std::vector<ScanPiece> pieces(numPieces);
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < numPieces; i++) {
+        ScanPiece& piece = pieces[i];
+        piece.firstMcu = numMcus * i / numPieces;
+        piece.numMcus = numMcus * (i + 1) / numPieces - piece.firstMcu;
+        std::stringbuf code;
+        Jpeg::JpegBitWriter bout(&code, false);
+        /* Each piece picks up the DC terms where the one before left off */
+        Jpeg::dct_t predictors[JPEG_MAX_COMPONENTS] = {0};
+        if (piece.firstMcu > 0) {
+            const Jpeg::coef_t (*previous)[JPEG_BLOCK_SIZE] =
+                blocks + (piece.firstMcu - 1) * settings.mcuSize;
+            for (size_t iComp = 0; iComp < settings.components.size(); iComp++) {
+                const Jpeg::JpegComponent& comp = settings.components[iComp];
+                size_t numBlocks = comp.sampling.first * comp.sampling.second;
+                predictors[iComp] = previous[settings.componentOffsets[iComp] + numBlocks - 1][0];
+            }
+        }
+        Jpeg::writeMcus(settings, tables, blocks + piece.firstMcu * settings.mcuSize,
+            piece.firstMcu, piece.numMcus, predictors, bout);
+        size_t padding = (8 - bout.pendingBits() % 8) % 8;
+        bout.flush();
+        piece.bits = code.str();
+        piece.bitCount = piece.bits.size() * 8 - padding;
+    }
+    
+    size_t offset = 0;
+    for (size_t i = 0; i < numPieces; i++) {
+        pieces[i].shift = offset % 8;
+        offset += pieces[i].bitCount;
+    }
+    
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < numPieces; i++) {
+        ScanPiece& piece = pieces[i];
+        size_t numBytes = (piece.bitCount + 7) / 8;
+        std::uint8_t *bits = reinterpret_cast<std::uint8_t*>(&piece.bits[0]);
+        if (piece.bitCount % 8 != 0) {
+            /* Drop the padding, the next piece continues in that byte */
+            bits[numBytes - 1] &= 0xFF << (8 - piece.bitCount % 8);
+        }
+        size_t outBytes = (piece.shift + piece.bitCount + 7) / 8;
+        std::vector<std::uint8_t> shifted(outBytes);
+        for (size_t j = 0; j < outBytes; j++) {
+            unsigned prev = (j > 0) ? bits[j - 1] : 0;
+            unsigned cur = (j < numBytes) ? bits[j] : 0;
+            shifted[j] = (std::uint8_t)((prev << (8 - piece.shift)) | (cur >> piece.shift));
+        }
+        size_t first = 0, last = outBytes;
+        piece.hasHead = piece.shift != 0;
+        if (piece.hasHead) {
+            piece.head = shifted[first++];
+        }
+        piece.hasTail = (piece.shift + piece.bitCount) % 8 != 0 && last > first;
+        if (piece.hasTail) {
+            piece.tail = shifted[--last];
+        }
+        std::stringbuf body;
+        Jpeg::JpegBitWriter stuffer(&body);
+        for (size_t j = first; j < last; j++) {
+            stuffer.write(shifted[j], 8);
+        }
+        stuffer.flush();
+        piece.body = body.str();
+        piece.bits.clear();
+    }
+    
+    Jpeg::JpegBitWriter seams(&dst);
+    std::uint8_t carry = 0;
+    bool failed = false;
+    offset = 0;
+    for (size_t i = 0; i < numPieces; i++) {
+        ScanPiece& piece = pieces[i];
+        offset += piece.bitCount;
+        if (piece.hasHead) {
+            carry |= piece.head;
+            /* Unless the piece ends inside it, the shared byte is now whole */
+            if (piece.shift + piece.bitCount >= 8) {
+                seams.write(carry, 8);
+                seams.flush();
+                carry = 0;
+            }
+        }
+        failed |= dst.sputn(piece.body.data(), piece.body.size()) != (std::streamsize)piece.body.size();
+        if (piece.hasTail) {
+            carry = piece.tail;
+        }
+    }
+    if (offset % 8 != 0) {
+        /* Pad with ones like the bit writer */
+        seams.write(carry >> (8 - offset % 8), offset % 8);
+        seams.flush();
+    }
+    good = !failed && seams.good();
+    return true;
+}
+
+bool Jpeg::Jpeg::encodeCompressed(std::streambuf& dst)
+{
+    if (settings.compressionFlags & flagParallelEntropy) {
+        if (settings.resetInterval != 0) {
+            return writeIntervalsParallel(settings, tables, blocks, dst);
+        }
+        bool good;
+        if (writeStitchedParallel(settings, tables, blocks, dst, good)) {
+            return good;
+        }
+    }
+    
+    JpegBitWriter bout(&dst);
+    dct_t predictors[JPEG_MAX_COMPONENTS] = {0};
+    writeMcus(settings, tables, blocks, 0, settings.numMcus.first * settings.numMcus.second,
+        predictors, bout);
+    bout.flush();
+    return bout.good();
+}
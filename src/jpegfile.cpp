@@ -0,0 +1,97 @@
+/*
+jpegfile.cpp
+Writing straight into memory mapped output files
+*/
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "bitutil.hpp"
+#include "jpegutil.hpp"
+#include "jpeginternal.hpp"
+
+#ifdef _WIN32
+
+size_t Jpeg::Jpeg::writeFile(const std::string& path)
+{
+    /* No mmap here, so the output is put together in memory first */
+    std::vector<std::uint8_t> data(maxEncodedSize(settings));
+    size_t size = write(data.data(), data.size());
+    std::ofstream dst(path, std::ios::binary | std::ios::trunc);
+    dst.write(reinterpret_cast<const char*>(data.data()), size);
+    if (!dst) {
+        throw JpegEncodingException("Cannot write " + path);
+    }
+    return size;
+}
+
+#else
+
+/*
+Unmap if mapped, close, and remove what writeFile made of path, leaving
+anything but a regular file in place
+*/
+void discardFile(const std::string& path, int fd, bool regular, void *mapped, size_t capacity)
+{
+    if (mapped != MAP_FAILED) {
+        munmap(mapped, capacity);
+    }
+    close(fd);
+    if (regular) {
+        unlink(path.c_str());
+    }
+}
+
+size_t Jpeg::Jpeg::writeFile(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        throw JpegEncodingException("Cannot open " + path);
+    }
+    struct stat info;
+    bool regular = fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+    /*
+    Sized to the bound, the mapping never needs to grow. The disk space is
+    reserved up front, so a full disk fails here rather than with SIGBUS
+    on a store into the mapping
+    */
+    size_t capacity = maxEncodedSize(settings);
+    void *mapped = MAP_FAILED;
+    if (posix_fallocate(fd, 0, capacity) == 0) {
+        mapped = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (mapped == MAP_FAILED) {
+        discardFile(path, fd, regular, mapped, capacity);
+        throw JpegEncodingException("Cannot map " + path);
+    }
+
+    size_t size;
+    try {
+        size = write(static_cast<std::uint8_t*>(mapped), capacity);
+    }
+    catch (...) {
+        discardFile(path, fd, regular, mapped, capacity);
+        throw;
+    }
+    if (munmap(mapped, capacity) != 0 || ftruncate(fd, size) != 0) {
+        discardFile(path, fd, regular, MAP_FAILED, capacity);
+        throw JpegEncodingException("Cannot write " + path);
+    }
+    if (close(fd) != 0) {
+        if (regular) {
+            unlink(path.c_str());
+        }
+        throw JpegEncodingException("Cannot write " + path);
+    }
+    return size;
+}
+
+#endif
@@ -0,0 +1,347 @@
+/*
+jpeginternal.hpp
+Encoder stages shared between the translation units of the library
+Not installed with the public header
+*/
+
+#ifndef _JPEGINTERNAL_HPP
+#define _JPEGINTERNAL_HPP
+
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+#include <iostream>
+#include <vector>
+#ifdef JPEG_STATS
+#include <chrono>
+#include <ctime>
+#endif
+
+#include "bitutil.hpp"
+#include "jpegutil.hpp"
+
+/* x86 kernels are compiled with per-function target attributes and picked at runtime */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JPEG_X86_SIMD
+#endif
+
+/* Fraction bits of the color conversion coefficients, small enough for 16-bit multiplies */
+#define JPEG_COLOR_BITS 15
+#define JPEG_COLOR_HALF (1 << (JPEG_COLOR_BITS - 1))
+
+namespace Jpeg {
+    
+    /*
+    R, G and B weights and the rounding bias of Y, Cb and Cr
+    The chroma bias rounds halves down so that no result can exceed 255
+    */
+    extern const std::int32_t colorFix[3][4];
+    
+    /*
+    Fixed point version of componentFromRGB, always within 0-255
+    */
+    inline std::uint8_t ycbcrFromRGB(const std::uint8_t *rgb, size_t component)
+    {
+        const std::int32_t *fix = colorFix[component];
+        return (fix[0] * rgb[0] + fix[1] * rgb[1] + fix[2] * rgb[2] + fix[3]) >> JPEG_COLOR_BITS;
+    }
+    
+    /*
+    Samples of one component at its own resolution
+    stride: distance between the starts of rows
+    step: distance between samples in a row
+    */
+    struct JpegPlane {
+        const std::uint8_t *data;
+        size_t width;
+        size_t height;
+        size_t stride;
+        size_t step;
+    };
+    
+    /*
+    Scratch of encodeStripeRGB, one entry per thread, grown as needed and
+    kept by a Jpeg so later frames reuse it
+    */
+    struct JpegWorkspace {
+        std::vector<std::vector<std::uint8_t>> planes;
+        std::vector<histograms_t> counted;
+    };
+    
+    /* (Huffman symbol, extra bits) */
+    using split_t = std::pair<std::uint8_t, std::uint16_t>;
+    
+    /*
+    First byte of row y of an image of the given width that is height rows tall
+    */
+    inline const std::uint8_t *pixelRow(const JpegPixels& pixels, size_t width, size_t height, size_t y)
+    {
+        size_t stride = pixels.stride != 0 ? pixels.stride : width * pixelBytes(pixels.format);
+        return pixels.data + (pixels.bottomUp ? height - 1 - y : y) * stride;
+    }
+    
+    /*
+    Index in the blocks of an image of block (x, y) of component iComp,
+    counting the component's blocks across and down the whole MCU grid
+    */
+    inline size_t gridBlock(const JpegSettings& settings, size_t iComp, size_t x, size_t y)
+    {
+        const JpegComponent& comp = settings.components[iComp];
+        size_t numX = comp.sampling.first;
+        size_t numY = comp.sampling.second;
+        size_t iMcu = (y / numY) * settings.numMcus.first + x / numX;
+        return iMcu * settings.mcuSize + settings.componentOffsets[iComp] + (y % numY) * numX + x % numX;
+    }
+    
+    /*
+    Copy of settings for an image of another size or sampling, keeping the
+    quantization tables as they are, not as quality would scale them
+    */
+    JpegSettings reshapedSettings(const JpegSettings& settings,
+        std::pair<int, int> size, const std::vector<JpegComponent>& components);
+    
+    /*
+    Color convert, DCT and quantize a stripe of whole MCU rows
+    
+    pixels: the stripe, rows of settings.size.first pixels
+    rows: number of valid pixel rows in the stripe, further rows repeat the last
+    numMcuRows: number of MCU rows to produce
+    blocks: output, settings.mcuSize blocks per MCU
+    histograms: if given, the symbols of the blocks are added to it, as
+    coded from the start of a scan; sized by resetHistograms
+    coefficients: if given, also gets the unquantized blocks
+    workspace: if given, scratch buffers to reuse instead of allocating
+    */
+    void encodeStripeRGB(const JpegSettings& settings,
+        const JpegPixels& pixels, size_t rows,
+        size_t numMcuRows, coef_t (*blocks)[JPEG_BLOCK_SIZE],
+        histograms_t *histograms = nullptr,
+        float (*coefficients)[JPEG_BLOCK_SIZE] = nullptr,
+        JpegWorkspace *workspace = nullptr);
+    
+    /*
+    encodeStripeRGB for callers already running in a parallel region,
+    as OpenMP tasks of rowsPerTask MCU rows each
+    */
+    void encodeStripeTasks(const JpegSettings& settings,
+        const JpegPixels& pixels, size_t rows,
+        size_t numMcuRows, coef_t (*blocks)[JPEG_BLOCK_SIZE],
+        size_t rowsPerTask, histograms_t *histograms = nullptr,
+        float (*coefficients)[JPEG_BLOCK_SIZE] = nullptr);
+    
+    /*
+    Populate jpeg with pixels, as Jpeg::encode
+    
+    rowsPerTask: 0 to share the rows out in a parallel region of its own,
+    otherwise MCU rows per task of encodeStripeTasks
+    */
+    void encodeImageRGB(Jpeg& jpeg, const JpegPixels& pixels, size_t rowsPerTask = 0);
+    
+    /*
+    DCT and quantize every MCU of an image given as one plane per component,
+    each already at the component's sampling, repeating the last column
+    and row of a plane past its edge
+    
+    blocks, histograms, coefficients: as for encodeStripeRGB
+    */
+    void encodePlanes(const JpegSettings& settings, const JpegPlane *planes,
+        coef_t (*blocks)[JPEG_BLOCK_SIZE], histograms_t *histograms = nullptr,
+        float (*coefficients)[JPEG_BLOCK_SIZE] = nullptr);
+    
+    /*
+    Reconstruct one component at 1/scale of its size from the low
+    frequencies of its blocks
+    
+    coefficients: kept coefficients, or nullptr to dequantize blocks
+    plane: output, numMcus.first * sampling.first * 8 / scale samples
+    wide and as many rows for the blocks down
+    */
+    void reduceComponent(const JpegSettings& settings,
+        const coef_t (*blocks)[JPEG_BLOCK_SIZE],
+        const float (*coefficients)[JPEG_BLOCK_SIZE],
+        size_t iComp, int scale, std::uint8_t *plane);
+    
+    /*
+    Downsample the numX by numY blocks of one component of an MCU from its
+    plane, level shifted for the DCT
+    
+    plane: first sample of the MCU in the plane
+    numX, numY: sampling factors of the component
+    denX, denY: largest sampling factors of the image
+    */
+    void blockifyComponent(const std::uint8_t *plane, size_t planeWidth,
+        int numX, int numY, int denX, int denY, int levelShift,
+        float (*cBlocks)[JPEG_BLOCK_SIZE]);
+    
+    using BlockifyKernel = void (*)(const std::uint8_t *plane, size_t planeWidth,
+        int numX, int numY, int denX, int denY, int levelShift,
+        float (*cBlocks)[JPEG_BLOCK_SIZE]);
+    
+    /*
+    Fastest equivalent of blockifyComponent for these sampling factors,
+    picked once per image: 4:4:4, 4:2:2, 4:2:0, 4:4:0 and gray have
+    kernels with their boxes fixed at compile time, anything else gets
+    blockifyComponent itself
+    */
+    BlockifyKernel blockifyKernel(int numX, int numY, int denX, int denY);
+    
+    /*
+    Weights of the samples covered by [start, end) when part of the first
+    or last sample is covered, as described in sampling.txt
+    
+    returns the number of samples
+    */
+    size_t boxWeights(float start, float end, size_t *index, float *weight);
+    
+    /*
+    Width and height of the JFIF thumbnail, 0 by 0 without one
+    */
+    std::pair<int, int> thumbnailDimensions(const JpegSettings& settings);
+    
+    /*
+    RGB thumbnail of thumbnailDimensions from the DC terms of the blocks
+    */
+    std::vector<std::uint8_t> makeThumbnail(const JpegSettings& settings,
+        const coef_t (*blocks)[JPEG_BLOCK_SIZE],
+        const float (*coefficients)[JPEG_BLOCK_SIZE]);
+    
+    /*
+    Quantize whole MCU rows of coefficients kept by encodeStripeRGB into
+    blocks, counting their symbols as it does
+    */
+    void quantizeCoefficients(const JpegSettings& settings,
+        const float (*coefficients)[JPEG_BLOCK_SIZE], size_t numMcuRows,
+        coef_t (*blocks)[JPEG_BLOCK_SIZE], histograms_t *histograms);
+    
+    split_t splitNumber(dct_t number);
+    
+    /*
+    Zeroed histograms for every table the components refer to
+    */
+    void resetHistograms(const JpegSettings& settings, histograms_t& histograms);
+    
+    void addHistograms(histograms_t& dst, const histograms_t& src);
+    
+    /*
+    Count the AC symbols of one quantized block
+    */
+    void countAcSymbols(const coef_t *block, JpegHistogram& counts);
+    
+    /*
+    Huffman code numMcus MCUs with the compiled tables,
+    straight from the coefficients
+    
+    firstMcu: index of blocks[0]'s MCU in the image; every MCU after the
+    first that starts a reset interval is preceded by its RSTn marker
+    predictors: DC predictors of each component, carried in and out so
+    consecutive calls continue the scan
+    */
+    void writeMcus(const JpegSettings& settings, const tables_t& tables,
+        const coef_t (*blocks)[JPEG_BLOCK_SIZE],
+        size_t firstMcu, size_t numMcus,
+        dct_t *predictors, JpegBitWriter& bout);
+    
+    void setupDefaultEncodingCodes(JpegSettings& settings);
+    
+    /*
+    Throws JpegEncodingException if a component refers to a missing table
+    */
+    void checkHuffmanCodes(const JpegSettings& settings);
+    
+    /*
+    Fill settings.huffmanCodes according to the compression flags
+    
+    Optimal codes are built from histograms if given, otherwise from
+    symbols counted in the blocks
+    */
+    void selectHuffmanCodes(JpegSettings& settings,
+        const coef_t (*blocks)[JPEG_BLOCK_SIZE],
+        const histograms_t *histograms = nullptr);
+    
+    /*
+    Compile settings.huffmanCodes into code/length lookup tables
+    */
+    void compileHuffmanCodes(JpegSettings& settings, tables_t& tables);
+    
+    /*
+    Write everything from SOI up to and including SOS, with DRI when
+    settings.resetInterval is set
+    
+    tables: compiled from settings.huffmanCodes, which the DHT segments
+    are written from
+    thumbnail: RGB pixels of thumbnailDimensions for APP0, or nullptr
+    for none
+    Both return false if dst refused any byte
+    */
+    bool writeHeaders(const JpegSettings& settings, const tables_t& tables,
+        std::streambuf& dst, const std::uint8_t *thumbnail = nullptr);
+    
+    bool writeTrailer(std::streambuf& dst);
+    
+    /*
+    Count the symbols of every block into zeroed histograms, as they
+    would be coded from the start of the scan
+    */
+    void countSymbols(const JpegSettings& settings,
+        const coef_t (*blocks)[JPEG_BLOCK_SIZE], histograms_t& histograms);
+    
+    /*
+    Throws JpegEncodingException if numMcus MCUs from firstMcu use a symbol
+    the compiled tables have no code for, as provided codes may
+    
+    predictors: DC predictors carried into blocks[0], left as they are
+    */
+    void checkCodedSymbols(const JpegSettings& settings, const tables_t& tables,
+        const coef_t (*blocks)[JPEG_BLOCK_SIZE],
+        size_t firstMcu, size_t numMcus, const dct_t *predictors);
+    
+#ifdef JPEG_STATS
+    /*
+    Times the scope it is made in as a stage of stats, if not null
+    */
+    class JpegStageTimer {
+        private:
+            JpegEncodeStats *stats;
+            JpegStage stage;
+            std::chrono::steady_clock::time_point wallStart;
+            std::clock_t cpuStart;
+        public:
+            JpegStageTimer(JpegEncodeStats *stats, JpegStage stage) :
+                stats {stats},
+                stage {stage}
+            {
+                if (stats != nullptr) {
+                    wallStart = std::chrono::steady_clock::now();
+                    cpuStart = std::clock();
+                }
+            }
+            
+            ~JpegStageTimer()
+            {
+                if (stats == nullptr) {
+                    return;
+                }
+                double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+                double cpu = (double)(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+                stats->wallSeconds[stage] = wall;
+                stats->cpuSeconds[stage] = cpu;
+                if (stats->hook != nullptr) {
+                    stats->hook(stage, wall, cpu, stats->hookContext);
+                }
+            }
+    };
+    
+    /*
+    Per component figures, symbols and buffer sizes of jpeg's last write
+    */
+    void collectEncodeStats(const Jpeg& jpeg, JpegEncodeStats& stats);
+    
+/* Times the rest of the enclosing scope as a stage, with no code at all without JPEG_STATS */
+#define JPEG_TIME_STAGE(stats, stage) ::Jpeg::JpegStageTimer stageTimer((stats), (stage))
+#else
+#define JPEG_TIME_STAGE(stats, stage)
+#endif
+    
+}
+
+#endif
@@ -0,0 +1,553 @@
+/*
+jpegread.cpp
+Reading baseline JPEG files back to their quantized blocks
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+#include "bitutil.hpp"
+#include "jpegutil.hpp"
+#include "jpeginternal.hpp"
+
+/* Bits looked up at once when decoding Huffman codes */
+#define LOOKUP_BITS 8
+
+/*
+Huffman decoding table of one DHT table, as in Annex F.2.2.3 of the
+standard, with a lookup of the symbols of codes up to LOOKUP_BITS long
+*/
+struct DecodeTable {
+    bool defined = false;
+    /* Largest code of each length, -1 for none */
+    std::int32_t maxCode[18];
+    /* Index in symbols of the first code of each length, less that code */
+    std::int32_t offset[17];
+    std::uint8_t symbols[256];
+    /* (length << 8) | symbol of a code starting with these bits, 0 if longer */
+    std::uint16_t lookup[1 << LOOKUP_BITS];
+    /* Symbols of each length, as the DHT segment lists them */
+    std::vector<std::vector<int>> byLength;
+};
+
+/*
+Everything the headers of a file give, filled in as segments are read
+*/
+struct FileHeaders {
+    Jpeg::dqt_t qtables[4][JPEG_BLOCK_SIZE];
+    bool qtableDefined[4] = {false, false, false, false};
+    DecodeTable dcTables[4];
+    DecodeTable acTables[4];
+    bool frameRead = false;
+    std::pair<int, int> size;
+    /* Identifier, sampling and quantization table of each component */
+    std::vector<int> ids;
+    std::vector<Jpeg::JpegComponent> components;
+    int restartInterval = 0;
+    Jpeg::JpegDensityUnits densityUnits = Jpeg::RELATIVE;
+    std::pair<int, int> density = std::pair<int, int>(1, 1);
+    std::pair<int, int> version = std::pair<int, int>(1, 1);
+    std::vector<std::string> extraSegments;
+};
+
+void buildDecodeTable(DecodeTable& table, const std::uint8_t *counts, const std::uint8_t *symbols)
+{
+    size_t numSymbols = 0;
+    std::int32_t code = 0;
+    table.byLength.assign(16, std::vector<int>());
+    std::fill(table.lookup, table.lookup + (1 << LOOKUP_BITS), 0);
+    for (size_t length = 1; length <= 16; length++) {
+        table.offset[length] = numSymbols - code;
+        for (size_t i = 0; i < counts[length - 1]; i++, numSymbols++, code++) {
+            table.symbols[numSymbols] = symbols[numSymbols];
+            table.byLength[length - 1].push_back(symbols[numSymbols]);
+            if (length <= LOOKUP_BITS) {
+                /* Every index that starts with this code */
+                size_t shift = LOOKUP_BITS - length;
+                for (size_t fill = 0; fill < ((size_t)1 << shift); fill++) {
+                    table.lookup[(code << shift) | fill] = (length << 8) | symbols[numSymbols];
+                }
+            }
+        }
+        table.maxCode[length] = counts[length - 1] != 0 ? code - 1 : -1;
+        if (code > (1 << length)) {
+            throw Jpeg::JpegEncodingException("Huffman table has too many codes");
+        }
+        code <<= 1;
+    }
+    /* Ends the search for codes that are too long */
+    table.maxCode[17] = INT32_MAX;
+    while (!table.byLength.empty() && table.byLength.back().empty()) {
+        table.byLength.pop_back();
+    }
+    table.defined = true;
+}
+
+/*
+Entropy coded data, with stuffed zero bytes removed and a marker ending it
+*/
+class ScanReader {
+    private:
+        const std::uint8_t *data;
+        size_t end;
+        size_t position;
+        std::uint64_t buffer;
+        int numBits;
+        /* Reached a marker, which only zero bits follow */
+        bool atMarker;
+        void fill();
+    public:
+        ScanReader(const std::vector<std::uint8_t>& file, size_t start) :
+            data {file.data()},
+            end {file.size()},
+            position {start},
+            buffer {0},
+            numBits {0},
+            atMarker {false}
+        {}
+        std::uint32_t bits(int count);
+        int decode(const DecodeTable& table);
+        /*
+        Skip the padding to the RSTn marker and read on after it
+        */
+        void restart(int n);
+        /* Offset of the marker that ends the data, skipping what is left */
+        size_t finish();
+};
+
+void ScanReader::fill()
+{
+    while (numBits <= 56) {
+        std::uint8_t byte = 0;
+        if (!atMarker) {
+            if (position >= end) {
+                throw Jpeg::JpegEncodingException("File ends inside the scan");
+            }
+            byte = data[position];
+            if (byte == 0xFF) {
+                if (position + 1 >= end) {
+                    throw Jpeg::JpegEncodingException("File ends inside the scan");
+                }
+                if (data[position + 1] == 0x00) {
+                    position += 2;
+                }
+                else {
+                    atMarker = true;
+                    byte = 0;
+                }
+            }
+            else {
+                position++;
+            }
+        }
+        buffer |= (std::uint64_t)byte << (56 - numBits);
+        numBits += 8;
+    }
+}
+
+std::uint32_t ScanReader::bits(int count)
+{
+    if (count == 0) {
+        return 0;
+    }
+    if (numBits < count) {
+        fill();
+    }
+    std::uint32_t value = buffer >> (64 - count);
+    buffer <<= count;
+    numBits -= count;
+    return value;
+}
+
+int ScanReader::decode(const DecodeTable& table)
+{
+    if (numBits < 16) {
+        fill();
+    }
+    std::uint16_t entry = table.lookup[buffer >> (64 - LOOKUP_BITS)];
+    if (entry != 0) {
+        int length = entry >> 8;
+        buffer <<= length;
+        numBits -= length;
+        return entry & 0xFF;
+    }
+    std::int32_t code = 0;
+    for (int length = 1; length <= 16; length++) {
+        code = (code << 1) | (std::int32_t)(buffer >> 63);
+        buffer <<= 1;
+        numBits--;
+        if (code <= table.maxCode[length]) {
+            return table.symbols[table.offset[length] + code];
+        }
+    }
+    throw Jpeg::JpegEncodingException("Invalid Huffman code in the scan");
+}
+
+void ScanReader::restart(int n)
+{
+    size_t marker = finish();
+    if (data[marker + 1] != 0xD0 + n) {
+        throw Jpeg::JpegEncodingException("Missing restart marker");
+    }
+    position = marker + 2;
+    atMarker = false;
+    buffer = 0;
+    numBits = 0;
+}
+
+size_t ScanReader::finish()
+{
+    /* Only padding is left in the buffer */
+    while (!atMarker) {
+        numBits = 0;
+        buffer = 0;
+        fill();
+    }
+    return position;
+}
+
+/*
+Value of a coefficient of category size from its extra bits, as EXTEND in
+the standard
+*/
+Jpeg::dct_t extendBits(std::uint32_t value, int size)
+{
+    if (size == 0) {
+        return 0;
+    }
+    return value < (1u << (size - 1)) ? (Jpeg::dct_t)value - (1 << size) + 1 : (Jpeg::dct_t)value;
+}
+
+void readBlock(ScanReader& reader, const DecodeTable& dcTable, const DecodeTable& acTable,
+    Jpeg::dct_t& predictor, Jpeg::coef_t *block)
+{
+    int size = reader.decode(dcTable);
+    if (size > 11) {
+        throw Jpeg::JpegEncodingException("DC difference out of range");
+    }
+    predictor += extendBits(reader.bits(size), size);
+    if (predictor < std::numeric_limits<Jpeg::coef_t>::min() || predictor > std::numeric_limits<Jpeg::coef_t>::max()) {
+        throw Jpeg::JpegEncodingException("DC coefficient out of range");
+    }
+    block[0] = predictor;
+    size_t k = 1;
+    while (k < JPEG_BLOCK_SIZE) {
+        int symbol = reader.decode(acTable);
+        int run = symbol >> 4;
+        size = symbol & 0xF;
+        if (size == 0) {
+            if (run != 15) {
+                break;
+            }
+            /* ZRL */
+            for (int i = 0; i < 16 && k < JPEG_BLOCK_SIZE; i++) {
+                block[k++] = 0;
+            }
+            continue;
+        }
+        for (; run > 0 && k < JPEG_BLOCK_SIZE; run--) {
+            block[k++] = 0;
+        }
+        if (k >= JPEG_BLOCK_SIZE) {
+            throw Jpeg::JpegEncodingException("Coefficients run past the end of a block");
+        }
+        block[k++] = extendBits(reader.bits(size), size);
+    }
+    for (; k < JPEG_BLOCK_SIZE; k++) {
+        block[k] = 0;
+    }
+}
+
+/*
+Decode one scan starting at start into jpeg's blocks, marking the blocks
+it covers
+
+comps: indices of the scan's components, with their DC and AC tables
+returns the offset of the marker after the scan
+*/
+size_t readScan(const std::vector<std::uint8_t>& file, size_t start, const FileHeaders& headers,
+    const std::vector<int>& comps, const std::vector<std::pair<int, int>>& tableIds,
+    Jpeg::Jpeg& jpeg, std::vector<bool>& covered)
+{
+    const Jpeg::JpegSettings& settings = jpeg.settings;
+    ScanReader reader(file, start);
+    Jpeg::dct_t predictors[JPEG_MAX_COMPONENTS] = {0};
+    size_t interval = headers.restartInterval;
+    /* One block per unit without interleaving, the component's blocks that show */
+    bool interleaved = comps.size() > 1;
+    size_t unitsX = settings.numMcus.first, unitsY = settings.numMcus.second;
+    if (!interleaved) {
+        const Jpeg::JpegComponent& comp = settings.components[comps[0]];
+        size_t samplesX = (settings.size.first * comp.sampling.first + settings.mcuScale.first - 1) / settings.mcuScale.first;
+        size_t samplesY = (settings.size.second * comp.sampling.second + settings.mcuScale.second - 1) / settings.mcuScale.second;
+        unitsX = (samplesX + JPEG_BLOCK_ROW - 1) / JPEG_BLOCK_ROW;
+        unitsY = (samplesY + JPEG_BLOCK_ROW - 1) / JPEG_BLOCK_ROW;
+    }
+    size_t numUnits = unitsX * unitsY;
+    for (size_t unit = 0; unit < numUnits; unit++) {
+        if (interval != 0 && unit != 0 && unit % interval == 0) {
+            reader.restart((unit / interval - 1) % 8);
+            std::fill(predictors, predictors + JPEG_MAX_COMPONENTS, 0);
+        }
+        size_t unitX = unit % unitsX, unitY = unit / unitsX;
+        for (size_t i = 0; i < comps.size(); i++) {
+            int iComp = comps[i];
+            const DecodeTable& dcTable = headers.dcTables[tableIds[i].first];
+            const DecodeTable& acTable = headers.acTables[tableIds[i].second];
+            const Jpeg::JpegComponent& comp = settings.components[iComp];
+            size_t numX = interleaved ? comp.sampling.first : 1;
+            size_t numY = interleaved ? comp.sampling.second : 1;
+            for (size_t y = 0; y < numY; y++) {
+                for (size_t x = 0; x < numX; x++) {
+                    size_t iBlock = Jpeg::gridBlock(settings, iComp, unitX * numX + x, unitY * numY + y);
+                    readBlock(reader, dcTable, acTable, predictors[iComp], jpeg.blocks[iBlock]);
+                    covered[iBlock] = true;
+                }
+            }
+        }
+    }
+    return reader.finish();
+}
+
+/*
+Give blocks past the edge that no scan covered the DC of the block before
+them, so they cost next to nothing when written interleaved
+*/
+void fillUncovered(Jpeg::Jpeg& jpeg, const std::vector<bool>& covered)
+{
+    const Jpeg::JpegSettings& settings = jpeg.settings;
+    for (size_t iComp = 0; iComp < settings.components.size(); iComp++) {
+        size_t width = settings.numMcus.first * settings.components[iComp].sampling.first;
+        size_t height = settings.numMcus.second * settings.components[iComp].sampling.second;
+        for (size_t y = 0; y < height; y++) {
+            for (size_t x = 0; x < width; x++) {
+                size_t iBlock = Jpeg::gridBlock(settings, iComp, x, y);
+                if (covered[iBlock]) {
+                    continue;
+                }
+                if (x == 0 && y == 0) {
+                    throw Jpeg::JpegEncodingException("A component has no scan");
+                }
+                size_t iFrom = x > 0 ? Jpeg::gridBlock(settings, iComp, x - 1, y) :
+                    Jpeg::gridBlock(settings, iComp, x, y - 1);
+                jpeg.blocks[iBlock][0] = jpeg.blocks[iFrom][0];
+                for (size_t i = 1; i < JPEG_BLOCK_SIZE; i++) {
+                    jpeg.blocks[iBlock][i] = 0;
+                }
+            }
+        }
+    }
+}
+
+/*
+The settings the headers describe, with the file's quantization tables
+and Huffman codes
+*/
+Jpeg::JpegSettings settingsFromHeaders(const FileHeaders& headers,
+    const std::vector<std::pair<int, int>>& componentTables)
+{
+    std::vector<Jpeg::JpegComponent> components = headers.components;
+    for (size_t i = 0; i < components.size(); i++) {
+        components[i].dcTable = componentTables[i].first;
+        components[i].acTable = componentTables[i].second;
+        if (!headers.qtableDefined[components[i].qtable]) {
+            throw Jpeg::JpegEncodingException("A component refers to a missing quantization table");
+        }
+    }
+    /* Quality 50 leaves the base tables as they are */
+    int numQTables = 0;
+    const Jpeg::dqt_t *qtables[JPEG_MAX_COMPONENTS];
+    for (int i = 0; i < 4; i++) {
+        if (headers.qtableDefined[i]) {
+            numQTables = i + 1;
+        }
+        qtables[i] = headers.qtables[headers.qtableDefined[i] ? i : components[0].qtable];
+    }
+    Jpeg::codes_t codes;
+    size_t numDc = 0, numAc = 0;
+    for (size_t i = 0; i < components.size(); i++) {
+        numDc = std::max(numDc, components[i].dcTable + 1);
+        numAc = std::max(numAc, components[i].acTable + 1);
+    }
+    /* Tables no component uses stand in for gaps; they are never written */
+    for (size_t i = 0; i < numDc; i++) {
+        const DecodeTable& table = headers.dcTables[headers.dcTables[i].defined ? i : components[0].dcTable];
+        codes.first.push_back(Huffman::HuffmanCode(table.byLength));
+    }
+    for (size_t i = 0; i < numAc; i++) {
+        const DecodeTable& table = headers.acTables[headers.acTables[i].defined ? i : components[0].acTable];
+        codes.second.push_back(Huffman::HuffmanCode(table.byLength));
+    }
+    Jpeg::JpegSettings settings(headers.size, &components, headers.densityUnits,
+        headers.density, 50, Jpeg::flagHuffmanProvided, numQTables, qtables,
+        headers.version, &codes, 8, headers.restartInterval);
+    settings.extraSegments = headers.extraSegments;
+    return settings;
+}
+
+Jpeg::Jpeg Jpeg::readJpeg(std::istream& src)
+{
+    std::vector<std::uint8_t> file((std::istreambuf_iterator<char>(src)), std::istreambuf_iterator<char>());
+    if (file.size() < 4 || file[0] != 0xFF || file[1] != 0xD8) {
+        throw JpegEncodingException("Not a JPEG file");
+    }
+    FileHeaders headers;
+    /* Read once the first scan's tables are known, as they go in the settings */
+    std::unique_ptr<Jpeg> jpeg;
+    std::vector<bool> covered;
+    std::vector<std::pair<int, int>> componentTables;
+    size_t position = 2;
+    while (true) {
+        if (position + 2 > file.size() || file[position] != 0xFF) {
+            throw JpegEncodingException("Expected a marker");
+        }
+        std::uint8_t marker = file[position + 1];
+        if (marker == 0xFF) {
+            /* Fill byte */
+            position++;
+            continue;
+        }
+        if (marker == 0xD9) {
+            break;
+        }
+        if (position + 4 > file.size()) {
+            throw JpegEncodingException("Segment runs past the end of the file");
+        }
+        size_t length = file[position + 2] << 8 | file[position + 3];
+        if (length < 2 || position + 2 + length > file.size()) {
+            throw JpegEncodingException("Segment runs past the end of the file");
+        }
+        const std::uint8_t *segment = file.data() + position + 4;
+        size_t segmentLength = length - 2;
+        size_t next = position + 2 + length;
+    
+        if (marker == 0xE0 && segmentLength >= 14 && std::equal(segment, segment + 5, "JFIF")) {
+            headers.version = std::pair<int, int>(segment[5], segment[6]);
+            headers.densityUnits = (JpegDensityUnits)segment[7];
+            headers.density = std::pair<int, int>(segment[8] << 8 | segment[9], segment[10] << 8 | segment[11]);
+        }
+        else if ((marker >= 0xE0 && marker <= 0xEF) || marker == 0xFE) {
+            headers.extraSegments.push_back(std::string(file.begin() + position, file.begin() + next));
+        }
+        else if (marker == 0xDB) {
+            for (size_t i = 0; i < segmentLength; i += 1 + JPEG_BLOCK_SIZE) {
+                int id = segment[i] & 0xF;
+                if (segment[i] >> 4 != 0 || id > 3 || i + 1 + JPEG_BLOCK_SIZE > segmentLength) {
+                    throw JpegEncodingException("Only 8-bit quantization tables 0 to 3 are supported");
+                }
+                for (size_t j = 0; j < JPEG_BLOCK_SIZE; j++) {
+                    headers.qtables[id][zigzag[j]] = segment[i + 1 + j];
+                }
+                headers.qtableDefined[id] = true;
+            }
+        }
+        else if (marker == 0xC4) {
+            for (size_t i = 0; i < segmentLength; ) {
+                int tableClass = segment[i] >> 4, id = segment[i] & 0xF;
+                if (tableClass > 1 || id > 3 || i + 17 > segmentLength) {
+                    throw JpegEncodingException("Invalid Huffman table");
+                }
+                size_t numSymbols = 0;
+                for (size_t j = 0; j < 16; j++) {
+                    numSymbols += segment[i + 1 + j];
+                }
+                if (numSymbols > 256 || i + 17 + numSymbols > segmentLength) {
+                    throw JpegEncodingException("Invalid Huffman table");
+                }
+                buildDecodeTable(tableClass == 0 ? headers.dcTables[id] : headers.acTables[id],
+                    segment + i + 1, segment + i + 17);
+                i += 17 + numSymbols;
+            }
+        }
+        else if (marker == 0xC0) {
+            if (headers.frameRead || segmentLength < 6 || segment[0] != 8) {
+                throw JpegEncodingException("Only one 8-bit frame is supported");
+            }
+            headers.size = std::pair<int, int>(segment[3] << 8 | segment[4], segment[1] << 8 | segment[2]);
+            size_t numComps = segment[5];
+            if (headers.size.first == 0 || headers.size.second == 0 || numComps == 0 ||
+                numComps > JPEG_MAX_COMPONENTS || segmentLength < 6 + 3 * numComps) {
+                throw JpegEncodingException("Invalid frame header");
+            }
+            for (size_t i = 0; i < numComps; i++) {
+                const std::uint8_t *comp = segment + 6 + 3 * i;
+                if (comp[2] > 3) {
+                    throw JpegEncodingException("Invalid frame header");
+                }
+                headers.ids.push_back(comp[0]);
+                headers.components.push_back(JpegComponent(
+                    std::pair<int, int>(comp[1] >> 4, comp[1] & 0xF), comp[2], 0, 0));
+            }
+            componentTables.assign(numComps, std::pair<int, int>(-1, -1));
+            headers.frameRead = true;
+        }
+        else if (marker == 0xDD) {
+            if (segmentLength < 2) {
+                throw JpegEncodingException("Invalid restart interval");
+            }
+            headers.restartInterval = segment[0] << 8 | segment[1];
+        }
+        else if (marker == 0xDA) {
+            size_t numScanComps = segmentLength > 0 ? segment[0] : 0;
+            if (!headers.frameRead || numScanComps == 0 || segmentLength < 4 + 2 * numScanComps) {
+                throw JpegEncodingException("Invalid scan header");
+            }
+            std::vector<int> comps;
+            std::vector<std::pair<int, int>> tableIds;
+            for (size_t i = 0; i < numScanComps; i++) {
+                auto found = std::find(headers.ids.begin(), headers.ids.end(), segment[1 + 2 * i]);
+                int dc = segment[2 + 2 * i] >> 4, ac = segment[2 + 2 * i] & 0xF;
+                if (found == headers.ids.end() || dc > 3 || ac > 3 ||
+                    !headers.dcTables[dc].defined || !headers.acTables[ac].defined) {
+                    throw JpegEncodingException("A scan refers to a missing component or table");
+                }
+                int iComp = found - headers.ids.begin();
+                comps.push_back(iComp);
+                tableIds.push_back(std::pair<int, int>(dc, ac));
+                componentTables[iComp] = tableIds.back();
+            }
+            const std::uint8_t *selection = segment + 1 + 2 * numScanComps;
+            if (selection[0] != 0 || selection[1] != 63 || selection[2] != 0) {
+                throw JpegEncodingException("Only sequential scans are supported");
+            }
+            if (jpeg == nullptr) {
+                /* Components of later scans take the first one's tables until they are read */
+                for (size_t i = 0; i < componentTables.size(); i++) {
+                    if (componentTables[i].first < 0) {
+                        componentTables[i] = tableIds[0];
+                    }
+                }
+                jpeg.reset(new Jpeg(settingsFromHeaders(headers, componentTables)));
+                covered.assign(jpeg->blockCapacity, false);
+            }
+            next = readScan(file, next, headers, comps, tableIds, *jpeg, covered);
+        }
+        else if ((marker >= 0xC1 && marker <= 0xCF) || marker == 0xDE) {
+            throw JpegEncodingException("Only baseline Huffman coded files are supported");
+        }
+        /* Other markers carry nothing the blocks need */
+        position = next;
+    }
+    if (jpeg == nullptr) {
+        throw JpegEncodingException("The file has no scan");
+    }
+    fillUncovered(*jpeg, covered);
+    /* Tables as each component's last scan had them */
+    JpegSettings settings = settingsFromHeaders(headers, componentTables);
+    jpeg->settings.huffmanCodes = settings.huffmanCodes;
+    for (size_t i = 0; i < settings.components.size(); i++) {
+        jpeg->settings.components[i] = settings.components[i];
+    }
+    return std::move(*jpeg);
+}
+
+void Jpeg::reoptimize(std::istream& src, std::ostream& dst)
+{
+    Jpeg jpeg = readJpeg(src);
+    jpeg.settings.compressionFlags = (jpeg.settings.compressionFlags & ~flagHuffmanMask) | flagHuffmanOptimal;
+    jpeg.write(dst);
+}
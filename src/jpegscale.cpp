@@ -0,0 +1,224 @@
+/*
+jpegscale.cpp
+Smaller copies of an encoded image, made from its DCT coefficients
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "jpegutil.hpp"
+#include "jpeginternal.hpp"
+
+/* Largest APP0 thumbnail, limited by the 16-bit segment length */
+#define THUMBNAIL_MAX_BYTES (0xFFFF - 16)
+
+void Jpeg::reduceComponent(const JpegSettings& settings,
+    const coef_t (*blocks)[JPEG_BLOCK_SIZE],
+    const float (*coefficients)[JPEG_BLOCK_SIZE],
+    size_t iComp, int scale, std::uint8_t *plane)
+{
+    const JpegComponent& comp = settings.components[iComp];
+    int numX = comp.sampling.first;
+    int numY = comp.sampling.second;
+    /* Samples each way of a reduced block */
+    size_t side = JPEG_BLOCK_ROW / scale;
+    size_t blocksX = settings.numMcus.first * numX;
+    size_t blocksY = settings.numMcus.second * numY;
+    size_t planeWidth = blocksX * side;
+    const dqt_t *qTable = settings.qtables[comp.qtable];
+    float levelShift = 1 << (settings.bitDepth - 1);
+
+    /*
+    An 8 point DCT scaled by sqrt(side / 8) is a side point DCT of the box
+    filtered samples, which leaves the basis C(u) / 2 * cos((2x + 1)u pi / 2side)
+    for the lowest side frequencies
+    */
+    float basis[JPEG_BLOCK_ROW][JPEG_BLOCK_ROW];
+    for (size_t x = 0; x < side; x++) {
+        for (size_t u = 0; u < side; u++) {
+            float c = u == 0 ? std::sqrt(0.5f) : 1.0f;
+            basis[x][u] = c / 2 * std::cos((2 * x + 1) * u * M_PI / (2 * side));
+        }
+    }
+    /* Zigzag position of each natural index */
+    size_t position[JPEG_BLOCK_SIZE];
+    for (size_t i = 0; i < JPEG_BLOCK_SIZE; i++) {
+        position[zigzag[i]] = i;
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t yBlock = 0; yBlock < blocksY; yBlock++) {
+        for (size_t xBlock = 0; xBlock < blocksX; xBlock++) {
+            size_t iMcu = (yBlock / numY) * settings.numMcus.first + xBlock / numX;
+            size_t iBlock = iMcu * settings.mcuSize + settings.componentOffsets[iComp] +
+                (yBlock % numY) * numX + xBlock % numX;
+            float freq[JPEG_BLOCK_ROW][JPEG_BLOCK_ROW];
+            for (size_t v = 0; v < side; v++) {
+                for (size_t u = 0; u < side; u++) {
+                    size_t index = v * JPEG_BLOCK_ROW + u;
+                    freq[v][u] = coefficients != nullptr ?
+                        coefficients[iBlock][position[index]] :
+                        (float)blocks[iBlock][position[index]] * qTable[index];
+                }
+            }
+            /* Rows, then columns */
+            float rows[JPEG_BLOCK_ROW][JPEG_BLOCK_ROW];
+            for (size_t v = 0; v < side; v++) {
+                for (size_t x = 0; x < side; x++) {
+                    float sum = 0;
+                    for (size_t u = 0; u < side; u++) {
+                        sum += freq[v][u] * basis[x][u];
+                    }
+                    rows[v][x] = sum;
+                }
+            }
+            std::uint8_t *origin = plane + yBlock * side * planeWidth + xBlock * side;
+            for (size_t y = 0; y < side; y++) {
+                for (size_t x = 0; x < side; x++) {
+                    float sum = levelShift;
+                    for (size_t v = 0; v < side; v++) {
+                        sum += basis[y][v] * rows[v][x];
+                    }
+                    origin[y * planeWidth + x] = std::max(0.0f, std::min(255.0f, std::round(sum)));
+                }
+            }
+        }
+    }
+}
+
+std::pair<int, int> Jpeg::thumbnailDimensions(const JpegSettings& settings)
+{
+    int width = settings.size.first;
+    int height = settings.size.second;
+    int longest = std::min({settings.thumbnailSize, 255, std::max(width, height)});
+    for (; longest > 0; longest--) {
+        std::pair<int, int> dims(
+            std::max(1, (int)std::lround((double)width * longest / std::max(width, height))),
+            std::max(1, (int)std::lround((double)height * longest / std::max(width, height))));
+        if (3 * dims.first * dims.second <= THUMBNAIL_MAX_BYTES) {
+            return dims;
+        }
+    }
+    return std::pair<int, int>(0, 0);
+}
+
+std::vector<std::uint8_t> Jpeg::makeThumbnail(const JpegSettings& settings,
+    const coef_t (*blocks)[JPEG_BLOCK_SIZE],
+    const float (*coefficients)[JPEG_BLOCK_SIZE])
+{
+    std::pair<int, int> dims = thumbnailDimensions(settings);
+    std::vector<std::uint8_t> rgb(3 * dims.first * dims.second);
+    if (rgb.empty()) {
+        return rgb;
+    }
+    /* The DC terms of Y, Cb and Cr, one sample per block */
+    size_t numComps = std::min(settings.components.size(), size_t{3});
+    std::vector<std::uint8_t> planes[3];
+    size_t strides[3], widths[3], heights[3];
+    float scaleX[3], scaleY[3];
+    for (size_t iComp = 0; iComp < numComps; iComp++) {
+        const JpegComponent& comp = settings.components[iComp];
+        strides[iComp] = settings.numMcus.first * comp.sampling.first;
+        planes[iComp].resize(strides[iComp] * settings.numMcus.second * comp.sampling.second);
+        reduceComponent(settings, blocks, coefficients, iComp, JPEG_BLOCK_ROW, planes[iComp].data());
+        /* Plane samples per image pixel */
+        scaleX[iComp] = (float)comp.sampling.first / settings.mcuScale.first / JPEG_BLOCK_ROW;
+        scaleY[iComp] = (float)comp.sampling.second / settings.mcuScale.second / JPEG_BLOCK_ROW;
+        widths[iComp] = std::ceil(settings.size.first * scaleX[iComp]);
+        heights[iComp] = std::ceil(settings.size.second * scaleY[iComp]);
+    }
+
+    float stepX = (float)settings.size.first / dims.first;
+    float stepY = (float)settings.size.second / dims.second;
+    std::vector<size_t> xIndex, yIndex;
+    std::vector<float> xWeight, yWeight;
+    for (size_t ty = 0; ty < dims.second; ty++) {
+        for (size_t tx = 0; tx < dims.first; tx++) {
+            /* Missing chroma is neutral */
+            float ycc[3] = {128, 128, 128};
+            for (size_t iComp = 0; iComp < numComps; iComp++) {
+                /* Average the samples under the thumbnail pixel's box */
+                float startX = tx * stepX * scaleX[iComp];
+                float startY = ty * stepY * scaleY[iComp];
+                float endX = std::min((float)widths[iComp], startX + stepX * scaleX[iComp]);
+                float endY = std::min((float)heights[iComp], startY + stepY * scaleY[iComp]);
+                xIndex.resize((size_t)(endX - startX) + 2);
+                xWeight.resize(xIndex.size());
+                yIndex.resize((size_t)(endY - startY) + 2);
+                yWeight.resize(yIndex.size());
+                size_t colsCovered = boxWeights(startX, endX, xIndex.data(), xWeight.data());
+                size_t rowsCovered = boxWeights(startY, endY, yIndex.data(), yWeight.data());
+                float sum = 0;
+                for (size_t iy = 0; iy < rowsCovered; iy++) {
+                    const std::uint8_t *row = planes[iComp].data() + yIndex[iy] * strides[iComp];
+                    float rowSum = 0;
+                    for (size_t ix = 0; ix < colsCovered; ix++) {
+                        rowSum += row[xIndex[ix]] * xWeight[ix];
+                    }
+                    sum += rowSum * yWeight[iy];
+                }
+                ycc[iComp] = sum / ((endX - startX) * (endY - startY));
+            }
+            float rgbf[3] = {
+                ycc[0] + 1.402f * (ycc[2] - 128),
+                ycc[0] - 0.344136f * (ycc[1] - 128) - 0.714136f * (ycc[2] - 128),
+                ycc[0] + 1.772f * (ycc[1] - 128)
+            };
+            std::uint8_t *pixel = rgb.data() + 3 * (ty * dims.first + tx);
+            for (size_t c = 0; c < 3; c++) {
+                pixel[c] = std::max(0.0f, std::min(255.0f, std::round(rgbf[c])));
+            }
+        }
+    }
+    return rgb;
+}
+
+void Jpeg::Jpeg::writeReduced(std::ostream& dst, int scale)
+{
+    if (scale == 1) {
+        write(dst);
+        return;
+    }
+    if (scale != 2 && scale != 4 && scale != 8) {
+        throw JpegEncodingException("Images can only be reduced by 1, 2, 4 or 8");
+    }
+    std::pair<int, int> size(
+        (settings.size.first + scale - 1) / scale,
+        (settings.size.second + scale - 1) / scale);
+    /* The same physical size has fewer pixels per unit */
+    std::pair<int, int> density = settings.density;
+    if (settings.densityUnits != RELATIVE) {
+        density.first = std::max(1, density.first / scale);
+        density.second = std::max(1, density.second / scale);
+    }
+    int flags = settings.compressionFlags & ~flagKeepCoefficients;
+    JpegSettings reducedSettings = reshapedSettings(settings, size, settings.components);
+    reducedSettings.density = density;
+    reducedSettings.compressionFlags = flags;
+
+    size_t numComps = settings.components.size();
+    size_t side = JPEG_BLOCK_ROW / scale;
+    std::vector<std::vector<std::uint8_t>> samples(numComps);
+    std::vector<JpegPlane> planes(numComps);
+    for (size_t iComp = 0; iComp < numComps; iComp++) {
+        const JpegComponent& comp = settings.components[iComp];
+        size_t stride = settings.numMcus.first * comp.sampling.first * side;
+        size_t rows = settings.numMcus.second * comp.sampling.second * side;
+        samples[iComp].resize(stride * rows);
+        reduceComponent(settings, blocks, coefficients, iComp, scale, samples[iComp].data());
+        size_t width = std::ceil((float)size.first * comp.sampling.first / settings.mcuScale.first);
+        size_t height = std::ceil((float)size.second * comp.sampling.second / settings.mcuScale.second);
+        planes[iComp] = JpegPlane{samples[iComp].data(),
+            std::min(width, stride), std::min(height, rows), stride, 1};
+    }
+
+    Jpeg reduced(reducedSettings);
+    reduced.histogramsReady = (flags & flagHuffmanMask) == flagHuffmanOptimal;
+    if (reduced.histogramsReady) {
+        resetHistograms(reduced.settings, reduced.histograms);
+    }
+    encodePlanes(reduced.settings, planes.data(), reduced.blocks,
+        reduced.histogramsReady ? &reduced.histograms : nullptr);
+    reduced.write(dst);
+}
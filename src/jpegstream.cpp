@@ -0,0 +1,215 @@
+/*
+jpegstream.cpp
+*/
+
+#include <algorithm>
+#include <cstring>
+#include "jpegutil.hpp"
+#include "jpeginternal.hpp"
+
+Jpeg::JpegStream::JpegStream(JpegSettings jpegSettings, size_t ringRows) :
+    settings {jpegSettings},
+    ringRows {std::max(size_t{1}, ringRows)},
+    staging {nullptr},
+    blocks {nullptr},
+    workspace {new JpegWorkspace()},
+    out {nullptr},
+    dst {nullptr},
+    rowsStaged {0},
+    rowsPushed {0},
+    mcuRowsDone {0},
+    format {PIXEL_RGB}
+{
+    size_t stripeRows = this->ringRows * settings.mcuScale.second * JPEG_BLOCK_ROW;
+    /* Room for the widest pixels */
+    staging = new std::uint8_t[stripeRows * settings.size.first * 4];
+    blocks = allocBlocks(this->ringRows * settings.numMcus.first * settings.mcuSize);
+}
+
+Jpeg::JpegStream::~JpegStream()
+{
+    delete[] staging;
+    freeBlocks(blocks);
+    delete workspace;
+}
+
+Jpeg::JpegChunkSink::JpegChunkSink(JpegChunkHook hook, void *context, size_t chunkSize)
+{
+    reset(hook, context, chunkSize);
+}
+
+void Jpeg::JpegChunkSink::reset(JpegChunkHook hook, void *context, size_t chunkSize)
+{
+    this->hook = hook;
+    this->context = context;
+    chunk.resize(std::max(size_t{1}, chunkSize));
+    failed = false;
+    setp(chunk.data(), chunk.data() + chunk.size());
+}
+
+/*
+Pass on what the chunk holds and empty it
+*/
+bool Jpeg::JpegChunkSink::emit()
+{
+    size_t size = pptr() - pbase();
+    if (failed || hook == nullptr) {
+        failed = true;
+        return false;
+    }
+    if (size > 0 && !hook(reinterpret_cast<const std::uint8_t*>(pbase()), size, context)) {
+        failed = true;
+        return false;
+    }
+    setp(chunk.data(), chunk.data() + chunk.size());
+    return true;
+}
+
+Jpeg::JpegChunkSink::int_type Jpeg::JpegChunkSink::overflow(int_type ch)
+{
+    if (!emit()) {
+        return traits_type::eof();
+    }
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+int Jpeg::JpegChunkSink::sync()
+{
+    return emit() ? 0 : -1;
+}
+
+/*
+Everything of beginFrame but where the output goes
+Returns false if out refused the headers
+*/
+bool Jpeg::JpegStream::startFrame(std::streambuf& out)
+{
+    if ((settings.compressionFlags & flagHuffmanMask) == flagHuffmanOptimal) {
+        throw JpegEncodingException("Optimal Huffman codes cannot be streamed");
+    }
+    /* The settings are the stream's own and never change, so the tables last */
+    if (tables.first.empty()) {
+        selectHuffmanCodes(settings, blocks);
+        compileHuffmanCodes(settings, tables);
+    }
+
+    this->out = &out;
+    rowsStaged = 0;
+    rowsPushed = 0;
+    mcuRowsDone = 0;
+    std::fill(predictors, predictors + JPEG_MAX_COMPONENTS, 0);
+    bout.reset(&out);
+    return writeHeaders(settings, tables, out);
+}
+
+void Jpeg::JpegStream::beginFrame(std::ostream& dst)
+{
+    bool ok = startFrame(*dst.rdbuf());
+    this->dst = &dst;
+    if (!ok) {
+        dst.setstate(std::ios_base::badbit);
+    }
+}
+
+void Jpeg::JpegStream::beginFrame(JpegChunkHook hook, void *context, size_t chunkSize)
+{
+    chunks.reset(hook, context, chunkSize);
+    bool ok = startFrame(chunks) && chunks.pubsync() == 0;
+    dst = nullptr;
+    if (!ok) {
+        out = nullptr;
+        throw JpegEncodingException("Output chunk was refused");
+    }
+}
+
+void Jpeg::JpegStream::pushRows(const std::uint8_t *rgb, size_t nRows)
+{
+    pushRows(JpegPixels(rgb), nRows);
+}
+
+void Jpeg::JpegStream::pushRows(const JpegPixels& pixels, size_t nRows)
+{
+    if (out == nullptr) {
+        throw JpegEncodingException("No frame has been started");
+    }
+    if (rowsPushed + nRows > settings.size.second) {
+        throw JpegEncodingException("More rows pushed than the image height");
+    }
+    if (pixels.bottomUp) {
+        throw JpegEncodingException("Rows must be pushed top down");
+    }
+    if (rowsPushed == 0) {
+        format = pixels.format;
+    }
+    else if (pixels.format != format) {
+        throw JpegEncodingException("Pixel format changed within a frame");
+    }
+    rowsPushed += nRows;
+    size_t rowBytes = settings.size.first * pixelBytes(format);
+    size_t stride = pixels.stride != 0 ? pixels.stride : rowBytes;
+    size_t stripeRows = ringRows * settings.mcuScale.second * JPEG_BLOCK_ROW;
+    const std::uint8_t *row = pixels.data;
+    while (nRows > 0) {
+        /* Whole stripes are transformed straight from the caller's memory */
+        if (rowsStaged == 0 && nRows >= stripeRows) {
+            encodeMcuRows(JpegPixels(row, format, stride), stripeRows, ringRows);
+            row += stripeRows * stride;
+            nRows -= stripeRows;
+            continue;
+        }
+        size_t take = std::min(nRows, stripeRows - rowsStaged);
+        for (size_t i = 0; i < take; i++, row += stride) {
+            std::memcpy(staging + (rowsStaged + i) * rowBytes, row, rowBytes);
+        }
+        rowsStaged += take;
+        nRows -= take;
+        if (rowsStaged == stripeRows) {
+            encodeMcuRows(JpegPixels(staging, format), stripeRows, ringRows);
+            rowsStaged = 0;
+        }
+    }
+}
+
+void Jpeg::JpegStream::finish()
+{
+    if (out == nullptr) {
+        throw JpegEncodingException("No frame has been started");
+    }
+    if (rowsPushed != settings.size.second) {
+        throw JpegEncodingException("Image is missing rows");
+    }
+    if (rowsStaged > 0) {
+        encodeMcuRows(JpegPixels(staging, format), rowsStaged, settings.numMcus.second - mcuRowsDone);
+        rowsStaged = 0;
+    }
+    bout.flush();
+    bool ok = bout.good() && writeTrailer(*out);
+    out = nullptr;
+    if (dst == nullptr) {
+        if (!ok || chunks.pubsync() != 0) {
+            throw JpegEncodingException("Output chunk was refused");
+        }
+    }
+    else if (!ok) {
+        dst->setstate(std::ios_base::badbit);
+    }
+}
+
+void Jpeg::JpegStream::encodeMcuRows(const JpegPixels& pixels, size_t rows, size_t numMcuRows)
+{
+    encodeStripeRGB(settings, pixels, rows, numMcuRows, blocks, nullptr, nullptr, workspace);
+    size_t mcusPerRow = settings.numMcus.first;
+    for (size_t iRow = 0; iRow < numMcuRows; iRow++) {
+        coef_t (*rowBlocks)[JPEG_BLOCK_SIZE] = blocks + iRow * mcusPerRow * settings.mcuSize;
+        size_t firstMcu = (mcuRowsDone + iRow) * mcusPerRow;
+        if ((settings.compressionFlags & flagHuffmanMask) == flagHuffmanProvided) {
+            checkCodedSymbols(settings, tables, rowBlocks, firstMcu, mcusPerRow, predictors);
+        }
+        writeMcus(settings, tables, rowBlocks, firstMcu, mcusPerRow, predictors, bout);
+    }
+    mcuRowsDone += numMcuRows;
+}
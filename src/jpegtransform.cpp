@@ -0,0 +1,189 @@
+/*
+jpegtransform.cpp
+Lossless rotations, flips and crops done on the quantized blocks
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "jpegutil.hpp"
+#include "jpeginternal.hpp"
+
+/*
+A transform as a transpose followed by mirroring the transposed image
+*/
+struct TransformSteps {
+    bool transpose;
+    bool flipX;
+    bool flipY;
+};
+
+TransformSteps transformSteps(Jpeg::JpegTransform op)
+{
+    switch (op) {
+        case Jpeg::TRANSFORM_FLIP_HORIZONTAL:
+            return TransformSteps{false, true, false};
+        case Jpeg::TRANSFORM_FLIP_VERTICAL:
+            return TransformSteps{false, false, true};
+        case Jpeg::TRANSFORM_TRANSPOSE:
+            return TransformSteps{true, false, false};
+        case Jpeg::TRANSFORM_TRANSVERSE:
+            return TransformSteps{true, true, true};
+        case Jpeg::TRANSFORM_ROTATE_90:
+            return TransformSteps{true, true, false};
+        case Jpeg::TRANSFORM_ROTATE_180:
+            return TransformSteps{false, true, true};
+        case Jpeg::TRANSFORM_ROTATE_270:
+            return TransformSteps{true, false, true};
+        default:
+            return TransformSteps{false, false, false};
+    }
+}
+
+/*
+Move jpeg's blocks, and its kept coefficients if any, into the layout of
+settings to
+
+source: called with (iComp, x, y) for each block of the new layout, gives
+the (x, y) of the old block of the component it comes from
+position, sign: coefficient i of a block is sign[i] times coefficient
+position[i] of its source block, both in zigzag order
+*/
+template <typename Source>
+void rearrangeBlocks(Jpeg::Jpeg& jpeg, const Jpeg::JpegSettings& to,
+    const size_t *position, const int *sign, const Source& source)
+{
+    const Jpeg::JpegSettings& from = jpeg.settings;
+    /* Never more blocks than before, so the capacity stays */
+    Jpeg::coef_t (*blocks)[JPEG_BLOCK_SIZE] = Jpeg::allocBlocks(jpeg.blockCapacity);
+    float (*coefficients)[JPEG_BLOCK_SIZE] = nullptr;
+    if (jpeg.coefficients != nullptr) {
+        coefficients = new float[jpeg.blockCapacity][JPEG_BLOCK_SIZE];
+    }
+    for (size_t iComp = 0; iComp < to.components.size(); iComp++) {
+        size_t width = to.numMcus.first * to.components[iComp].sampling.first;
+        size_t height = to.numMcus.second * to.components[iComp].sampling.second;
+        #pragma omp parallel for
+        for (size_t y = 0; y < height; y++) {
+            for (size_t x = 0; x < width; x++) {
+                std::pair<size_t, size_t> src = source(iComp, x, y);
+                size_t iSrc = Jpeg::gridBlock(from, iComp, src.first, src.second);
+                size_t iDst = Jpeg::gridBlock(to, iComp, x, y);
+                for (size_t i = 0; i < JPEG_BLOCK_SIZE; i++) {
+                    blocks[iDst][i] = sign[i] * jpeg.blocks[iSrc][position[i]];
+                }
+                if (coefficients != nullptr) {
+                    for (size_t i = 0; i < JPEG_BLOCK_SIZE; i++) {
+                        coefficients[iDst][i] = sign[i] * jpeg.coefficients[iSrc][position[i]];
+                    }
+                }
+            }
+        }
+    }
+    Jpeg::freeBlocks(jpeg.blocks);
+    delete[] jpeg.coefficients;
+    jpeg.blocks = blocks;
+    jpeg.coefficients = coefficients;
+    jpeg.settings = to;
+    /* Counted in the old order */
+    jpeg.histogramsReady = false;
+    /*
+    Provided codes need not have the symbols of the new DC differences and
+    runs; the default ones have every symbol
+    */
+    int& flags = jpeg.settings.compressionFlags;
+    if ((flags & Jpeg::flagHuffmanMask) == Jpeg::flagHuffmanProvided) {
+        flags = (flags & ~Jpeg::flagHuffmanMask) | Jpeg::flagHuffmanOptimal;
+    }
+}
+
+void Jpeg::Jpeg::transform(JpegTransform op)
+{
+    TransformSteps steps = transformSteps(op);
+    if (!steps.transpose && !steps.flipX && !steps.flipY) {
+        return;
+    }
+    std::pair<int, int> size = settings.size;
+    std::vector<JpegComponent> components = settings.components;
+    if (steps.transpose) {
+        std::swap(size.first, size.second);
+        for (auto it = components.begin(); it != components.end(); it++) {
+            std::swap(it->sampling.first, it->sampling.second);
+        }
+    }
+    int mcuWidth = JPEG_BLOCK_ROW * (steps.transpose ? settings.mcuScale.second : settings.mcuScale.first);
+    int mcuHeight = JPEG_BLOCK_ROW * (steps.transpose ? settings.mcuScale.first : settings.mcuScale.second);
+    if (steps.flipX) {
+        size.first -= size.first % mcuWidth;
+    }
+    if (steps.flipY) {
+        size.second -= size.second % mcuHeight;
+    }
+    if (size.first == 0 || size.second == 0) {
+        throw JpegEncodingException("The image is smaller than the MCUs a flip keeps");
+    }
+    JpegSettings to = reshapedSettings(settings, size, components);
+    if (steps.transpose) {
+        /* Quantization is not symmetric, so its tables turn with the blocks */
+        for (int iTable = 0; iTable < to.numQTables; iTable++) {
+            for (size_t v = 0; v < JPEG_BLOCK_ROW; v++) {
+                for (size_t u = 0; u < JPEG_BLOCK_ROW; u++) {
+                    to.qtables[iTable][v * JPEG_BLOCK_ROW + u] = settings.qtables[iTable][u * JPEG_BLOCK_ROW + v];
+                    to.baseQTables[iTable][v * JPEG_BLOCK_ROW + u] = settings.baseQTables[iTable][u * JPEG_BLOCK_ROW + v];
+                }
+            }
+        }
+    }
+    
+    /* Horizontal frequencies u and vertical v, after the transpose */
+    size_t position[JPEG_BLOCK_SIZE];
+    int sign[JPEG_BLOCK_SIZE];
+    size_t zigzagOf[JPEG_BLOCK_SIZE];
+    for (size_t i = 0; i < JPEG_BLOCK_SIZE; i++) {
+        zigzagOf[zigzag[i]] = i;
+    }
+    for (size_t i = 0; i < JPEG_BLOCK_SIZE; i++) {
+        size_t u = zigzag[i] % JPEG_BLOCK_ROW;
+        size_t v = zigzag[i] / JPEG_BLOCK_ROW;
+        position[i] = steps.transpose ? zigzagOf[u * JPEG_BLOCK_ROW + v] : i;
+        /* Mirroring negates the odd frequencies across it */
+        sign[i] = ((steps.flipX && u % 2 == 1) != (steps.flipY && v % 2 == 1)) ? -1 : 1;
+    }
+    
+    rearrangeBlocks(*this, to, position, sign, [&](size_t iComp, size_t x, size_t y) {
+        /* The mirrored dimensions are whole MCUs, so the grid ends at the image edge */
+        size_t width = to.numMcus.first * to.components[iComp].sampling.first;
+        size_t height = to.numMcus.second * to.components[iComp].sampling.second;
+        size_t tx = steps.flipX ? width - 1 - x : x;
+        size_t ty = steps.flipY ? height - 1 - y : y;
+        return steps.transpose ? std::pair<size_t, size_t>(ty, tx) : std::pair<size_t, size_t>(tx, ty);
+    });
+}
+
+void Jpeg::Jpeg::crop(std::pair<int, int> offset, std::pair<int, int> size)
+{
+    int mcuWidth = JPEG_BLOCK_ROW * settings.mcuScale.first;
+    int mcuHeight = JPEG_BLOCK_ROW * settings.mcuScale.second;
+    if (offset.first < 0 || offset.second < 0 || offset.first % mcuWidth != 0 || offset.second % mcuHeight != 0) {
+        throw JpegEncodingException("Crops must start on an MCU boundary");
+    }
+    if (size.first <= 0 || size.second <= 0 ||
+        offset.first + size.first > settings.size.first || offset.second + size.second > settings.size.second) {
+        throw JpegEncodingException("Crops must be inside the image");
+    }
+    JpegSettings to = reshapedSettings(settings, size, settings.components);
+    
+    size_t position[JPEG_BLOCK_SIZE];
+    int sign[JPEG_BLOCK_SIZE];
+    for (size_t i = 0; i < JPEG_BLOCK_SIZE; i++) {
+        position[i] = i;
+        sign[i] = 1;
+    }
+    size_t mcuX = offset.first / mcuWidth;
+    size_t mcuY = offset.second / mcuHeight;
+    rearrangeBlocks(*this, to, position, sign, [&](size_t iComp, size_t x, size_t y) {
+        const JpegComponent& comp = settings.components[iComp];
+        return std::pair<size_t, size_t>(x + mcuX * comp.sampling.first, y + mcuY * comp.sampling.second);
+    });
+}
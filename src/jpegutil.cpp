@@ -7,7 +7,17 @@ jpegutil.cpp
 #include <memory>
 #include <numeric>
 #include <cmath>
+#include <new>
 #include "jpegutil.hpp"
+#include "jpeginternal.hpp"
+
+const std::vector<Jpeg::JpegComponent> Jpeg::grayscaleComponents = {
+    JpegComponent(std::pair<int, int>(1, 1), 0, 0, 0)
+};
+
+const char *const Jpeg::stageNames[JPEG_STAGES] = {
+    "encode", "symbols", "huffman", "headers", "entropy"
+};
 
 Jpeg::JpegSettings::JpegSettings(
         std::pair<int, int> size,
@@ -30,6 +40,7 @@ Jpeg::JpegSettings::JpegSettings(
     compressionFlags {compressionFlags},
     numQTables {numQTables},
     resetInterval {resetInterval},
+    thumbnailSize {0},
     mcuSize {0},
     version {version} {
         if (components != nullptr) {
@@ -47,7 +58,7 @@ Jpeg::JpegSettings::JpegSettings(
             this->huffmanCodes = *huffmanCodes;
         }
         for (int i = 0; i < numQTables; i++) {
-            std::copy(qtables[i], qtables[i] + JPEG_BLOCK_SIZE, this->qtables[i]);
+            std::copy(qtables[i], qtables[i] + JPEG_BLOCK_SIZE, baseQTables[i]);
         }
         init();
 }
@@ -82,48 +93,195 @@ Jpeg::JpegSettings::JpegSettings(
         // init();
 // }
 
+Jpeg::JpegSettings Jpeg::reshapedSettings(const JpegSettings& settings,
+    std::pair<int, int> size, const std::vector<JpegComponent>& components)
+{
+    const dqt_t *baseQTables[JPEG_MAX_COMPONENTS];
+    for (int i = 0; i < settings.numQTables; i++) {
+        baseQTables[i] = settings.baseQTables[i];
+    }
+    bool provided = (settings.compressionFlags & flagHuffmanMask) == flagHuffmanProvided;
+    JpegSettings reshaped(size, &components, settings.densityUnits,
+        settings.density, settings.quality, settings.compressionFlags,
+        settings.numQTables, baseQTables, settings.version,
+        provided ? &settings.huffmanCodes : nullptr,
+        settings.bitDepth, settings.resetInterval);
+    std::copy(&settings.qtables[0][0], &settings.qtables[0][0] + JPEG_MAX_COMPONENTS * JPEG_BLOCK_SIZE,
+        &reshaped.qtables[0][0]);
+    reshaped.thumbnailSize = settings.thumbnailSize;
+    reshaped.extraSegments = settings.extraSegments;
+    return reshaped;
+}
+
 void Jpeg::JpegSettings::init()
 {
     int maxX = 0, maxY = 0;
-    quality = std::max(1, std::min(100, quality));
-    float factor = (quality <= 50) ?
-        (5000.0/quality) :
-        (200.0 - 2.0 * quality);
-    // std::cout << "Factor=" << factor << std::endl;
+    if (resetInterval < 0 || resetInterval > 0xFFFF) {
+        throw JpegEncodingException("Reset interval must be from 0 to 65535");
+    }
+    if (components.size() > JPEG_MAX_COMPONENTS) {
+        throw JpegEncodingException("Too many components");
+    }
+    if (components.size() == 1) {
+        /* Non-interleaved, so each MCU is one block */
+        components[0].sampling = std::pair<int, int>(1, 1);
+    }
     for (int i = 0; i < components.size(); i ++) {
+        std::pair<int, int> sampling = components[i].sampling;
+        if (sampling.first < 1 || sampling.first > JPEG_MAX_SAMPLING ||
+            sampling.second < 1 || sampling.second > JPEG_MAX_SAMPLING) {
+            throw JpegEncodingException("Sampling factors must be from 1 to 4");
+        }
         componentOffsets[i] = mcuSize;
         mcuSize += components[i].sampling.first * components[i].sampling.second;
         maxX = std::max(maxX, components[i].sampling.first);
         maxY = std::max(maxY, components[i].sampling.second);
     }
+    scaleQTables();
+    mcuScale = std::pair<int, int>(maxX, maxY);
+    numMcus = std::pair<int, int>(std::ceil((float)size.first / maxX / JPEG_BLOCK_ROW), std::ceil((float)size.second / maxY / JPEG_BLOCK_ROW));
+}
+
+void Jpeg::JpegSettings::scaleQTables()
+{
+    quality = std::max(1, std::min(100, quality));
+    float factor = (quality <= 50) ?
+        (5000.0/quality) :
+        (200.0 - 2.0 * quality);
+    // std::cout << "Factor=" << factor << std::endl;
     for (int i = 0; i < numQTables; i++) {
         for (int j = 0; j < JPEG_BLOCK_SIZE; j++) {
-            this->qtables[i][j] = std::max(1, std::min(255, (int)std::floor((qtables[i][j] * factor + 50) / 100)));
-            // std::cout << "Qtable " << i << ',' << j << ": " << this->qtables[i][j] << std::endl;
+            qtables[i][j] = std::max(1, std::min(255, (int)std::floor((baseQTables[i][j] * factor + 50) / 100)));
+            // std::cout << "Qtable " << i << ',' << j << ": " << qtables[i][j] << std::endl;
         }
     }
-    mcuScale = std::pair<int, int>(maxX, maxY);
-    numMcus = std::pair<int, int>(std::ceil((float)size.first / maxX / JPEG_BLOCK_ROW), std::ceil((float)size.second / maxY / JPEG_BLOCK_ROW));
+}
+
+void Jpeg::JpegSettings::setQuality(int quality)
+{
+    this->quality = quality;
+    scaleQTables();
+}
+
+void Jpeg::JpegSettings::setQTables(int numQTables, const dqt_t *qtables[JPEG_MAX_COMPONENTS], int quality)
+{
+    if (numQTables < 1 || numQTables > JPEG_MAX_COMPONENTS) {
+        throw JpegEncodingException("Number of quantization tables must be from 1 to 5");
+    }
+    this->numQTables = numQTables;
+    for (int i = 0; i < numQTables; i++) {
+        std::copy(qtables[i], qtables[i] + JPEG_BLOCK_SIZE, baseQTables[i]);
+    }
+    setQuality(quality);
+}
+
+Jpeg::coef_t (*Jpeg::allocBlocks(size_t count))[JPEG_BLOCK_SIZE]
+{
+    return new (std::align_val_t(JPEG_BLOCK_ALIGN)) coef_t[count][JPEG_BLOCK_SIZE];
+}
+
+void Jpeg::freeBlocks(coef_t (*blocks)[JPEG_BLOCK_SIZE])
+{
+    if (blocks != nullptr) {
+        ::operator delete[](blocks, std::align_val_t(JPEG_BLOCK_ALIGN));
+    }
 }
 
 Jpeg::Jpeg::Jpeg(const Jpeg& other) :
     settings {other.settings},
-    blocks {new dct_t[other.settings.numMcus.first * other.settings.numMcus.second * other.settings.mcuSize][JPEG_BLOCK_SIZE]}
+    blocks {nullptr},
+    blockCapacity {0},
+    histograms {other.histograms},
+    histogramsReady {other.histogramsReady},
+    coefficients {nullptr},
+    tables {other.tables},
+    defaultTablesReady {other.defaultTablesReady},
+    workspace {nullptr},
+    stats {other.stats}
 {
-    std::copy(&other.blocks[0][0], &other.blocks[0][0] + JPEG_BLOCK_SIZE * settings.numMcus.first * settings.numMcus.second * settings.mcuSize, &blocks[0][0]);
+    /* A moved-from Jpeg holds no blocks, or what it was swapped with */
+    if (other.blocks == nullptr) {
+        return;
+    }
+    blockCapacity = std::min((size_t)other.settings.numMcus.first * other.settings.numMcus.second * other.settings.mcuSize,
+        other.blockCapacity);
+    blocks = allocBlocks(blockCapacity);
+    std::copy(&other.blocks[0][0], &other.blocks[0][0] + JPEG_BLOCK_SIZE * blockCapacity, &blocks[0][0]);
+    if (other.coefficients != nullptr) {
+        coefficients = new float[blockCapacity][JPEG_BLOCK_SIZE];
+        std::copy(&other.coefficients[0][0], &other.coefficients[0][0] + JPEG_BLOCK_SIZE * blockCapacity, &coefficients[0][0]);
+    }
+}
+
+Jpeg::Jpeg::Jpeg(Jpeg&& other) noexcept :
+    settings {std::move(other.settings)},
+    blocks {other.blocks},
+    blockCapacity {other.blockCapacity},
+    histograms {std::move(other.histograms)},
+    histogramsReady {other.histogramsReady},
+    coefficients {other.coefficients},
+    tables {std::move(other.tables)},
+    defaultTablesReady {other.defaultTablesReady},
+    workspace {other.workspace},
+    stats {other.stats}
+{
+    other.blocks = nullptr;
+    other.blockCapacity = 0;
+    other.coefficients = nullptr;
+    other.histogramsReady = false;
+    other.defaultTablesReady = false;
+    other.workspace = nullptr;
 }
 
 Jpeg::Jpeg& Jpeg::Jpeg::operator=(const Jpeg& other)
 {
-    delete[] blocks;
-    settings = other.settings;
-    size_t size = settings.numMcus.first * settings.numMcus.second * settings.mcuSize;
-    blocks = new dct_t[size][JPEG_BLOCK_SIZE];
-    std::copy(&other.blocks[0][0], &other.blocks[0][0] + JPEG_BLOCK_SIZE * size, &blocks[0][0]);
+    if (this == &other) {
+        return *this;
+    }
+    /* Copy and take over its buffers */
+    return *this = Jpeg(other);
+}
+
+Jpeg::Jpeg& Jpeg::Jpeg::operator=(Jpeg&& other) noexcept
+{
+    if (this == &other) {
+        return *this;
+    }
+    std::swap(blocks, other.blocks);
+    std::swap(blockCapacity, other.blockCapacity);
+    std::swap(coefficients, other.coefficients);
+    std::swap(workspace, other.workspace);
+    settings = std::move(other.settings);
+    histograms = std::move(other.histograms);
+    histogramsReady = other.histogramsReady;
+    tables = std::move(other.tables);
+    defaultTablesReady = other.defaultTablesReady;
+    stats = other.stats;
+    /* other frees what this held */
+    other.histogramsReady = false;
+    other.defaultTablesReady = false;
     return *this;
 }
 
 Jpeg::Jpeg::~Jpeg()
 {
-    delete[] blocks;
+    freeBlocks(blocks);
+    delete[] coefficients;
+    delete workspace;
+}
+
+void Jpeg::Jpeg::reset(const JpegSettings& jpegSettings)
+{
+    settings = jpegSettings;
+    size_t numBlocks = (size_t)settings.numMcus.first * settings.numMcus.second * settings.mcuSize;
+    if (numBlocks > blockCapacity) {
+        freeBlocks(blocks);
+        delete[] coefficients;
+        blocks = nullptr;
+        coefficients = nullptr;
+        blocks = allocBlocks(numBlocks);
+        blockCapacity = numBlocks;
+    }
+    histogramsReady = false;
+    defaultTablesReady = false;
 }
@@ -0,0 +1,104 @@
+/*
+batchtest.cpp
+Checks that a batch writes exactly what encoding each image alone does,
+with the images spread over more than one thread
+*/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "jpegutil.hpp"
+
+#define NUM_IMAGES 24
+
+std::mutex threadsLock;
+std::set<std::thread::id> threads;
+
+/*
+Output that notes the thread writing it, and holds that thread a moment on
+its first write so the other threads take the remaining images
+*/
+class ThreadRecorder : public std::stringbuf {
+    private:
+        bool started = false;
+    protected:
+        std::streamsize xsputn(const char *s, std::streamsize n) override
+        {
+            if (!started) {
+                started = true;
+                {
+                    std::lock_guard<std::mutex> lock(threadsLock);
+                    threads.insert(std::this_thread::get_id());
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+            return std::stringbuf::xsputn(s, n);
+        }
+};
+
+int main(int argc, char **argv) {
+    std::vector<Jpeg::JpegSettings> settings;
+    std::vector<std::vector<std::uint8_t>> images;
+    srand(1);
+    for (int i = 0; i < NUM_IMAGES; i++) {
+        /* Mostly small images, with a few large enough to be split into row tasks */
+        int width = i % 8 == 0 ? 800 + rand() % 100 : 32 + rand() % 200;
+        int height = i % 8 == 0 ? 600 : 16 + rand() % 200;
+        int flags = i % 3 == 0 ? Jpeg::flagHuffmanOptimal : Jpeg::flagHuffmanDefault;
+        settings.push_back(Jpeg::JpegSettings(std::pair<int, int>(width, height), nullptr, Jpeg::DPI, {1, 1}, 30 + i * 2, flags));
+        if (i % 4 == 1) {
+            settings.back().resetInterval = 5;
+        }
+        std::vector<std::uint8_t> rgb(width * height * 3);
+        for (size_t p = 0; p < rgb.size(); p++) {
+            rgb[p] = (p / 3 % width + p / 3 / width * i) % 256 ^ (rand() % 16);
+        }
+        images.push_back(rgb);
+    }
+
+#ifdef _OPENMP
+    /* Enough threads to share the batch even on a single core */
+    omp_set_num_threads(4);
+#endif
+    std::vector<ThreadRecorder> recorders(NUM_IMAGES);
+    std::deque<std::ostream> outputs;
+    std::vector<Jpeg::JpegJob> jobs;
+    for (int i = 0; i < NUM_IMAGES; i++) {
+        outputs.emplace_back(&recorders[i]);
+    }
+    for (int i = 0; i < NUM_IMAGES; i++) {
+        jobs.push_back(Jpeg::JpegJob{&settings[i], images[i].data(), &outputs[i]});
+    }
+    Jpeg::encodeBatch(jobs.data(), jobs.size());
+
+    int failures = 0;
+    for (int i = 0; i < NUM_IMAGES; i++) {
+        Jpeg::Jpeg jpeg(settings[i]);
+        jpeg.encodeRGB(images[i].data());
+        std::stringstream alone;
+        jpeg.write(alone);
+        if (alone.str() != recorders[i].str()) {
+            std::cout << "Image " << i << " (" << settings[i].size.first << "x" << settings[i].size.second <<
+                ") differs from encoding it alone" << std::endl;
+            failures++;
+        }
+    }
+    std::cout << NUM_IMAGES - failures << " of " << NUM_IMAGES << " images match" << std::endl;
+    std::cout << "Written on " << threads.size() << " threads" << std::endl;
+    if (threads.size() < 2) {
+        std::cout << "The batch ran on a single thread; is the library built with -fopenmp?" << std::endl;
+        failures++;
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,140 @@
+/*
+buffertest.cpp
+Checks that writes to memory and to mapped files give the bytes a stream
+gets, growing or failing as the buffer allows
+*/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#ifndef _WIN32
+#include <csignal>
+#include <sys/resource.h>
+#endif
+#include "jpegutil.hpp"
+#include "check.hpp"
+
+#define W 203
+#define H 117
+
+/*
+Grows a std::vector given as context to twice what is needed, counting calls
+*/
+int growCalls = 0;
+
+std::uint8_t *growVector(std::uint8_t *data, size_t used, size_t& capacity, void *context)
+{
+    std::vector<std::uint8_t>& buffer = *static_cast<std::vector<std::uint8_t>*>(context);
+    growCalls++;
+    buffer.resize(2 * capacity);
+    capacity = buffer.size();
+    return buffer.data();
+}
+
+std::uint8_t *refuse(std::uint8_t *data, size_t used, size_t& capacity, void *context)
+{
+    return nullptr;
+}
+
+bool throws(Jpeg::Jpeg& jpeg, std::uint8_t *dst, size_t capacity, Jpeg::JpegGrowHook grow)
+{
+    try {
+        jpeg.write(dst, capacity, grow);
+    } catch (const Jpeg::JpegEncodingException&) {
+        return true;
+    }
+    return false;
+}
+
+int main(int argc, char **argv) {
+    static std::uint8_t rgb[W * H * 3];
+    srand(1);
+    for (size_t i = 0; i < W * H * 3; i++) {
+        rgb[i] = (i / 3 % W + i / 3 / W) * (i % 3 + 1) / 2 + rand() % 48;
+    }
+
+    for (int flags : {Jpeg::flagHuffmanDefault, Jpeg::flagHuffmanOptimal | Jpeg::flagParallelEntropy}) {
+        Jpeg::JpegSettings settings(std::pair<int, int>(W, H), nullptr, Jpeg::DPI, {72, 72}, 90, flags);
+        settings.resetInterval = flags == Jpeg::flagHuffmanDefault ? 0 : 4;
+        settings.thumbnailSize = 16;
+        settings.extraSegments.push_back(std::string("\xFF\xFE\x00\x07note", 9));
+        Jpeg::Jpeg jpeg(settings);
+        jpeg.encodeRGB(rgb);
+        std::stringstream out;
+        jpeg.write(out);
+        std::string expected = out.str();
+        std::string name = flags == Jpeg::flagHuffmanDefault ? "default codes" : "optimal codes, parallel";
+
+        size_t bound = Jpeg::maxEncodedSize(jpeg.settings);
+        std::vector<std::uint8_t> buffer(bound);
+        size_t size = jpeg.write(buffer.data(), buffer.size());
+        check(size == expected.size() && std::string(buffer.begin(), buffer.begin() + size) == expected,
+            name + ", within the bound");
+
+        std::vector<std::uint8_t> grown(64);
+        growCalls = 0;
+        size = jpeg.write(grown.data(), grown.size(), growVector, &grown);
+        check(growCalls > 0 && size == expected.size() &&
+            std::string(grown.begin(), grown.begin() + size) == expected, name + ", grown");
+
+        check(throws(jpeg, buffer.data(), expected.size() - 1, nullptr) &&
+            throws(jpeg, buffer.data(), 100, refuse), name + ", too small throws");
+        check(jpeg.write(buffer.data(), expected.size()) == expected.size(), name + ", exact fit");
+
+        const char *path = "buffertest.jpg";
+        size = jpeg.writeFile(path);
+        std::ifstream file(path, std::ios::binary);
+        std::stringstream written;
+        written << file.rdbuf();
+        std::remove(path);
+        check(size == expected.size() && written.str() == expected, name + ", mapped file");
+    }
+
+    /* Noise near the worst case still fits */
+    for (size_t i = 0; i < W * H * 3; i++) {
+        rgb[i] = rand() % 256;
+    }
+    Jpeg::JpegSettings settings(std::pair<int, int>(W, H), nullptr, Jpeg::DPI, {72, 72}, 100,
+        Jpeg::flagHuffmanDefault);
+    Jpeg::Jpeg jpeg(settings);
+    jpeg.encodeRGB(rgb);
+    std::vector<std::uint8_t> buffer(Jpeg::maxEncodedSize(jpeg.settings));
+    check(!throws(jpeg, buffer.data(), buffer.size(), nullptr), "noise at quality 100 within the bound");
+
+    /* A failed encode leaves no file behind */
+    settings.compressionFlags = Jpeg::flagHuffmanProvided;
+    Jpeg::Jpeg noCodes(settings);
+    noCodes.encodeRGB(rgb);
+    const char *path = "buffertest-failed.jpg";
+    bool threw = false;
+    try {
+        noCodes.writeFile(path);
+    } catch (const Jpeg::JpegEncodingException&) {
+        threw = true;
+    }
+    check(threw && !std::ifstream(path), "failed mapped file removed");
+
+#ifndef _WIN32
+    /* Nor does a file that cannot be sized for mapping */
+    struct rlimit limit;
+    getrlimit(RLIMIT_FSIZE, &limit);
+    struct rlimit small = limit;
+    small.rlim_cur = 1024;
+    signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &small);
+    threw = false;
+    try {
+        jpeg.writeFile(path);
+    } catch (const Jpeg::JpegEncodingException&) {
+        threw = true;
+    }
+    setrlimit(RLIMIT_FSIZE, &limit);
+    check(threw && !std::ifstream(path), "unmappable file removed");
+#endif
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,26 @@
+/*
+check.hpp
+Named pass/fail reporting shared by the tests
+*/
+
+#ifndef _CHECK_HPP
+#define _CHECK_HPP
+
+#include <iostream>
+#include <string>
+
+/* Checks failed so far, for the exit status */
+inline int failures = 0;
+
+/*
+Print name with ok or FAILED, counting failures
+*/
+inline void check(bool ok, const std::string& name)
+{
+    std::cout << name << ": " << (ok ? "ok" : "FAILED") << std::endl;
+    if (!ok) {
+        failures++;
+    }
+}
+
+#endif
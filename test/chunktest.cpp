@@ -0,0 +1,110 @@
+/*
+chunktest.cpp
+Checks that output passed on in chunks adds up to what a stream gets, with
+the headers out before any row is coded
+*/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include "jpegutil.hpp"
+#include "check.hpp"
+
+#define W 203
+#define H 117
+#define CHUNK 512
+
+/*
+Chunks received, refusing any past limit
+*/
+struct Received {
+    std::vector<std::string> chunks;
+    size_t limit = SIZE_MAX;
+};
+
+bool receive(const std::uint8_t *data, size_t size, void *context)
+{
+    Received& received = *static_cast<Received*>(context);
+    if (received.chunks.size() >= received.limit) {
+        return false;
+    }
+    received.chunks.push_back(std::string(data, data + size));
+    return true;
+}
+
+std::string joined(const Received& received)
+{
+    std::string data;
+    for (auto it = received.chunks.begin(); it != received.chunks.end(); it++) {
+        data += *it;
+    }
+    return data;
+}
+
+/*
+Every chunk whole but the last and the one ending the headers, which end
+at a chunk boundary
+*/
+bool chunked(const Received& received)
+{
+    std::string data = joined(received);
+    size_t headerSize = data.find("\xFF\xDA") + 14;
+    size_t offset = 0, partial = 0;
+    bool headersApart = false;
+    for (size_t i = 0; i + 1 < received.chunks.size(); i++) {
+        offset += received.chunks[i].size();
+        partial += received.chunks[i].size() != CHUNK;
+        headersApart = headersApart || offset == headerSize;
+    }
+    return headersApart && partial <= 1;
+}
+
+int main(int argc, char **argv) {
+    static std::uint8_t rgb[W * H * 3];
+    srand(1);
+    for (size_t i = 0; i < W * H * 3; i++) {
+        rgb[i] = (i / 3 % W + i / 3 / W) * (i % 3 + 1) / 2 + rand() % 48;
+    }
+
+    Jpeg::JpegSettings settings(std::pair<int, int>(W, H), nullptr, Jpeg::DPI, {72, 72}, 85,
+        Jpeg::flagHuffmanOptimal);
+    Jpeg::Jpeg jpeg(settings);
+    jpeg.encodeRGB(rgb);
+    std::stringstream out;
+    jpeg.write(out);
+    Received received;
+    jpeg.write(receive, &received, CHUNK);
+    check(joined(received) == out.str() && chunked(received), "write in chunks");
+
+    bool threw = false;
+    received = Received();
+    received.limit = 3;
+    try {
+        jpeg.write(receive, &received, CHUNK);
+    } catch (const Jpeg::JpegEncodingException&) {
+        threw = true;
+    }
+    check(threw && received.chunks.size() == 3, "refused chunk throws");
+
+    /* The stream passes on the headers before any row and each chunk as soon as it fills */
+    settings.compressionFlags = Jpeg::flagHuffmanDefault;
+    Jpeg::Jpeg whole(settings);
+    whole.encodeRGB(rgb);
+    std::stringstream expected;
+    whole.write(expected);
+    Jpeg::JpegStream stream(settings);
+    received = Received();
+    stream.beginFrame(receive, &received, CHUNK);
+    size_t headerSize = joined(received).size();
+    size_t half = H / 2;
+    stream.pushRows(rgb, half);
+    bool early = headerSize > 0 && joined(received).size() > headerSize;
+    stream.pushRows(rgb + half * W * 3, H - half);
+    stream.finish();
+    check(early, "stream output before the last row");
+    check(joined(received) == expected.str() && chunked(received), "stream in chunks");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,149 @@
+/*
+colortest.cpp
+Checks the fixed point color conversion kernels against the float formulas,
+and that every pixel format converts and encodes the same as RGB
+*/
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include "jpegutil.hpp"
+
+#define NUM_PIXELS 100003
+#define IMAGE_W 77
+#define IMAGE_H 45
+
+/*
+Lay out RGB pixels in another format, gray from the red channel
+*/
+void repack(const std::uint8_t *rgb, size_t count, Jpeg::JpegPixelFormat format, std::uint8_t *out)
+{
+    size_t step = Jpeg::pixelBytes(format);
+    for (size_t i = 0; i < count; i++, rgb += 3, out += step) {
+        switch (format) {
+            case Jpeg::PIXEL_GRAY:
+                out[0] = rgb[0];
+                break;
+            case Jpeg::PIXEL_BGR:
+            case Jpeg::PIXEL_BGRA:
+            case Jpeg::PIXEL_BGRX:
+                out[0] = rgb[2];
+                out[1] = rgb[1];
+                out[2] = rgb[0];
+                break;
+            default:
+                std::copy(rgb, rgb + 3, out);
+        }
+        if (step == 4) {
+            out[3] = i * 37;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    static std::uint8_t rgb[NUM_PIXELS * 3];
+    static std::uint8_t planes[3][NUM_PIXELS];
+    static std::uint8_t fixed[3][NUM_PIXELS];
+    srand(1);
+    for (size_t i = 0; i < NUM_PIXELS * 3; i++) {
+        rgb[i] = rand() % 256;
+    }
+    /* Corners of the RGB cube are where clamping matters */
+    for (size_t i = 0; i < 8; i++) {
+        rgb[i * 3] = (i & 1) ? 255 : 0;
+        rgb[i * 3 + 1] = (i & 2) ? 255 : 0;
+        rgb[i * 3 + 2] = (i & 4) ? 255 : 0;
+    }
+    Jpeg::convertRowRGB(rgb, NUM_PIXELS, fixed[0], fixed[1], fixed[2], Jpeg::SIMD_NONE);
+
+    int failures = 0;
+    for (int level = Jpeg::SIMD_NONE; level <= Jpeg::detectSimd(); level++) {
+        Jpeg::convertRowRGB(rgb, NUM_PIXELS, planes[0], planes[1], planes[2], (Jpeg::SimdLevel)level);
+        int maxError = 0, mismatches = 0;
+        for (size_t i = 0; i < NUM_PIXELS; i++) {
+            const std::uint8_t *p = rgb + i * 3;
+            int expected[3] = {
+                Jpeg::Y(p[0], p[1], p[2]),
+                Jpeg::Cb(p[0], p[1], p[2]),
+                Jpeg::Cr(p[0], p[1], p[2])
+            };
+            for (size_t c = 0; c < 3; c++) {
+                maxError = std::max(maxError, std::abs(planes[c][i] - expected[c]));
+                if (planes[c][i] != fixed[c][i]) {
+                    mismatches++;
+                }
+            }
+        }
+        /* Short rows go through the tail handling only */
+        for (size_t count = 1; count < 40; count++) {
+            std::uint8_t *dst[3] = {planes[0] + count, planes[1] + count, planes[2] + count};
+            Jpeg::convertRowRGB(rgb + count * 3, count, dst[0], dst[1], dst[2], (Jpeg::SimdLevel)level);
+            for (size_t c = 0; c < 3; c++) {
+                mismatches += !std::equal(dst[c], dst[c] + count, fixed[c] + count);
+            }
+        }
+        /* Vector kernels must match the scalar fixed point one exactly */
+        bool pass = maxError <= 1 && mismatches == 0;
+        std::cout << "SIMD level " << level <<
+            ": max error " << maxError <<
+            ", mismatches against scalar " << mismatches <<
+            (pass ? " ok" : " FAIL") << std::endl;
+        if (!pass) {
+            failures++;
+        }
+    }
+
+    /* Other formats must give exactly what their colors give as RGB */
+    static std::uint8_t packed[NUM_PIXELS * 4];
+    static std::uint8_t gray[NUM_PIXELS * 3];
+    for (size_t i = 0; i < NUM_PIXELS; i++) {
+        std::fill(gray + i * 3, gray + i * 3 + 3, rgb[i * 3]);
+    }
+    static std::uint8_t grayFixed[3][NUM_PIXELS];
+    Jpeg::convertRowRGB(gray, NUM_PIXELS, grayFixed[0], grayFixed[1], grayFixed[2], Jpeg::SIMD_NONE);
+    for (int format = 0; format < JPEG_PIXEL_FORMATS; format++) {
+        bool isGray = format == Jpeg::PIXEL_GRAY;
+        repack(rgb, NUM_PIXELS, (Jpeg::JpegPixelFormat)format, packed);
+        int mismatches = 0;
+        for (int level = Jpeg::SIMD_NONE; level <= Jpeg::detectSimd(); level++) {
+            /* Odd counts and offsets for the tails */
+            for (size_t count = NUM_PIXELS - 2; count <= NUM_PIXELS; count++) {
+                size_t skip = NUM_PIXELS - count;
+                Jpeg::convertRow((Jpeg::JpegPixelFormat)format, packed + skip * Jpeg::pixelBytes((Jpeg::JpegPixelFormat)format),
+                    count, planes[0], planes[1], planes[2], (Jpeg::SimdLevel)level);
+                for (size_t c = 0; c < 3; c++) {
+                    const std::uint8_t *expected = (isGray ? grayFixed[c] : fixed[c]) + skip;
+                    mismatches += !std::equal(planes[c], planes[c] + count, expected);
+                }
+            }
+        }
+        std::cout << "Pixel format " << format << ": mismatches against RGB " << mismatches <<
+            (mismatches == 0 ? " ok" : " FAIL") << std::endl;
+        if (mismatches != 0) {
+            failures++;
+        }
+    }
+
+    /* Padded, bottom-up BGRA must encode to the same file as packed RGB */
+    Jpeg::JpegSettings settings(std::pair<int, int>(IMAGE_W, IMAGE_H));
+    size_t stride = IMAGE_W * 4 + 12;
+    std::vector<std::uint8_t> bgra(stride * IMAGE_H);
+    for (size_t y = 0; y < IMAGE_H; y++) {
+        repack(rgb + y * IMAGE_W * 3, IMAGE_W, Jpeg::PIXEL_BGRA, bgra.data() + (IMAGE_H - 1 - y) * stride);
+    }
+    std::stringstream fromRgb, fromBgra;
+    Jpeg::Jpeg jpeg(settings);
+    jpeg.encodeRGB(rgb);
+    jpeg.write(fromRgb);
+    jpeg.encode(Jpeg::JpegPixels(bgra.data(), Jpeg::PIXEL_BGRA, stride, true));
+    jpeg.write(fromBgra);
+    bool same = fromRgb.str() == fromBgra.str();
+    std::cout << "Strided bottom-up BGRA " << (same ? "encodes as RGB" : "ENCODES DIFFERENTLY") << std::endl;
+    if (!same) {
+        failures++;
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,86 @@
+/*
+dcttest.cpp
+Checks the vectorized forward DCT kernels against the scalar path
+*/
+
+#include <iostream>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include "jpegutil.hpp"
+
+#define NUM_BLOCKS 4096
+
+/*
+The scalar path truncates after each of its two passes: under 1 per input
+of the second pass, times at most sqrt(8) through it, plus under 1 at the end
+*/
+#define MAX_SCALAR_ERROR 3.83
+/* Against the exact transform only float rounding remains */
+#define MAX_EXACT_ERROR 0.01
+
+void exactDct(const float *in, double *out)
+{
+    for (size_t v = 0; v < JPEG_DCT_SIZE; v++) {
+        for (size_t u = 0; u < JPEG_DCT_SIZE; u++) {
+            double sum = 0;
+            for (size_t y = 0; y < JPEG_DCT_SIZE; y++) {
+                for (size_t x = 0; x < JPEG_DCT_SIZE; x++) {
+                    sum += in[y * JPEG_DCT_SIZE + x] *
+                        std::cos((2 * x + 1) * u * M_PI / 16) *
+                        std::cos((2 * y + 1) * v * M_PI / 16);
+                }
+            }
+            double cu = (u == 0) ? M_SQRT1_2 : 1;
+            double cv = (v == 0) ? M_SQRT1_2 : 1;
+            out[v * JPEG_DCT_SIZE + u] = sum * cu * cv / 4;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    static float input[NUM_BLOCKS][JPEG_BLOCK_SIZE];
+    static float output[NUM_BLOCKS][JPEG_BLOCK_SIZE];
+    static Jpeg::dct_t scalar[NUM_BLOCKS][JPEG_BLOCK_SIZE];
+    srand(1);
+    for (size_t n = 0; n < NUM_BLOCKS; n++) {
+        /* Mix of noise and smooth ramps so both ends of the spectrum are exercised */
+        int slope = rand() % 33 - 16;
+        for (size_t i = 0; i < JPEG_BLOCK_SIZE; i++) {
+            int sample = (n % 2) ?
+                rand() % 256 - 128 :
+                std::max(-128, std::min(127, (int)(i % 8) * slope + (int)(i / 8) * 4 - 16));
+            input[n][i] = sample;
+            scalar[n][i] = sample;
+        }
+        Jpeg::forwardDctScalar(scalar[n]);
+    }
+
+    int failures = 0;
+    for (int level = Jpeg::SIMD_NONE; level <= Jpeg::detectSimd(); level++) {
+        std::copy(&input[0][0], &input[0][0] + NUM_BLOCKS * JPEG_BLOCK_SIZE, &output[0][0]);
+        Jpeg::forwardDct(output, NUM_BLOCKS, (Jpeg::SimdLevel)level);
+        double maxScalar = 0, maxExact = 0;
+        for (size_t n = 0; n < NUM_BLOCKS; n++) {
+            double exact[JPEG_BLOCK_SIZE];
+            if (n < NUM_BLOCKS / 16) {
+                exactDct(input[n], exact);
+            }
+            for (size_t i = 0; i < JPEG_BLOCK_SIZE; i++) {
+                maxScalar = std::max(maxScalar, std::abs((double)output[n][i] - scalar[n][i]));
+                if (n < NUM_BLOCKS / 16) {
+                    maxExact = std::max(maxExact, std::abs(output[n][i] - exact[i]));
+                }
+            }
+        }
+        bool pass = maxScalar <= MAX_SCALAR_ERROR && maxExact <= MAX_EXACT_ERROR;
+        std::cout << "SIMD level " << level <<
+            ": max error vs scalar " << maxScalar <<
+            ", vs exact " << maxExact <<
+            (pass ? " ok" : " FAIL") << std::endl;
+        if (!pass) {
+            failures++;
+        }
+    }
+    return failures ? 1 : 0;
+}
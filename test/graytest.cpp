@@ -0,0 +1,79 @@
+/*
+graytest.cpp
+Checks the grayscale path against gray RGB input and that only the
+luminance tables are written
+*/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include "jpegutil.hpp"
+
+#define W 203
+#define H 117
+#define STRIDE (W + 13)
+
+/*
+Number of segments with the given marker before the scan
+*/
+int countSegments(const std::string& data, std::uint8_t marker)
+{
+    int count = 0;
+    for (size_t i = 2; i + 3 < data.size(); ) {
+        const std::uint8_t *segment = reinterpret_cast<const std::uint8_t*>(data.data() + i);
+        if (segment[0] != 0xFF || segment[1] == 0xDA) {
+            break;
+        }
+        count += segment[1] == marker;
+        i += 2 + (segment[2] << 8 | segment[3]);
+    }
+    return count;
+}
+
+int main(int argc, char **argv) {
+    static std::uint8_t gray[STRIDE * H];
+    static std::uint8_t rgb[W * H * 3];
+    srand(1);
+    for (size_t y = 0; y < H; y++) {
+        for (size_t x = 0; x < W; x++) {
+            std::uint8_t v = (x + y) % 2 == 0 ? x ^ y : rand() % 256;
+            gray[y * STRIDE + x] = v;
+            std::fill(rgb + (y * W + x) * 3, rgb + (y * W + x) * 3 + 3, v);
+        }
+    }
+
+    int failures = 0;
+    const int flagSets[2] = {Jpeg::flagHuffmanDefault, Jpeg::flagHuffmanOptimal | Jpeg::flagKeepCoefficients};
+    for (int f = 0; f < 2; f++) {
+        Jpeg::JpegSettings settings(std::pair<int, int>(W, H), &Jpeg::grayscaleComponents,
+            Jpeg::DPI, {1, 1}, 80, flagSets[f]);
+        Jpeg::Jpeg jpeg(settings);
+        std::stringstream fromGray, fromRgb;
+        jpeg.encode(Jpeg::JpegPixels(gray, Jpeg::PIXEL_GRAY, STRIDE));
+        jpeg.write(fromGray);
+        jpeg.encodeRGB(rgb);
+        jpeg.write(fromRgb);
+
+        /* Sampling factors of a lone component make no difference */
+        std::vector<Jpeg::JpegComponent> sampled(1, Jpeg::JpegComponent(std::pair<int, int>(2, 2), 0, 0, 0));
+        Jpeg::JpegSettings sampledSettings(std::pair<int, int>(W, H), &sampled,
+            Jpeg::DPI, {1, 1}, 80, flagSets[f]);
+        Jpeg::Jpeg sampledJpeg(sampledSettings);
+        std::stringstream fromSampled;
+        sampledJpeg.encode(Jpeg::JpegPixels(gray, Jpeg::PIXEL_GRAY, STRIDE));
+        sampledJpeg.write(fromSampled);
+
+        std::string data = fromGray.str();
+        bool same = data == fromRgb.str() && data == fromSampled.str();
+        bool tables = countSegments(data, 0xDB) == 1 && countSegments(data, 0xC4) == 2;
+        std::cout << "flags " << flagSets[f] << ": " << (same ? "matches gray RGB" : "DIFFERS from gray RGB") <<
+            ", " << (tables ? "luminance tables only" : "WRONG TABLES") << std::endl;
+        if (!same || !tables) {
+            failures++;
+        }
+    }
+    return failures ? 1 : 0;
+}
@@ -25,8 +25,11 @@ int main(int argc, char **argv) {
     size_t w = W, h = H;
     int quality = 50;
     bool optimize = false;
+    size_t streamRows = 0;
+    int resetInterval = 0;
+    bool parallel = false;
     int c;
-    while ((c = getopt(argc, argv, "w:h:oq:")) != -1) {
+    while ((c = getopt(argc, argv, "w:h:oq:s:r:p")) != -1) {
         switch (c) {
             case 'w':
                 w = atoi(optarg);
@@ -40,6 +43,15 @@ int main(int argc, char **argv) {
             case 'q':
                 quality = atoi(optarg);
                 break;
+            case 's':
+                streamRows = atoi(optarg);
+                break;
+            case 'r':
+                resetInterval = atoi(optarg);
+                break;
+            case 'p':
+                parallel = true;
+                break;
         }
     }
     Jpeg::JpegSettings settings(
@@ -49,10 +61,13 @@ int main(int argc, char **argv) {
         {1, 1},
         quality
     );
+    settings.resetInterval = resetInterval;
     if (optimize) {
         settings.compressionFlags = Jpeg::flagHuffmanOptimal;
     }
-    Jpeg::Jpeg img(settings);
+    if (parallel) {
+        settings.compressionFlags |= Jpeg::flagParallelEntropy;
+    }
     std::uint8_t *rgb = new std::uint8_t[w * h * 3]{0};
     
     float x0 = (float)rand() / RAND_MAX * w;
@@ -69,9 +84,21 @@ int main(int argc, char **argv) {
         }
     }
     
-    img.encodeRGB((rgb));
     std::ofstream ss("test.jpeg", std::ios_base::out | std::ios_base::binary);
-    img.write(ss);
+    if (streamRows > 0) {
+        /* Feed the image a few rows at a time */
+        Jpeg::JpegStream stream(settings);
+        stream.beginFrame(ss);
+        for (size_t y = 0; y < h; y += streamRows) {
+            stream.pushRows(rgb + y * w * 3, std::min(streamRows, h - y));
+        }
+        stream.finish();
+    }
+    else {
+        Jpeg::Jpeg img(settings);
+        img.encodeRGB((rgb));
+        img.write(ss);
+    }
     ss.close();
     delete[] rgb;
     return 0;
@@ -0,0 +1,103 @@
+/*
+paralleltest.cpp
+Checks that Huffman coding on several threads writes exactly the bytes of
+the serial coder
+*/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "jpegutil.hpp"
+#include "check.hpp"
+
+/*
+Noise over a gradient, busy enough that the scan is mostly long codes,
+or pure noise
+*/
+std::vector<std::uint8_t> image(int width, int height, int channels, bool noise)
+{
+    std::vector<std::uint8_t> pixels((size_t)width * height * channels);
+    for (size_t i = 0; i < pixels.size(); i++) {
+        pixels[i] = noise ? rand() % 256 : (i / channels % width + i / channels / width) / 4 + rand() % 64;
+    }
+    return pixels;
+}
+
+/*
+The same encode written serially and with flagParallelEntropy
+*/
+bool parallelMatches(const std::vector<Jpeg::JpegComponent> *components, int width, int height,
+    int resetInterval, int flags, bool noise = false, int quality = 90)
+{
+    int channels = components == &Jpeg::grayscaleComponents ? 1 : 3;
+    std::vector<std::uint8_t> pixels = image(width, height, channels, noise);
+    std::string outputs[2];
+    for (int parallel = 0; parallel < 2; parallel++) {
+        Jpeg::JpegSettings settings(std::pair<int, int>(width, height), components, Jpeg::DPI, {72, 72}, quality,
+            flags | (parallel ? Jpeg::flagParallelEntropy : 0));
+        settings.resetInterval = resetInterval;
+        Jpeg::Jpeg jpeg(settings);
+        jpeg.encode(Jpeg::JpegPixels(pixels.data(), channels == 1 ? Jpeg::PIXEL_GRAY : Jpeg::PIXEL_RGB));
+        std::stringstream out;
+        jpeg.write(out);
+        outputs[parallel] = out.str();
+    }
+    return outputs[0] == outputs[1];
+}
+
+int main(int argc, char **argv) {
+#ifndef _OPENMP
+    check(false, "built with OpenMP");
+#else
+    srand(1);
+    omp_set_num_threads(4);
+    check(omp_get_max_threads() >= 2, "several threads");
+
+    /* Every interval on a thread of its own, with a short last interval */
+    for (int resetInterval : {1, 3, 7, 64}) {
+        check(parallelMatches(nullptr, 333, 211, resetInterval, Jpeg::flagHuffmanDefault) &&
+            parallelMatches(nullptr, 333, 211, resetInterval, Jpeg::flagHuffmanOptimal) &&
+            parallelMatches(&Jpeg::grayscaleComponents, 250, 90, resetInterval, Jpeg::flagHuffmanOptimal),
+            "reset interval " + std::to_string(resetInterval));
+    }
+
+    /*
+    Without restart markers, runs of 256 MCUs or more are coded apart and
+    stitched at bit offsets, up to four runs a thread: these sizes make
+    odd numbers of runs, and the largest hits the limit
+    */
+    struct Case {
+        const std::vector<Jpeg::JpegComponent> *components;
+        int width, height, threads, pieces;
+    };
+    const Case cases[] = {
+        {&Jpeg::grayscaleComponents, 256, 200, 4, 3},
+        {&Jpeg::grayscaleComponents, 256, 330, 4, 5},
+        {&Jpeg::grayscaleComponents, 256, 460, 4, 7},
+        {&Jpeg::grayscaleComponents, 256, 720, 3, 11},
+        {&Jpeg::grayscaleComponents, 256, 1300, 4, 16},
+        {nullptr, 500, 700, 4, 5},
+        {nullptr, 500, 1000, 2, 7},
+    };
+    for (const Case& c : cases) {
+        omp_set_num_threads(c.threads);
+        check(parallelMatches(c.components, c.width, c.height, 0, Jpeg::flagHuffmanDefault) &&
+            parallelMatches(c.components, c.width, c.height, 0, Jpeg::flagHuffmanOptimal),
+            std::to_string(c.width) + "x" + std::to_string(c.height) + " in " + std::to_string(c.pieces) + " runs");
+    }
+
+    /* With this seed a byte shared by two runs is 0xFF, so it is stuffed at the seam */
+    srand(3);
+    omp_set_num_threads(4);
+    check(parallelMatches(&Jpeg::grayscaleComponents, 256, 1300, 0, Jpeg::flagHuffmanOptimal, true, 100) &&
+        parallelMatches(&Jpeg::grayscaleComponents, 256, 1300, 0, Jpeg::flagHuffmanDefault, true, 100),
+        "0xFF where runs meet");
+#endif
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,81 @@
+/*
+providedtest.cpp
+Checks that provided Huffman codes are used as given, and refused when
+they leave out a table or a symbol the image needs
+*/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include "jpegutil.hpp"
+#include "check.hpp"
+
+#define W 203
+#define H 117
+
+/*
+Written with the given codes, or empty if the encoder refused them
+*/
+std::string written(const std::uint8_t *rgb, int flags, const Jpeg::codes_t *codes)
+{
+    Jpeg::JpegSettings settings(std::pair<int, int>(W, H), nullptr, Jpeg::DPI, {72, 72}, 90, flags);
+    if (codes != nullptr) {
+        settings.huffmanCodes = *codes;
+    }
+    Jpeg::Jpeg jpeg(settings);
+    jpeg.encodeRGB(rgb);
+    std::stringstream out;
+    try {
+        jpeg.write(out);
+    } catch (const Jpeg::JpegEncodingException&) {
+        return std::string();
+    }
+    return out.str();
+}
+
+bool streamRefuses(const std::uint8_t *rgb, const Jpeg::codes_t& codes)
+{
+    Jpeg::JpegSettings settings(std::pair<int, int>(W, H), nullptr, Jpeg::DPI, {72, 72}, 90,
+        Jpeg::flagHuffmanProvided);
+    settings.huffmanCodes = codes;
+    Jpeg::JpegStream stream(settings);
+    std::stringstream out;
+    try {
+        stream.beginFrame(out);
+        stream.pushRows(rgb, H);
+        stream.finish();
+    } catch (const Jpeg::JpegEncodingException&) {
+        return true;
+    }
+    return false;
+}
+
+int main(int argc, char **argv) {
+    /* A flat image only needs DC difference 0 and end of block */
+    static std::uint8_t flat[W * H * 3], busy[W * H * 3];
+    srand(1);
+    for (size_t i = 0; i < W * H * 3; i++) {
+        flat[i] = 128;
+        busy[i] = (i / 3 % W + i / 3 / W) * (i % 3 + 1) / 2 + rand() % 48;
+    }
+
+    Jpeg::JpegSettings settings(std::pair<int, int>(W, H), nullptr, Jpeg::DPI, {72, 72}, 90,
+        Jpeg::flagHuffmanOptimal);
+    Jpeg::Jpeg jpeg(settings);
+    jpeg.encodeRGB(flat);
+    std::stringstream out;
+    jpeg.write(out);
+    Jpeg::codes_t codes = jpeg.settings.huffmanCodes;
+
+    check(written(flat, Jpeg::flagHuffmanProvided, &codes) == out.str(), "codes covering the image");
+    check(written(busy, Jpeg::flagHuffmanProvided, &codes).empty(), "codes lacking a symbol throw");
+    check(streamRefuses(busy, codes), "stream with codes lacking a symbol throws");
+
+    Jpeg::codes_t missingAc = codes;
+    missingAc.second.pop_back();
+    check(written(flat, Jpeg::flagHuffmanProvided, &missingAc).empty(), "missing AC table throws");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,61 @@
+/*
+reoptimizetest.cpp
+Checks that reoptimizing a file written with the default codes gives the
+file an optimal encode of the same image would have
+*/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include "jpegutil.hpp"
+
+#define W 203
+#define H 117
+
+std::string encoded(const std::uint8_t *rgb, const std::vector<Jpeg::JpegComponent> *components,
+    int flags, int resetInterval)
+{
+    Jpeg::JpegSettings settings(std::pair<int, int>(W, H), components, Jpeg::DPI, {72, 72}, 85, flags);
+    settings.resetInterval = resetInterval;
+    Jpeg::Jpeg jpeg(settings);
+    jpeg.encodeRGB(rgb);
+    std::stringstream out;
+    jpeg.write(out);
+    return out.str();
+}
+
+std::string reoptimized(const std::string& data)
+{
+    std::stringstream in(data), out;
+    Jpeg::reoptimize(in, out);
+    return out.str();
+}
+
+int main(int argc, char **argv) {
+    static std::uint8_t rgb[W * H * 3];
+    srand(1);
+    for (size_t i = 0; i < W * H * 3; i++) {
+        rgb[i] = (i / 3 % W + i / 3 / W) * (i % 3 + 1) / 2 + rand() % 24;
+    }
+
+    int failures = 0;
+    const std::vector<Jpeg::JpegComponent> *componentSets[2] = {nullptr, &Jpeg::grayscaleComponents};
+    const char *names[2] = {"color", "gray"};
+    for (int c = 0; c < 2; c++) {
+        for (int resetInterval = 0; resetInterval < 8; resetInterval += 7) {
+            std::string original = encoded(rgb, componentSets[c], Jpeg::flagHuffmanDefault, resetInterval);
+            std::string optimal = encoded(rgb, componentSets[c], Jpeg::flagHuffmanOptimal, resetInterval);
+            std::string data = reoptimized(original);
+            bool same = data == optimal && reoptimized(data) == data;
+            std::cout << names[c] << ", reset interval " << resetInterval << ": " << original.size() <<
+                " -> " << data.size() << " bytes, " << (same ? "matches an optimal encode" : "DIFFERS") << std::endl;
+            if (!same || data.size() >= original.size()) {
+                failures++;
+            }
+        }
+    }
+    return failures ? 1 : 0;
+}
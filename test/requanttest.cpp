@@ -0,0 +1,74 @@
+/*
+requanttest.cpp
+Checks that requantizing kept coefficients matches encoding from scratch
+*/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <cstdint>
+#include <cstdlib>
+#include "jpegutil.hpp"
+
+#define W 203
+#define H 117
+
+std::string encodeAt(const std::uint8_t *rgb, int quality, int flags)
+{
+    Jpeg::JpegSettings settings(std::pair<int, int>(W, H), nullptr, Jpeg::DPI, {1, 1}, quality, flags);
+    Jpeg::Jpeg jpeg(settings);
+    jpeg.encodeRGB(rgb);
+    std::stringstream out;
+    jpeg.write(out);
+    return out.str();
+}
+
+int main(int argc, char **argv) {
+    static std::uint8_t rgb[W * H * 3];
+    srand(1);
+    for (size_t y = 0; y < H; y++) {
+        for (size_t x = 0; x < W; x++) {
+            std::uint8_t *pixel = rgb + (y * W + x) * 3;
+            pixel[0] = x + y;
+            pixel[1] = (x * y) >> 4;
+            pixel[2] = rand() % 64 + 96;
+        }
+    }
+
+    int failures = 0;
+    const int flagSets[2] = {Jpeg::flagHuffmanDefault, Jpeg::flagHuffmanOptimal};
+    for (int f = 0; f < 2; f++) {
+        int flags = flagSets[f] | Jpeg::flagKeepCoefficients;
+        Jpeg::JpegSettings settings(std::pair<int, int>(W, H), nullptr, Jpeg::DPI, {1, 1}, 50, flags);
+        Jpeg::Jpeg kept(settings);
+        kept.encodeRGB(rgb);
+
+        const int qualities[5] = {5, 35, 50, 80, 100};
+        for (int i = 0; i < 5; i++) {
+            kept.requantize(qualities[i]);
+            std::stringstream first, second;
+            kept.write(first);
+            kept.write(second);
+            bool same = first.str() == encodeAt(rgb, qualities[i], flags);
+            bool repeatable = first.str() == second.str();
+            std::cout << "flags " << flags << ", quality " << qualities[i] << ": " <<
+                (same ? "matches" : "DIFFERS from") << " a fresh encode, " <<
+                (repeatable ? "rewrites the same" : "REWRITES DIFFERENTLY") << std::endl;
+            if (!same || !repeatable) {
+                failures++;
+            }
+        }
+
+        size_t budget = encodeAt(rgb, 70, flags).size();
+        std::stringstream target;
+        int quality = kept.writeTargetSize(target, budget);
+        bool fits = target.str().size() <= budget &&
+            (quality == 100 || encodeAt(rgb, quality + 1, flags).size() > budget);
+        std::cout << "flags " << flags << ", " << budget << " byte budget: quality " << quality <<
+            ", " << target.str().size() << " bytes" << (fits ? " ok" : " FAIL") << std::endl;
+        if (!fits) {
+            failures++;
+        }
+    }
+    return failures ? 1 : 0;
+}
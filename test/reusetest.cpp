@@ -0,0 +1,244 @@
+/*
+reusetest.cpp
+Checks that a reused Jpeg stops allocating once warmed up, and that
+moving or resetting it leaves output unchanged
+*/
+
+#include <iostream>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <new>
+#include <cstdint>
+#include <cstdlib>
+#include "jpegutil.hpp"
+
+#define W 320
+#define H 240
+
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+    allocations++;
+    if (void *p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+/* Temporary buffers of the library come from the nothrow forms */
+void *operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    allocations++;
+    return std::malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t& tag) noexcept
+{
+    return operator new(size, tag);
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t&) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t&) noexcept
+{
+    std::free(p);
+}
+
+/* Blocks come from the aligned forms, which must be counted and freed alike */
+void *operator new(size_t size, std::align_val_t align)
+{
+    allocations++;
+    size_t alignment = static_cast<size_t>(align);
+    if (void *p = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size, std::align_val_t align)
+{
+    return operator new(size, align);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p, size_t, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+/*
+Fixed buffer to write into, so the stream itself never allocates
+*/
+class FixedBuffer : public std::streambuf {
+    public:
+        FixedBuffer(char *data, size_t size)
+        {
+            setp(data, data + size);
+        }
+        size_t size() const
+        {
+            return pptr() - pbase();
+        }
+        void rewind()
+        {
+            setp(pbase(), epptr());
+        }
+};
+
+void fillFrame(std::uint8_t *rgb, int width, int height, int frame)
+{
+    for (size_t i = 0; i < width * height * 3; i++) {
+        rgb[i] = (i / 3 % width * 2 + i / 3 / width + frame * 7 + i % 3 * 50) % 256;
+    }
+}
+
+std::string encodeFresh(const Jpeg::JpegSettings& settings, const std::uint8_t *rgb)
+{
+    Jpeg::Jpeg jpeg(settings);
+    jpeg.encodeRGB(rgb);
+    std::stringstream out;
+    jpeg.write(out);
+    return out.str();
+}
+
+int main(int argc, char **argv) {
+    static std::uint8_t rgb[W * H * 3];
+    static char data[1 << 20];
+    FixedBuffer buffer(data, sizeof(data));
+    std::ostream out(&buffer);
+    int failures = 0;
+
+    Jpeg::JpegSettings settings(std::pair<int, int>(W, H));
+    Jpeg::Jpeg jpeg(settings);
+    for (int frame = 0; frame < 3; frame++) {
+        fillFrame(rgb, W, H, frame);
+        buffer.rewind();
+        jpeg.encodeRGB(rgb);
+        jpeg.write(out);
+    }
+    size_t before = allocations;
+    for (int frame = 3; frame < 13; frame++) {
+        fillFrame(rgb, W, H, frame);
+        buffer.rewind();
+        jpeg.encodeRGB(rgb);
+        jpeg.write(out);
+    }
+    size_t steady = allocations - before;
+    std::cout << "Allocations over 10 warm frames: " << steady << std::endl;
+    if (steady != 0) {
+        failures++;
+    }
+    std::string last(data, buffer.size());
+    if (last != encodeFresh(settings, rgb)) {
+        std::cout << "Reused encoder differs from a fresh one" << std::endl;
+        failures++;
+    }
+
+    /* A moved encoder keeps its frame and buffers */
+    Jpeg::coef_t (*blocks)[JPEG_BLOCK_SIZE] = jpeg.blocks;
+    Jpeg::Jpeg moved(std::move(jpeg));
+    std::stringstream movedOut;
+    moved.write(movedOut);
+    bool movedOk = moved.blocks == blocks && jpeg.blocks == nullptr && movedOut.str() == last;
+    std::cout << "Move " << (movedOk ? "ok" : "FAILED") << std::endl;
+    if (!movedOk) {
+        failures++;
+    }
+
+    /* What is left behind can still be copied */
+    Jpeg::Jpeg copied(jpeg);
+    bool copiedOk = copied.blocks == nullptr && copied.blockCapacity == 0;
+    std::cout << "Copy of a moved-from encoder " << (copiedOk ? "ok" : "FAILED") << std::endl;
+    if (!copiedOk) {
+        failures++;
+    }
+
+    /* A smaller frame fits in the same blocks */
+    Jpeg::JpegSettings smaller(std::pair<int, int>(W / 2, H / 3), nullptr, Jpeg::DPI, {1, 1}, 80, Jpeg::flagHuffmanOptimal);
+    moved.reset(smaller);
+    fillFrame(rgb, W / 2, H / 3, 0);
+    moved.encodeRGB(rgb);
+    std::stringstream resetOut;
+    moved.write(resetOut);
+    bool resetOk = moved.blocks == blocks && resetOut.str() == encodeFresh(smaller, rgb);
+    std::cout << "Reset to a smaller frame " << (resetOk ? "ok" : "FAILED") << std::endl;
+    if (!resetOk) {
+        failures++;
+    }
+
+    /* And back to the first settings */
+    moved.reset(settings);
+    fillFrame(rgb, W, H, 12);
+    moved.encodeRGB(rgb);
+    std::stringstream backOut;
+    moved.write(backOut);
+    if (backOut.str() != last) {
+        std::cout << "Reset back to the first settings differs" << std::endl;
+        failures++;
+    }
+
+    /* A stream reuses its stripe scratch from frame to frame */
+    Jpeg::JpegStream stream(settings);
+    for (int frame = 0; frame < 7; frame++) {
+        if (frame == 2) {
+            before = allocations;
+        }
+        fillFrame(rgb, W, H, frame);
+        buffer.rewind();
+        stream.beginFrame(out);
+        for (size_t y = 0; y < H; y += 40) {
+            stream.pushRows(rgb + y * W * 3, 40);
+        }
+        stream.finish();
+    }
+    steady = allocations - before;
+    std::cout << "Stream allocations over 5 warm frames: " << steady << std::endl;
+    if (steady != 0) {
+        failures++;
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,72 @@
+/*
+scaletest.cpp
+Checks the frame sizes of reduced copies and the JFIF thumbnail
+*/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <cstdint>
+#include <cstdlib>
+#include "jpegutil.hpp"
+
+#define W 203
+#define H 117
+
+/*
+Width and height from the SOF0 segment, -1 by -1 if there is none
+*/
+std::pair<int, int> frameSize(const std::string& data)
+{
+    for (size_t i = 2; i + 9 < data.size(); ) {
+        const std::uint8_t *segment = reinterpret_cast<const std::uint8_t*>(data.data() + i);
+        if (segment[0] != 0xFF) {
+            break;
+        }
+        if (segment[1] == 0xC0) {
+            return std::pair<int, int>(segment[7] << 8 | segment[8], segment[5] << 8 | segment[6]);
+        }
+        i += 2 + (segment[2] << 8 | segment[3]);
+    }
+    return std::pair<int, int>(-1, -1);
+}
+
+int main(int argc, char **argv) {
+    /* Flat color, so the thumbnail must come out the same color */
+    const std::uint8_t color[3] = {200, 90, 30};
+    static std::uint8_t rgb[W * H * 3];
+    for (size_t i = 0; i < W * H; i++) {
+        std::copy(color, color + 3, rgb + i * 3);
+    }
+
+    int failures = 0;
+    const int flagSets[2] = {Jpeg::flagHuffmanDefault, Jpeg::flagHuffmanOptimal | Jpeg::flagKeepCoefficients};
+    for (int f = 0; f < 2; f++) {
+        Jpeg::JpegSettings settings(std::pair<int, int>(W, H), nullptr, Jpeg::DPI, {1, 1}, 90, flagSets[f]);
+        settings.thumbnailSize = 40;
+        Jpeg::Jpeg jpeg(settings);
+        jpeg.encodeRGB(rgb);
+        for (int scale = 1; scale <= 8; scale *= 2) {
+            std::stringstream out;
+            jpeg.writeReduced(out, scale);
+            std::string data = out.str();
+            std::pair<int, int> size = frameSize(data);
+            bool sized = size.first == (W + scale - 1) / scale && size.second == (H + scale - 1) / scale;
+            /* APP0 follows SOI, the thumbnail size is at 18 and its pixels at 20 */
+            const std::uint8_t *app0 = reinterpret_cast<const std::uint8_t*>(data.data());
+            int thumbWidth = app0[18], thumbHeight = app0[19];
+            bool thumbnail = (app0[4] << 8 | app0[5]) == 16 + 3 * thumbWidth * thumbHeight &&
+                std::max(thumbWidth, thumbHeight) == std::min(40, std::max(size.first, size.second));
+            for (int i = 0; thumbnail && i < thumbWidth * thumbHeight * 3; i++) {
+                thumbnail = std::abs(app0[20 + i] - color[i % 3]) <= 2;
+            }
+            std::cout << "flags " << flagSets[f] << ", 1/" << scale << ": " <<
+                size.first << "x" << size.second << (sized ? " ok" : " WRONG SIZE") << ", thumbnail " <<
+                thumbWidth << "x" << thumbHeight << (thumbnail ? " ok" : " WRONG") << std::endl;
+            if (!sized || !thumbnail) {
+                failures++;
+            }
+        }
+    }
+    return failures ? 1 : 0;
+}
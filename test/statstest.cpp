@@ -0,0 +1,104 @@
+/*
+statstest.cpp
+Checks what encodes report through JpegEncodeStats: everything with
+JPEG_STATS, nothing at all without it
+*/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <cstdint>
+#include <cstdlib>
+#include "jpegutil.hpp"
+#include "check.hpp"
+
+#define W 203
+#define H 117
+
+void countCalls(Jpeg::JpegStage stage, double wallSeconds, double cpuSeconds, void *context)
+{
+    static_cast<int*>(context)[stage]++;
+}
+
+/*
+Bytes of entropy coded data between SOS and EOI, less the stuffed zeros
+*/
+size_t scanBytes(const std::string& data)
+{
+    size_t i = 2;
+    while (static_cast<std::uint8_t>(data[i + 1]) != 0xDA) {
+        i += 2 + ((std::uint8_t)data[i + 2] << 8 | (std::uint8_t)data[i + 3]);
+    }
+    i += 2 + ((std::uint8_t)data[i + 2] << 8 | (std::uint8_t)data[i + 3]);
+    size_t count = 0;
+    for (; i < data.size() - 2; i++) {
+        count += !(data[i] == 0 && static_cast<std::uint8_t>(data[i - 1]) == 0xFF);
+    }
+    return count;
+}
+
+int main(int argc, char **argv) {
+    static std::uint8_t rgb[W * H * 3];
+    srand(1);
+    for (size_t i = 0; i < W * H * 3; i++) {
+        /* Flat mid gray on the left, whose blocks are all zero */
+        rgb[i] = i / 3 % W < W / 2 ? 128 : rand() % 256;
+    }
+
+    Jpeg::JpegSettings settings(std::pair<int, int>(W, H), nullptr, Jpeg::DPI, {1, 1}, 75,
+        Jpeg::flagHuffmanOptimal);
+    Jpeg::Jpeg jpeg(settings);
+    Jpeg::JpegEncodeStats stats;
+    int calls[JPEG_STAGES] = {0};
+    stats.hook = countCalls;
+    stats.hookContext = calls;
+    jpeg.stats = &stats;
+    jpeg.encodeRGB(rgb);
+    std::stringstream out;
+    jpeg.write(out);
+    std::string data = out.str();
+
+#ifdef JPEG_STATS
+    /* Symbols were counted by the encode, so write had none to count */
+    check(calls[Jpeg::STAGE_ENCODE] == 1 && calls[Jpeg::STAGE_SYMBOLS] == 0 && calls[Jpeg::STAGE_HUFFMAN] == 1 &&
+        calls[Jpeg::STAGE_HEADERS] == 1 && calls[Jpeg::STAGE_ENTROPY] == 1, "hook called once per stage run");
+    check(stats.wallSeconds[Jpeg::STAGE_ENCODE] > 0 && stats.wallSeconds[Jpeg::STAGE_SYMBOLS] == 0,
+        "stage times");
+    std::uint64_t bits = 0, symbols = 0, tableSymbols = 0;
+    bool counts = stats.components.size() == 3;
+    for (size_t iComp = 0; iComp < stats.components.size(); iComp++) {
+        const Jpeg::JpegComponentStats& comp = stats.components[iComp];
+        const std::pair<int, int>& sampling = jpeg.settings.components[iComp].sampling;
+        bits += comp.bits;
+        symbols += comp.dcSymbols + comp.acSymbols;
+        counts = counts && comp.blocks == (std::uint64_t)jpeg.settings.numMcus.first * jpeg.settings.numMcus.second *
+            sampling.first * sampling.second && comp.dcSymbols == comp.blocks &&
+            comp.zeroBlocks > 0 && comp.zeroBlocks <= comp.eobOnlyBlocks && comp.eobOnlyBlocks < comp.blocks;
+    }
+    for (int table = 0; table < 2; table++) {
+        const std::vector<Jpeg::JpegHistogram>& histograms = table == 0 ? stats.symbols.first : stats.symbols.second;
+        for (auto it = histograms.begin(); it != histograms.end(); it++) {
+            for (size_t i = 0; i < 256; i++) {
+                tableSymbols += it->counts[i];
+            }
+        }
+    }
+    check(counts && symbols == tableSymbols, "block and symbol counts");
+    check((bits + 7) / 8 == scanBytes(data), "bits add up to the scan");
+    check(stats.blockBytes == jpeg.blockCapacity * sizeof(*jpeg.blocks) && stats.coefficientBytes == 0,
+        "buffer sizes");
+
+    /* Without counts from an encode, write counts them itself */
+    jpeg.transform(Jpeg::TRANSFORM_ROTATE_180);
+    jpeg.settings.compressionFlags = Jpeg::flagHuffmanOptimal;
+    jpeg.write(out);
+    check(calls[Jpeg::STAGE_SYMBOLS] == 1 && calls[Jpeg::STAGE_ENCODE] == 1, "symbols counted by write");
+#else
+    bool untouched = stats.components.empty() && stats.blockBytes == 0;
+    for (int stage = 0; stage < JPEG_STAGES; stage++) {
+        untouched = untouched && calls[stage] == 0 && stats.wallSeconds[stage] == 0 && stats.cpuSeconds[stage] == 0;
+    }
+    check(untouched, "nothing measured without JPEG_STATS");
+#endif
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,74 @@
+/*
+streamtest.cpp
+Checks that images pushed to a JpegStream in rows of any count give the
+bytes of the same image encoded whole
+*/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include "jpegutil.hpp"
+#include "check.hpp"
+
+#define W 203
+#define H 117
+
+std::string whole(const Jpeg::JpegSettings& settings, const std::uint8_t *rgb)
+{
+    Jpeg::Jpeg jpeg(settings);
+    jpeg.encodeRGB(rgb);
+    std::stringstream out;
+    jpeg.write(out);
+    return out.str();
+}
+
+/*
+Pushed split rows at a time, the last push taking what is left
+*/
+std::string streamed(Jpeg::JpegStream& stream, const std::uint8_t *rgb, size_t split)
+{
+    std::stringstream out;
+    stream.beginFrame(out);
+    for (size_t y = 0; y < H; y += split) {
+        stream.pushRows(rgb + y * W * 3, std::min(split, H - y));
+    }
+    stream.finish();
+    return out.str();
+}
+
+int main(int argc, char **argv) {
+    static std::uint8_t rgb[W * H * 3];
+    srand(1);
+    for (size_t i = 0; i < W * H * 3; i++) {
+        rgb[i] = (i / 3 % W + i / 3 / W) * (i % 3 + 1) / 2 + rand() % 48;
+    }
+
+    std::vector<Jpeg::JpegComponent> yuv444 = {
+        Jpeg::JpegComponent(std::pair<int, int>(1, 1), 0, 0, 0),
+        Jpeg::JpegComponent(std::pair<int, int>(1, 1), 1, 1, 1),
+        Jpeg::JpegComponent(std::pair<int, int>(1, 1), 1, 1, 1)
+    };
+    const std::vector<Jpeg::JpegComponent> *componentSets[2] = {nullptr, &yuv444};
+    const char *names[2] = {"4:2:0", "4:4:4"};
+    for (int c = 0; c < 2; c++) {
+        for (int resetInterval : {0, 5}) {
+            Jpeg::JpegSettings settings(std::pair<int, int>(W, H), componentSets[c], Jpeg::DPI, {72, 72}, 85);
+            settings.resetInterval = resetInterval;
+            std::string expected = whole(settings, rgb);
+            for (size_t ringRows : {1, 3}) {
+                /* One stream for every split, so frames after the first reuse it */
+                Jpeg::JpegStream stream(settings, ringRows);
+                bool same = true;
+                for (size_t split : {1, 3, 7, 13, 37, 116, 117}) {
+                    same = same && streamed(stream, rgb, split) == expected;
+                }
+                check(same, std::string(names[c]) + ", reset interval " + std::to_string(resetInterval) +
+                    ", " + std::to_string(ringRows) + " MCU rows at a time");
+            }
+        }
+    }
+    return failures ? 1 : 0;
+}
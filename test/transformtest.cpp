@@ -0,0 +1,103 @@
+/*
+transformtest.cpp
+Checks that files read back write the same bytes and that rotations, flips
+and crops compose as they should
+*/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <cstdint>
+#include <cstdlib>
+#include "jpegutil.hpp"
+#include "check.hpp"
+
+#define W 128
+#define H 96
+
+std::string written(Jpeg::Jpeg& jpeg)
+{
+    std::stringstream out;
+    jpeg.write(out);
+    return out.str();
+}
+
+Jpeg::Jpeg read(const std::string& data)
+{
+    std::stringstream in(data);
+    return Jpeg::readJpeg(in);
+}
+
+/*
+Written with the default codes, which have every symbol, so that moved
+blocks compare byte for byte
+*/
+std::string transformed(const std::string& data, Jpeg::JpegTransform op)
+{
+    Jpeg::Jpeg jpeg = read(data);
+    jpeg.transform(op);
+    jpeg.settings.compressionFlags = Jpeg::flagHuffmanDefault;
+    return written(jpeg);
+}
+
+int main(int argc, char **argv) {
+    static std::uint8_t rgb[W * H * 3];
+    srand(1);
+    for (size_t i = 0; i < W * H * 3; i++) {
+        rgb[i] = (i / 3 % W) * (i % 3 + 1) + rand() % 32;
+    }
+
+    Jpeg::JpegSettings settings(std::pair<int, int>(W, H), nullptr, Jpeg::DPI, {1, 1}, 75,
+        Jpeg::flagHuffmanOptimal);
+    settings.resetInterval = 5;
+    settings.extraSegments.push_back(std::string("\xFF\xFE\x00\x07note", 9));
+    Jpeg::Jpeg jpeg(settings);
+    jpeg.encodeRGB(rgb);
+    std::string original = written(jpeg);
+    Jpeg::Jpeg parsed = read(original);
+    check(written(parsed) == original, "read and written again");
+
+    parsed.settings.compressionFlags = Jpeg::flagHuffmanDefault;
+    std::string base = written(parsed);
+    std::string turned = base;
+    for (int i = 0; i < 4; i++) {
+        turned = transformed(turned, Jpeg::TRANSFORM_ROTATE_90);
+    }
+    check(turned == base, "four quarter turns");
+    check(transformed(transformed(base, Jpeg::TRANSFORM_TRANSPOSE), Jpeg::TRANSFORM_TRANSPOSE) == base,
+        "transpose twice");
+    check(transformed(transformed(base, Jpeg::TRANSFORM_FLIP_HORIZONTAL), Jpeg::TRANSFORM_FLIP_VERTICAL) ==
+        transformed(base, Jpeg::TRANSFORM_ROTATE_180), "flips make a half turn");
+    check(transformed(transformed(base, Jpeg::TRANSFORM_ROTATE_90), Jpeg::TRANSFORM_FLIP_HORIZONTAL) ==
+        transformed(base, Jpeg::TRANSFORM_TRANSPOSE), "quarter turn and flip make a transpose");
+    check(transformed(transformed(base, Jpeg::TRANSFORM_ROTATE_90), Jpeg::TRANSFORM_FLIP_VERTICAL) ==
+        transformed(base, Jpeg::TRANSFORM_TRANSVERSE), "quarter turn and flip make a transverse");
+
+    /* Kept coefficients move with the blocks */
+    Jpeg::JpegSettings keptSettings = jpeg.settings;
+    keptSettings.compressionFlags = Jpeg::flagHuffmanDefault | Jpeg::flagKeepCoefficients;
+    Jpeg::Jpeg kept(keptSettings);
+    kept.encodeRGB(rgb);
+    kept.transform(Jpeg::TRANSFORM_ROTATE_270);
+    check(written(kept) == transformed(base, Jpeg::TRANSFORM_ROTATE_270), "encoded and read the same");
+    kept.requantize();
+    check(written(kept) == transformed(base, Jpeg::TRANSFORM_ROTATE_270), "requantized after a turn");
+
+    Jpeg::Jpeg cropped = read(base);
+    cropped.crop(std::pair<int, int>(32, 16), std::pair<int, int>(50, 40));
+    std::string croppedData = written(cropped);
+    Jpeg::Jpeg whole = read(base);
+    whole.crop(std::pair<int, int>(0, 0), std::pair<int, int>(W, H));
+    whole.settings.compressionFlags = Jpeg::flagHuffmanDefault;
+    check(written(whole) == base, "crop to the whole image");
+    check(read(croppedData).settings.size == std::pair<int, int>(50, 40), "crop size");
+
+    bool threw = false;
+    try {
+        read(base).crop(std::pair<int, int>(8, 0), std::pair<int, int>(16, 16));
+    } catch (const Jpeg::JpegEncodingException&) {
+        threw = true;
+    }
+    check(threw, "crop off an MCU boundary throws");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,82 @@
+/*
+yuvtest.cpp
+Checks that Y, Cb and Cr input encodes the same as the RGB it came from
+*/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include "jpegutil.hpp"
+
+#define W 203
+#define H 117
+#define CW ((W + 1) / 2)
+#define CH ((H + 1) / 2)
+
+int main(int argc, char **argv) {
+    static std::uint8_t rgb[W * H * 3];
+    srand(1);
+    for (size_t y = 0; y < H; y++) {
+        for (size_t x = 0; x < W; x++) {
+            std::uint8_t *pixel = rgb + (y * W + x) * 3;
+            pixel[0] = x + y;
+            pixel[1] = (x * y) >> 4;
+            pixel[2] = rand() % 64 + 96;
+        }
+    }
+
+    /* Full resolution planes, converted as encodeRGB converts */
+    static std::uint8_t full[3][W * H];
+    for (size_t y = 0; y < H; y++) {
+        Jpeg::convertRowRGB(rgb + y * W * 3, W, full[0] + y * W, full[1] + y * W, full[2] + y * W);
+    }
+    /* 4:2:0 chroma averaged over 2x2 boxes, repeating the last column and row */
+    static std::uint8_t i420[2][CW * CH];
+    std::vector<std::uint8_t> nv12(CW * 2 * CH);
+    for (size_t c = 0; c < 2; c++) {
+        for (size_t y = 0; y < CH; y++) {
+            for (size_t x = 0; x < CW; x++) {
+                int sum = 0;
+                for (size_t dy = 0; dy < 2; dy++) {
+                    for (size_t dx = 0; dx < 2; dx++) {
+                        sum += full[c + 1][std::min<size_t>(2 * y + dy, H - 1) * W + std::min<size_t>(2 * x + dx, W - 1)];
+                    }
+                }
+                i420[c][y * CW + x] = (sum + 2) / 4;
+                nv12[y * CW * 2 + x * 2 + c] = i420[c][y * CW + x];
+            }
+        }
+    }
+
+    int failures = 0;
+    const int flagSets[2] = {Jpeg::flagHuffmanDefault, Jpeg::flagHuffmanOptimal | Jpeg::flagKeepCoefficients};
+    for (int f = 0; f < 2; f++) {
+        Jpeg::JpegSettings settings(std::pair<int, int>(W, H), nullptr, Jpeg::DPI, {1, 1}, 75, flagSets[f]);
+        Jpeg::Jpeg jpeg(settings);
+        std::stringstream fromRgb;
+        jpeg.encodeRGB(rgb);
+        jpeg.write(fromRgb);
+
+        const char *names[3] = {"I420", "NV12", "4:4:4 resampled"};
+        const Jpeg::JpegYCbCr inputs[3] = {
+            Jpeg::JpegYCbCr(full[0], W, i420[0], CW, i420[1], CW),
+            Jpeg::JpegYCbCr(full[0], W, nv12.data(), CW * 2),
+            Jpeg::JpegYCbCr(full[0], W, full[1], W, full[2], W, std::pair<int, int>(1, 1))
+        };
+        for (int i = 0; i < 3; i++) {
+            std::stringstream out;
+            jpeg.encodeYCbCr(inputs[i]);
+            jpeg.write(out);
+            bool same = out.str() == fromRgb.str();
+            std::cout << "flags " << flagSets[f] << ", " << names[i] << ": " <<
+                (same ? "matches RGB" : "DIFFERS from RGB") << std::endl;
+            if (!same) {
+                failures++;
+            }
+        }
+    }
+    return failures ? 1 : 0;
+}
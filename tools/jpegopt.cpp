@@ -0,0 +1,46 @@
+/*
+jpegopt.cpp
+Rewrite baseline JPEG files with optimal Huffman codes, losslessly
+
+Usage: jpegopt input.jpg output.jpg
+Files the new codes would not shrink are copied as they are
+*/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include "jpegutil.hpp"
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " input.jpg output.jpg" << std::endl;
+        return 2;
+    }
+    std::ifstream src(argv[1], std::ios::binary);
+    if (!src) {
+        std::cerr << "Cannot open " << argv[1] << std::endl;
+        return 1;
+    }
+    std::stringstream original;
+    original << src.rdbuf();
+    std::stringstream optimized;
+    try {
+        Jpeg::reoptimize(original, optimized);
+    } catch (const Jpeg::JpegEncodingException& e) {
+        std::cerr << argv[1] << ": " << e.what() << std::endl;
+        return 1;
+    }
+
+    std::string before = original.str();
+    std::string after = optimized.str();
+    const std::string& kept = after.size() < before.size() ? after : before;
+    std::ofstream dst(argv[2], std::ios::binary);
+    dst.write(kept.data(), kept.size());
+    if (!dst) {
+        std::cerr << "Cannot write " << argv[2] << std::endl;
+        return 1;
+    }
+    std::cout << argv[1] << ": " << before.size() << " -> " << kept.size() << " bytes" << std::endl;
+    return 0;
+}